@@ -0,0 +1,150 @@
+/*
+ * Copyright 2015 Jon Mayo <jon@cobra-kai.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "atom.h"
+#include "log.h"
+
+/* atoms are interned strings shared by every thread. each name is stored
+ * once and never freed, so two atoms are equal only if their pointers are.
+ * lookups take no lock: the table is published through an atomic pointer and
+ * slots are only ever filled, never cleared. adding a name takes atom_lock.
+ * growing publishes a new table, the old one is retired but never freed
+ * because a reader may still be probing it. */
+
+struct atom {
+	unsigned hash;
+	char name[];
+};
+
+struct atom_table {
+	struct atom_table *retired; /* older tables, kept for slow readers */
+	unsigned max; /* power of 2 */
+	struct atom *slot[]; /* open addressed */
+};
+
+static pthread_mutex_t atom_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct atom_table *atom_table;
+static unsigned atom_count; /* protected by atom_lock */
+
+static unsigned atom_hash_name(const char *name)
+{
+	/* FNV-1a */
+	unsigned h = 2166136261u;
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct atom *atom_lookup(const struct atom_table *t, const char *name, unsigned hash)
+{
+	if (!t)
+		return NULL;
+	unsigned mask = t->max - 1;
+	unsigned i;
+	struct atom *a;
+	for (i = hash & mask; (a = __atomic_load_n(&t->slot[i], __ATOMIC_ACQUIRE)); i = (i + 1) & mask)
+		if (a->hash == hash && !strcmp(a->name, name))
+			return a;
+	return NULL;
+}
+
+/* caller must hold atom_lock, and table must have a free slot */
+static void atom_insert(struct atom_table *t, struct atom *a)
+{
+	unsigned mask = t->max - 1;
+	unsigned i = a->hash & mask;
+	while (t->slot[i])
+		i = (i + 1) & mask;
+	/* readers see the slot only after the atom is filled in */
+	__atomic_store_n(&t->slot[i], a, __ATOMIC_RELEASE);
+}
+
+/* caller must hold atom_lock */
+static int atom_grow(void)
+{
+	struct atom_table *old = atom_table;
+	unsigned max = old ? old->max * 2 : 256;
+	struct atom_table *t = calloc(1, sizeof(*t) + max * sizeof(*t->slot));
+	if (!t) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return -1;
+	}
+	t->max = max;
+	t->retired = old;
+	unsigned i;
+	if (old)
+		for (i = 0; i < old->max; i++)
+			if (old->slot[i])
+				atom_insert(t, old->slot[i]);
+	__atomic_store_n(&atom_table, t, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* return the atom for name, or NULL if it has never been interned. */
+const struct atom *atom_find(const char *name)
+{
+	return atom_lookup(__atomic_load_n(&atom_table, __ATOMIC_ACQUIRE),
+		name, atom_hash_name(name));
+}
+
+/* return the atom for name, adding it if needed. NULL on failure. */
+const struct atom *atom_intern(const char *name)
+{
+	unsigned hash = atom_hash_name(name);
+	struct atom *a = atom_lookup(__atomic_load_n(&atom_table, __ATOMIC_ACQUIRE), name, hash);
+	if (a)
+		return a;
+
+	pthread_mutex_lock(&atom_lock);
+	/* another thread may have added it, or grown the table */
+	a = atom_lookup(atom_table, name, hash);
+	if (a)
+		goto done;
+	/* keep the table at most half full */
+	if ((!atom_table || (atom_count + 1) * 2 > atom_table->max) && atom_grow())
+		goto done;
+	size_t len = strlen(name) + 1;
+	a = malloc(sizeof(*a) + len);
+	if (!a) {
+		log_error("%s:%s", __func__, strerror(errno));
+		goto done;
+	}
+	a->hash = hash;
+	memcpy(a->name, name, len);
+	atom_insert(atom_table, a);
+	atom_count++;
+done:
+	pthread_mutex_unlock(&atom_lock);
+	return a;
+}
+
+const char *atom_name(const struct atom *a)
+{
+	return a->name;
+}
+
+unsigned atom_hash(const struct atom *a)
+{
+	return a->hash;
+}
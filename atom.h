@@ -0,0 +1,9 @@
+#ifndef ATOM_H
+#define ATOM_H
+/* interned names, compare atoms by pointer */
+struct atom;
+const struct atom *atom_find(const char *name);
+const struct atom *atom_intern(const char *name);
+const char *atom_name(const struct atom *a);
+unsigned atom_hash(const struct atom *a);
+#endif
@@ -0,0 +1,342 @@
+/*
+ * Copyright 2015 Jon Mayo <jon@cobra-kai.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buf.h"
+#include "log.h"
+
+/* segments of this size are recycled, larger ones go back to malloc */
+#define BUF_SEG_SIZE (4096 - sizeof(struct buf_seg))
+#define BUF_POOL_MAX 1024 /* per thread */
+
+/* free lists, the first bytes of a free item hold the next pointer */
+static __thread void *buf_seg_pool, *buf_ref_pool;
+static __thread unsigned buf_seg_pool_len, buf_ref_pool_len;
+
+static struct buf_seg *buf_seg_new(size_t want)
+{
+	struct buf_seg *seg;
+	if (want <= BUF_SEG_SIZE && buf_seg_pool) {
+		seg = buf_seg_pool;
+		buf_seg_pool = *(void**)seg;
+		buf_seg_pool_len--;
+		want = BUF_SEG_SIZE;
+	} else {
+		if (want < BUF_SEG_SIZE)
+			want = BUF_SEG_SIZE;
+		seg = malloc(sizeof(*seg) + want);
+		if (!seg) {
+			log_error("%s:%s", __func__, strerror(errno));
+			return NULL;
+		}
+	}
+	seg->rc = 1;
+	seg->len = 0;
+	seg->max = want;
+	return seg;
+}
+
+void buf_seg_retain(struct buf_seg *seg)
+{
+	__atomic_add_fetch(&seg->rc, 1, __ATOMIC_RELAXED);
+}
+
+/* buf_seg_release() drops a reference, safe to call from any thread. */
+void buf_seg_release(struct buf_seg *seg)
+{
+	if (__atomic_sub_fetch(&seg->rc, 1, __ATOMIC_ACQ_REL))
+		return;
+	if (seg->max == BUF_SEG_SIZE && buf_seg_pool_len < BUF_POOL_MAX) {
+		*(void**)seg = buf_seg_pool;
+		buf_seg_pool = seg;
+		buf_seg_pool_len++;
+		return;
+	}
+	free(seg);
+}
+
+static struct buf_ref *buf_ref_new(struct buf_seg *seg, unsigned ofs, unsigned end)
+{
+	struct buf_ref *ref = buf_ref_pool;
+	if (ref) {
+		buf_ref_pool = *(void**)ref;
+		buf_ref_pool_len--;
+	} else {
+		ref = malloc(sizeof(*ref));
+		if (!ref) {
+			log_error("%s:%s", __func__, strerror(errno));
+			return NULL;
+		}
+	}
+	ref->next = NULL;
+	ref->seg = seg;
+	ref->ofs = ofs;
+	ref->end = end;
+	return ref;
+}
+
+static void buf_ref_free(struct buf_ref *ref)
+{
+	buf_seg_release(ref->seg);
+	if (buf_ref_pool_len < BUF_POOL_MAX) {
+		*(void**)ref = buf_ref_pool;
+		buf_ref_pool = ref;
+		buf_ref_pool_len++;
+		return;
+	}
+	free(ref);
+}
+
+void buf_init(struct buf_chain *b)
+{
+	b->head = NULL;
+	b->tail = &b->head;
+	b->len = 0;
+}
+
+void buf_free(struct buf_chain *b)
+{
+	while (b->head) {
+		struct buf_ref *ref = b->head;
+		b->head = ref->next;
+		buf_ref_free(ref);
+	}
+	buf_init(b);
+}
+
+static void buf_link(struct buf_chain *b, struct buf_ref *ref)
+{
+	*b->tail = ref;
+	b->tail = &ref->next;
+	b->len += ref->end - ref->ofs;
+}
+
+/* the last reference, if this chain is still the only writer of its segment.
+ * a shared segment has other references and is never written again. */
+static struct buf_ref *buf_last(struct buf_chain *b)
+{
+	if (!b->head)
+		return NULL;
+	struct buf_ref *ref = (struct buf_ref*)((char*)b->tail - offsetof(struct buf_ref, next));
+	if (ref->seg->rc != 1 || ref->end != ref->seg->len)
+		return NULL;
+	return ref;
+}
+
+/* buf_write() appends data. returns 0 on success, -1 on failure. */
+int buf_write(struct buf_chain *b, const void *data, size_t len)
+{
+	struct buf_ref *ref = buf_last(b);
+	if (ref) {
+		size_t n = ref->seg->max - ref->seg->len;
+		if (n > len)
+			n = len;
+		memcpy(ref->seg->data + ref->seg->len, data, n);
+		ref->seg->len += n;
+		ref->end += n;
+		b->len += n;
+		data = (const char*)data + n;
+		len -= n;
+	}
+	if (!len)
+		return 0;
+
+	struct buf_seg *seg = buf_seg_new(len);
+	if (!seg)
+		return -1;
+	memcpy(seg->data, data, len);
+	seg->len = len;
+	ref = buf_ref_new(seg, 0, len);
+	if (!ref) {
+		buf_seg_release(seg);
+		return -1;
+	}
+	buf_link(b, ref);
+	return 0;
+}
+
+/* buf_vprintf() appends formatted output, nothing is truncated.
+ * returns the length written or -1 on failure. */
+int buf_vprintf(struct buf_chain *b, const char *fmt, va_list ap)
+{
+	va_list ap2;
+	int e;
+
+	/* try to fit it in the space left at the end of the chain */
+	struct buf_ref *ref = buf_last(b);
+	if (ref) {
+		struct buf_seg *seg = ref->seg;
+		size_t rem = seg->max - seg->len;
+		va_copy(ap2, ap);
+		e = vsnprintf(seg->data + seg->len, rem, fmt, ap2);
+		va_end(ap2);
+		if (e < 0)
+			return -1;
+		if ((size_t)e < rem) {
+			seg->len += e;
+			ref->end += e;
+			b->len += e;
+			return e;
+		}
+	} else {
+		va_copy(ap2, ap);
+		e = vsnprintf(NULL, 0, fmt, ap2);
+		va_end(ap2);
+		if (e < 0)
+			return -1;
+	}
+
+	/* start a new segment big enough for all of it */
+	struct buf_seg *seg = buf_seg_new(e + 1);
+	if (!seg)
+		return -1;
+	va_copy(ap2, ap);
+	vsnprintf(seg->data, seg->max, fmt, ap2);
+	va_end(ap2);
+	seg->len = e;
+	ref = buf_ref_new(seg, 0, e);
+	if (!ref) {
+		buf_seg_release(seg);
+		return -1;
+	}
+	buf_link(b, ref);
+	return e;
+}
+
+/* buf_iov() describes the start of the chain for writev().
+ * returns the number of entries filled. */
+int buf_iov(struct buf_chain *b, struct iovec *iov, int iovmax)
+{
+	int n = 0;
+	struct buf_ref *ref;
+	for (ref = b->head; ref && n < iovmax; ref = ref->next) {
+		iov[n].iov_base = ref->seg->data + ref->ofs;
+		iov[n].iov_len = ref->end - ref->ofs;
+		n++;
+	}
+	return n;
+}
+
+/* buf_consume() drops len bytes from the start of the chain. */
+void buf_consume(struct buf_chain *b, size_t len)
+{
+	if (len > b->len)
+		len = b->len;
+	b->len -= len;
+	while (b->head) {
+		struct buf_ref *ref = b->head;
+		size_t n = ref->end - ref->ofs;
+		if (len < n) {
+			ref->ofs += len;
+			return;
+		}
+		len -= n;
+		/* drained segments go back to the pool right away */
+		b->head = ref->next;
+		if (!b->head)
+			b->tail = &b->head;
+		buf_ref_free(ref);
+	}
+}
+
+/* buf_reserve() returns space at the end of the chain for producing output
+ * in place, such as a compressor. avail is set to the room left, at least one
+ * byte. finish with buf_commit(). returns NULL on failure. */
+char *buf_reserve(struct buf_chain *b, size_t *avail)
+{
+	struct buf_ref *ref = buf_last(b);
+	if (!ref || ref->seg->len == ref->seg->max) {
+		struct buf_seg *seg = buf_seg_new(BUF_SEG_SIZE);
+		if (!seg)
+			return NULL;
+		ref = buf_ref_new(seg, 0, 0);
+		if (!ref) {
+			buf_seg_release(seg);
+			return NULL;
+		}
+		buf_link(b, ref);
+	}
+	*avail = ref->seg->max - ref->seg->len;
+	return ref->seg->data + ref->seg->len;
+}
+
+/* buf_commit() adds len bytes written after buf_reserve() to the chain. */
+void buf_commit(struct buf_chain *b, size_t len)
+{
+	struct buf_ref *ref = buf_last(b);
+	if (!ref)
+		return;
+	ref->seg->len += len;
+	ref->end += len;
+	b->len += len;
+}
+
+/* buf_splice() moves everything in src to the end of dst. */
+void buf_splice(struct buf_chain *dst, struct buf_chain *src)
+{
+	if (!src->head)
+		return;
+	*dst->tail = src->head;
+	dst->tail = src->tail;
+	dst->len += src->len;
+	buf_init(src);
+}
+
+/* buf_seg_vprintf() formats once into a new segment for sharing with
+ * buf_append_seg(). the caller owns one reference. */
+struct buf_seg *buf_seg_vprintf(const char *fmt, va_list ap)
+{
+	va_list ap2;
+	va_copy(ap2, ap);
+	int e = vsnprintf(NULL, 0, fmt, ap2);
+	va_end(ap2);
+	if (e < 0)
+		return NULL;
+	struct buf_seg *seg = buf_seg_new(e + 1);
+	if (!seg)
+		return NULL;
+	vsnprintf(seg->data, seg->max, fmt, ap);
+	seg->len = e;
+	return seg;
+}
+
+struct buf_seg *buf_seg_printf(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	struct buf_seg *seg = buf_seg_vprintf(fmt, ap);
+	va_end(ap);
+	return seg;
+}
+
+/* buf_append_seg() queues a shared segment without copying it.
+ * returns 0 on success, -1 on failure. */
+int buf_append_seg(struct buf_chain *b, struct buf_seg *seg)
+{
+	if (!seg->len)
+		return 0;
+	struct buf_ref *ref = buf_ref_new(seg, 0, seg->len);
+	if (!ref)
+		return -1;
+	buf_seg_retain(seg);
+	buf_link(b, ref);
+	return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef BUF_H
+#define BUF_H
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* a block of output data. segments are reference counted so they can be
+ * shared by many chains once they are no longer written to. */
+struct buf_seg {
+	int rc;
+	unsigned len, max;
+	char data[];
+};
+
+/* a chain's reference to part of a segment */
+struct buf_ref {
+	struct buf_ref *next;
+	struct buf_seg *seg;
+	unsigned ofs, end;
+};
+
+/* a queue of output waiting to be written */
+struct buf_chain {
+	struct buf_ref *head, **tail;
+	size_t len;
+};
+
+void buf_init(struct buf_chain *b);
+void buf_free(struct buf_chain *b);
+int buf_write(struct buf_chain *b, const void *data, size_t len);
+int buf_vprintf(struct buf_chain *b, const char *fmt, va_list ap);
+void buf_seg_retain(struct buf_seg *seg);
+void buf_seg_release(struct buf_seg *seg);
+struct buf_seg *buf_seg_vprintf(const char *fmt, va_list ap);
+struct buf_seg *buf_seg_printf(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+int buf_append_seg(struct buf_chain *b, struct buf_seg *seg);
+int buf_iov(struct buf_chain *b, struct iovec *iov, int iovmax);
+void buf_consume(struct buf_chain *b, size_t len);
+char *buf_reserve(struct buf_chain *b, size_t *avail);
+void buf_commit(struct buf_chain *b, size_t len);
+void buf_splice(struct buf_chain *dst, struct buf_chain *src);
+#endif
@@ -18,12 +18,21 @@
 #include <errno.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cencode.h"
 
 /* c_encode places null terminated string into dst.
  * return written length on success. -1 on failure. */
 int c_encode(char *dst, size_t dstmax, const char *src, size_t srclen)
+{
+	return c_encode_special(dst, dstmax, src, srclen, "");
+}
+
+/* like c_encode, characters in special are also written as octal escapes so
+ * that the caller can use them as separators. */
+int c_encode_special(char *dst, size_t dstmax, const char *src, size_t srclen,
+	const char *special)
 {
 	size_t dstlen = 0;
 	while (srclen > 0 && *src) {
@@ -67,13 +76,14 @@ int c_encode(char *dst, size_t dstmax, const char *src, size_t srclen)
 			dst[dstlen++] = 'v';
 			break;
 		default:
-			if (isprint(c)) {
+			if (isprint((unsigned char)c) && !strchr(special, c)) {
 				dst[dstlen++] = c;
 			} else {
+				unsigned char u = c;
 				dst[dstlen++] = '\\';
-				dst[dstlen++] = '0' + (c % 8);
-				dst[dstlen++] = '0' + ((c / 8) % 8);
-				dst[dstlen++] = '0' + ((c / 64) % 8);
+				dst[dstlen++] = '0' + ((u / 64) % 8);
+				dst[dstlen++] = '0' + ((u / 8) % 8);
+				dst[dstlen++] = '0' + (u % 8);
 			}
 		}
 	}
@@ -107,16 +117,10 @@ int c_decode(char *dst, size_t dstmax, const char *src, size_t srclen)
 			case '0': case '1': case '2': case '3':
 			case '4': case '5': case '6': case '7':
 				/* parse octal number - up to 3 digits */
-				v = 0;
-				for (i = 0; (c >= '0' && c <= '7') && i < 3; i++) {
-					v = (v * 8) + (c - '0');
-					/* stop at end of src */
-					if (srclen) {
-						c = *src++;
-						srclen--;
-					} else {
-						break;
-					}
+				v = c - '0';
+				for (i = 1; i < 3 && srclen && *src >= '0' && *src <= '7'; i++) {
+					v = (v * 8) + (*src++ - '0');
+					srclen--;
 				}
 				dst[dstlen++] = v;
 				break;
@@ -2,5 +2,7 @@
 #define CENCODE_H
 #include <stddef.h>
 int c_encode(char *dst, size_t dstmax, const char *src, size_t srclen);
+int c_encode_special(char *dst, size_t dstmax, const char *src, size_t srclen,
+	const char *special);
 int c_decode(char *dst, size_t dstmax, const char *src, size_t srclen);
 #endif
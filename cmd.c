@@ -20,14 +20,15 @@
 #include <string.h>
 #include "cmd.h"
 #include "grow.h"
+#include "metrics.h"
 
 typedef unsigned long hash_t;
 
-static hash_t hash(const char *key)
+static hash_t hash(const char *key, size_t len)
 {
 	/* jenkins one-at-a-time hash */
 	hash_t h = 0;
-	while (*key) {
+	while (len--) {
 		h += *key++;
 		h += h << 10;
 		h += h >> 6;
@@ -39,11 +40,11 @@ static hash_t hash(const char *key)
 }
 
 /* find the first unused slot */
-static void *hash_slot(const char *key, void *base, unsigned max, size_t elem, const char *(*getkey)(const void *obj))
+static void *hash_slot(const char *key, size_t len, void *base, unsigned max, size_t elem, const char *(*getkey)(const void *obj))
 {
 	if (!max)
 		return NULL;
-	hash_t h = hash(key);
+	hash_t h = hash(key, len);
 	unsigned mask = max ? max - 1 : 0;
 	unsigned tries = max;
 	while (tries-- > 0) {
@@ -56,19 +57,20 @@ static void *hash_slot(const char *key, void *base, unsigned max, size_t elem, c
 	return NULL; /* unable to find unused slot */
 }
 
-static void *hash_find(const char *key, void *base, unsigned max, size_t elem, const char *(*getkey)(const void *obj))
+/* key does not need to be null terminated */
+static void *hash_find(const char *key, size_t len, void *base, unsigned max, size_t elem, const char *(*getkey)(const void *obj))
 {
 	if (!max)
 		return NULL;
-	hash_t h = hash(key);
+	hash_t h = hash(key, len);
 	unsigned mask = max ? max - 1 : 0;
 	unsigned tries = max;
-	while (tries > 0) {
+	while (tries-- > 0) {
 		void *test = (char*)base + (h & mask) * elem;
 		const char *check = getkey(test);
 		if (!check)
 			return NULL; /* dead end */
-		if (!strcmp(key, check))
+		if (!strncmp(key, check, len) && !check[len])
 			return test; /* match */
 		h += 65537; /* quick and dirty rehash */
 	}
@@ -77,11 +79,13 @@ static void *hash_find(const char *key, void *base, unsigned max, size_t elem, c
 
 struct command {
 	char *name;
-	void (*f)(void *p);
+	void (*f)(void *p, const char *arg, size_t arglen);
+	unsigned long long calls, ns; /* shared by all threads */
 };
 
 static struct command *command;
 static unsigned command_max; /* must be a power of 2 */
+static unsigned command_len;
 
 static const char *command_getkey(const void *obj)
 {
@@ -89,23 +93,43 @@ static const char *command_getkey(const void *obj)
 	return cmd->name;
 }
 
-int command_register(const char *name, void (*f)(void *p))
+/* double the table and rehash, positions depend on the table size */
+static int command_resize(void)
+{
+	struct command *old = command;
+	unsigned i, old_max = command_max;
+
+	command = NULL;
+	command_max = 0;
+	if (grow(&command, &command_max, old_max ? old_max * 2 : 1, sizeof(*command))) {
+		command = old;
+		command_max = old_max;
+		return -1;
+	}
+	for (i = 0; i < old_max; i++) {
+		if (!old[i].name)
+			continue;
+		struct command *cmd = hash_slot(old[i].name, strlen(old[i].name), command, command_max, sizeof(*command), command_getkey);
+		*cmd = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+int command_register(const char *name, void (*f)(void *p, const char *arg, size_t arglen))
 {
+	size_t len = strlen(name);
 	/* look for a duplicate entry */
-	struct command *cmd = hash_find(name, command, command_max, sizeof(*command), command_getkey);
+	struct command *cmd = hash_find(name, len, command, command_max, sizeof(*command), command_getkey);
 
 	if (!cmd)  {
-		/* not found, create it */
-		cmd = hash_slot(name, command, command_max, sizeof(*command), command_getkey);
-		if (!cmd) {
-			/* resize if there isn't space */
-			unsigned next = command_max ? command_max * 2 : 1;
-			if (grow(&command, &command_max, next, sizeof(*command)))
-				return -1;
-			cmd = hash_slot(name, command, command_max, sizeof(*command), command_getkey);
-		}
+		/* not found, create it. keep the table at most 3/4 full */
+		if ((command_len + 1) * 4 > command_max * 3 && command_resize())
+			return -1;
+		cmd = hash_slot(name, len, command, command_max, sizeof(*command), command_getkey);
 		if (!cmd)
 			return -1;
+		command_len++;
 	} else {
 		/* free the old details */
 		free(cmd->name);
@@ -115,15 +139,50 @@ int command_register(const char *name, void (*f)(void *p))
 	/* initialize the entry */
 	cmd->name = strdup(name);
 	cmd->f = f;
+	cmd->calls = 0;
+	cmd->ns = 0;
 	return 0;
 }
 
-int command_run(const char *name, void *p)
+/* command_run() runs a command line of len bytes, it doesn't need to be null
+ * terminated. the first word is the command, the rest is passed as the
+ * argument without being copied. returns -1 if the command is not found. */
+int command_run(const char *line, size_t len, void *p)
 {
-	struct command *cmd = hash_find(name, command, command_max, sizeof(*command), command_getkey);
+	const char *end = line + len;
+	while (line < end && (*line == ' ' || *line == '\t'))
+		line++;
+	const char *name = line;
+	while (line < end && *line != ' ' && *line != '\t')
+		line++;
+	size_t namelen = line - name;
+	while (line < end && (*line == ' ' || *line == '\t'))
+		line++;
+
+	if (!namelen)
+		return 0; /* blank line */
+
+	struct command *cmd = hash_find(name, namelen, command, command_max, sizeof(*command), command_getkey);
 
 	if (!cmd)
 		return -1; /* error - not found */
-	cmd->f(p);
+	unsigned long long start = metrics_now();
+	cmd->f(p, line, end - line);
+	unsigned long long ns = metrics_now() - start;
+	metrics_record(METRIC_COMMAND, ns);
+	__atomic_add_fetch(&cmd->calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&cmd->ns, ns, __ATOMIC_RELAXED);
 	return 0;
 }
+
+/* command_stats() calls f for every command that has been run */
+void command_stats(void (*f)(void *p, const char *name, unsigned long long calls, unsigned long long ns), void *p)
+{
+	unsigned i;
+	for (i = 0; i < command_max; i++) {
+		struct command *cmd = &command[i];
+		unsigned long long calls = __atomic_load_n(&cmd->calls, __ATOMIC_RELAXED);
+		if (cmd->name && calls)
+			f(p, cmd->name, calls, __atomic_load_n(&cmd->ns, __ATOMIC_RELAXED));
+	}
+}
@@ -1,5 +1,7 @@
 #ifndef CMD_H
 #define CMD_H
-int command_register(const char *name, void (*f)(void *p));
-int command_run(const char *name, void *p);
+#include <stddef.h>
+int command_register(const char *name, void (*f)(void *p, const char *arg, size_t arglen));
+int command_run(const char *line, size_t len, void *p);
+void command_stats(void (*f)(void *p, const char *name, unsigned long long calls, unsigned long long ns), void *p);
 #endif
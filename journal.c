@@ -0,0 +1,201 @@
+/*
+ * Copyright 2015 Jon Mayo <jon@cobra-kai.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "journal.h"
+#include "log.h"
+
+/* an append-only file of (path, data) records. each record is checked with
+ * a crc, so that a record torn by a crash ends the journal at replay. the
+ * journal is not locked, the caller serializes appends. */
+
+#define JOURNAL_MAGIC 0x4a524e4cu /* "JRNL" */
+
+struct journal_record {
+	uint32_t magic;
+	uint32_t pathlen, datalen;
+	uint32_t crc; /* of path and data */
+};
+
+struct journal {
+	int fd;
+	off_t size;
+	char *name;
+};
+
+/* open or create the journal name in the directory dirfd. */
+struct journal *journal_open(int dirfd, const char *name)
+{
+	struct journal *j = calloc(1, sizeof(*j));
+	if (!j) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return NULL;
+	}
+	j->name = strdup(name);
+	j->fd = openat(dirfd, name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+	struct stat st;
+	if (!j->name || j->fd < 0 || fstat(j->fd, &st)) {
+		log_error("%s:%s", name, strerror(errno));
+		journal_close(j);
+		return NULL;
+	}
+	j->size = st.st_size;
+	/* a new journal is lost with its directory entry, make that durable
+	 * before any record in it is reported as synced */
+	if (!j->size && fsync(dirfd)) {
+		log_error("%s:fsync:%s", name, strerror(errno));
+		journal_close(j);
+		return NULL;
+	}
+	return j;
+}
+
+void journal_close(struct journal *j)
+{
+	if (!j)
+		return;
+	if (j->fd >= 0)
+		close(j->fd);
+	free(j->name);
+	free(j);
+}
+
+/* bytes in the journal, including records not synced yet. */
+off_t journal_size(struct journal *j)
+{
+	return j->size;
+}
+
+/* append one record, it is durable after journal_sync(). */
+int journal_append(struct journal *j, const char *path, const void *data, size_t len)
+{
+	struct journal_record rec;
+	size_t pathlen = strlen(path);
+	rec.magic = JOURNAL_MAGIC;
+	rec.pathlen = pathlen;
+	rec.datalen = len;
+	rec.crc = crc32(crc32(0, (const Bytef*)path, pathlen), data, len);
+
+	struct iovec iov[3] = {
+		{ &rec, sizeof(rec) },
+		{ (void*)path, pathlen },
+		{ (void*)data, len },
+	};
+	size_t total = sizeof(rec) + pathlen + len;
+	ssize_t e = writev(j->fd, iov, 3);
+	if (e != (ssize_t)total) {
+		log_error("%s:%s", j->name, e < 0 ? strerror(errno) : "short write");
+		/* don't leave a partial record for the next append to follow */
+		if (e > 0 && ftruncate(j->fd, j->size))
+			log_error("%s:%s", j->name, strerror(errno));
+		return -1;
+	}
+	j->size += total;
+	return 0;
+}
+
+int journal_sync(struct journal *j)
+{
+	if (fdatasync(j->fd)) {
+		log_error("%s:%s", j->name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* empty the journal, once everything in it is stored elsewhere. */
+int journal_reset(struct journal *j)
+{
+	if (ftruncate(j->fd, 0) || fdatasync(j->fd)) {
+		log_error("%s:%s", j->name, strerror(errno));
+		return -1;
+	}
+	j->size = 0;
+	return 0;
+}
+
+/* call f for every record in order. a torn or corrupt record ends the
+ * journal, and it is cut off there. returns the number of records, or -1. */
+long journal_replay(struct journal *j,
+	int (*f)(void *p, const char *path, const void *data, size_t len), void *p)
+{
+	if (!j->size)
+		return 0;
+	char *buf = malloc(j->size);
+	if (!buf) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return -1;
+	}
+	off_t have = 0;
+	while (have < j->size) {
+		ssize_t e = pread(j->fd, buf + have, j->size - have, have);
+		if (e <= 0) {
+			log_error("%s:%s", j->name, e < 0 ? strerror(errno) : "short read");
+			free(buf);
+			return -1;
+		}
+		have += e;
+	}
+
+	off_t ofs = 0;
+	long count = 0;
+	char path[PATH_MAX];
+	while (ofs < j->size) {
+		struct journal_record rec;
+		if ((size_t)(j->size - ofs) < sizeof(rec))
+			break;
+		memcpy(&rec, buf + ofs, sizeof(rec));
+		if (rec.magic != JOURNAL_MAGIC || rec.pathlen >= sizeof(path) ||
+				(off_t)(sizeof(rec) + rec.pathlen + rec.datalen) > j->size - ofs)
+			break;
+		const char *data = buf + ofs + sizeof(rec) + rec.pathlen;
+		memcpy(path, buf + ofs + sizeof(rec), rec.pathlen);
+		path[rec.pathlen] = 0;
+		if (crc32(crc32(0, (const Bytef*)path, rec.pathlen),
+				(const Bytef*)data, rec.datalen) != rec.crc)
+			break;
+		if (f(p, path, data, rec.datalen)) {
+			free(buf);
+			return -1;
+		}
+		ofs += sizeof(rec) + rec.pathlen + rec.datalen;
+		count++;
+	}
+	free(buf);
+
+	if (ofs < j->size) {
+		log_warning("%s:torn record at offset %lld, discarding %lld bytes",
+			j->name, (long long)ofs, (long long)(j->size - ofs));
+		if (ftruncate(j->fd, ofs)) {
+			log_error("%s:%s", j->name, strerror(errno));
+			return -1;
+		}
+		j->size = ofs;
+	}
+	return count;
+}
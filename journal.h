@@ -0,0 +1,14 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+#include <stddef.h>
+#include <sys/types.h>
+struct journal;
+struct journal *journal_open(int dirfd, const char *name);
+void journal_close(struct journal *j);
+off_t journal_size(struct journal *j);
+int journal_append(struct journal *j, const char *path, const void *data, size_t len);
+int journal_sync(struct journal *j);
+int journal_reset(struct journal *j);
+long journal_replay(struct journal *j,
+	int (*f)(void *p, const char *path, const void *data, size_t len), void *p);
+#endif
@@ -0,0 +1,356 @@
+/*
+ * Copyright 2015 Jon Mayo <jon@cobra-kai.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/* loadgen - drives simulated telnet clients against the server.
+ *
+ * opens many connections, waits for each greeting, then replays a script of
+ * commands at a fixed total rate. every connection has at most one command
+ * outstanding, the response time is measured to the first byte of output.
+ * the greeting and every response end with the marker, so the script should
+ * only use commands whose output ends with it.
+ * reports throughput and latency percentiles when done. */
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "grow.h"
+
+#define LOADGEN_BATCH 256
+
+enum {
+	CLIENT_CONNECTING,
+	CLIENT_GREETING, /* waiting for the end of the greeting */
+	CLIENT_IDLE,
+	CLIENT_WAITING, /* command sent, waiting for output */
+	CLIENT_READING, /* reading the rest of the output */
+	CLIENT_DEAD,
+};
+
+struct client {
+	int fd;
+	int state;
+	unsigned step; /* next line of the script */
+	unsigned long long start; /* of the connection or the command */
+	char tail[32]; /* end of the output seen so far */
+	size_t taillen;
+};
+
+/* samples in nanoseconds, sorted for the report */
+struct samples {
+	unsigned long long *v;
+	unsigned len, max;
+};
+
+static struct client *clients;
+static unsigned client_count;
+static char **script;
+static unsigned script_len, script_max;
+static const char *marker = "Hello\n"; /* end of the greeting and responses */
+static struct samples setup_times, response_times;
+static unsigned long long sent, failed;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sample_add(struct samples *s, unsigned long long v)
+{
+	if (grow(&s->v, &s->max, s->len + 1, sizeof(*s->v)))
+		return;
+	s->v[s->len++] = v;
+}
+
+static int sample_cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long*)a;
+	unsigned long long y = *(const unsigned long long*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void sample_report(const char *name, struct samples *s)
+{
+	if (!s->len) {
+		printf("%-10s no samples\n", name);
+		return;
+	}
+	qsort(s->v, s->len, sizeof(*s->v), sample_cmp);
+	printf("%-10s n=%-8u p50=%.3fms p99=%.3fms p999=%.3fms max=%.3fms\n",
+		name, s->len,
+		s->v[s->len / 2] / 1e6,
+		s->v[(unsigned long long)s->len * 99 / 100] / 1e6,
+		s->v[(unsigned long long)s->len * 999 / 1000] / 1e6,
+		s->v[s->len - 1] / 1e6);
+}
+
+static int script_load(const char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		perror(filename);
+		return -1;
+	}
+	char line[512];
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		/* the last line may lack its newline, the server needs one */
+		size_t len = strcspn(line, "\n");
+		char *cmd = malloc(len + 2);
+		if (!cmd || grow(&script, &script_max, script_len + 1, sizeof(*script))) {
+			perror(filename);
+			free(cmd);
+			fclose(f);
+			return -1;
+		}
+		memcpy(cmd, line, len);
+		memcpy(cmd + len, "\n", 2);
+		script[script_len++] = cmd;
+	}
+	fclose(f);
+	return 0;
+}
+
+static void client_kill(struct client *c)
+{
+	if (c->state == CLIENT_DEAD)
+		return;
+	close(c->fd);
+	c->state = CLIENT_DEAD;
+	failed++;
+}
+
+/* remember the end of the output to spot the marker across reads */
+static int client_output(struct client *c, const char *data, size_t len)
+{
+	size_t keep = sizeof(c->tail);
+	if (len >= keep) {
+		memcpy(c->tail, data + len - keep, keep);
+		c->taillen = keep;
+	} else {
+		if (c->taillen + len > keep) {
+			size_t drop = c->taillen + len - keep;
+			memmove(c->tail, c->tail + drop, c->taillen - drop);
+			c->taillen -= drop;
+		}
+		memcpy(c->tail + c->taillen, data, len);
+		c->taillen += len;
+	}
+	size_t mlen = strlen(marker);
+	return c->taillen >= mlen && !memcmp(c->tail + c->taillen - mlen, marker, mlen);
+}
+
+static void client_event(struct client *c, unsigned events)
+{
+	unsigned long long t = now_ns();
+
+	if (c->state == CLIENT_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+			client_kill(c);
+			return;
+		}
+		c->state = CLIENT_GREETING;
+	}
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return;
+
+	char buf[16384];
+	ssize_t n;
+	while ((n = read(c->fd, buf, sizeof(buf))) > 0) {
+		int done = client_output(c, buf, n);
+		switch (c->state) {
+		case CLIENT_GREETING:
+			if (done) {
+				sample_add(&setup_times, t - c->start);
+				c->state = CLIENT_IDLE;
+			}
+			break;
+		case CLIENT_WAITING:
+			sample_add(&response_times, t - c->start);
+			c->state = CLIENT_READING;
+			/* fall through */
+		case CLIENT_READING:
+			/* output may arrive in several reads, wait for all of it */
+			if (done)
+				c->state = CLIENT_IDLE;
+			break;
+		}
+	}
+	if (n == 0 || (n < 0 && errno != EAGAIN))
+		client_kill(c);
+}
+
+static int client_send(struct client *c)
+{
+	const char *line = script[c->step++ % script_len];
+	size_t len = strlen(line);
+	if (write(c->fd, line, len) != (ssize_t)len) {
+		client_kill(c);
+		return -1;
+	}
+	c->start = now_ns();
+	c->state = CLIENT_WAITING;
+	c->taillen = 0; /* the marker must come from this response */
+	sent++;
+	return 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-h host] [-p port] [-c connections] [-r commands/s] [-d seconds] [-m marker] [-s script]\n", argv0);
+	fprintf(stderr, "the greeting and the output of every command must end with the marker\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1", *port = "5000";
+	unsigned long rate = 1000, duration = 10;
+	int opt;
+
+	client_count = 1000;
+	while ((opt = getopt(argc, argv, "h:p:c:r:d:m:s:")) != -1) {
+		switch (opt) {
+		case 'h': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 'c': client_count = strtoul(optarg, NULL, 10); break;
+		case 'r': rate = strtoul(optarg, NULL, 10); break;
+		case 'd': duration = strtoul(optarg, NULL, 10); break;
+		case 'm': marker = optarg; break;
+		case 's':
+			if (script_load(optarg))
+				return EXIT_FAILURE;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (!script_len) {
+		static char *builtin[] = { "print\n" };
+		script = builtin;
+		script_len = 1;
+	}
+	if (!client_count || !rate) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	struct rlimit rl;
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	struct addrinfo *res, hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+	int e = getaddrinfo(host, port, &hints, &res);
+	if (e) {
+		fprintf(stderr, "%s/%s:%s\n", host, port, gai_strerror(e));
+		return EXIT_FAILURE;
+	}
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	clients = calloc(client_count, sizeof(*clients));
+	if (epfd < 0 || !clients) {
+		perror(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	/* open everything at once, the server sees an accept storm */
+	unsigned i;
+	for (i = 0; i < client_count; i++) {
+		struct client *c = &clients[i];
+		c->state = CLIENT_DEAD;
+		c->fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (c->fd < 0) {
+			perror("socket()");
+			failed++;
+			continue;
+		}
+		c->start = now_ns();
+		c->state = CLIENT_CONNECTING;
+		if (connect(c->fd, res->ai_addr, res->ai_addrlen) && errno != EINPROGRESS) {
+			client_kill(c);
+			continue;
+		}
+		struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.u32 = i };
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev))
+			client_kill(c);
+	}
+	freeaddrinfo(res);
+
+	unsigned long long begin = now_ns();
+	unsigned long long end = begin + duration * 1000000000ULL;
+	unsigned long long credit = 0, last = begin;
+	unsigned next = 0;
+	unsigned long long t;
+
+	while ((t = now_ns()) < end) {
+		/* commands become due at a steady rate, spread over idle clients */
+		credit += (t - last) * rate;
+		last = t;
+		unsigned tried = 0;
+		while (credit >= 1000000000ULL && tried < client_count) {
+			struct client *c = &clients[next++ % client_count];
+			tried++;
+			if (c->state != CLIENT_IDLE)
+				continue;
+			credit -= 1000000000ULL;
+			client_send(c);
+			tried = 0;
+		}
+		if (credit > 1000000000ULL * client_count)
+			credit = 1000000000ULL * client_count; /* everyone is busy */
+
+		struct epoll_event ready[LOADGEN_BATCH];
+		int n = epoll_wait(epfd, ready, LOADGEN_BATCH, 1);
+		int k;
+		for (k = 0; k < n; k++)
+			client_event(&clients[ready[k].data.u32], ready[k].events);
+	}
+
+	double secs = (now_ns() - begin) / 1e9;
+	unsigned alive = 0;
+	for (i = 0; i < client_count; i++) {
+		if (clients[i].state != CLIENT_DEAD) {
+			alive++;
+			close(clients[i].fd);
+		}
+	}
+	printf("connections %u of %u alive, %llu failed\n", alive, client_count, failed);
+	printf("commands   %llu sent, %u answered, %.1f/s\n",
+		sent, response_times.len, response_times.len / secs);
+	sample_report("setup", &setup_times);
+	sample_report("response", &response_times);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,265 @@
+/*
+ * Copyright 2015 Jon Mayo <jon@cobra-kai.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "log.h"
+
+/* asynchronous logger.
+ *
+ * producers format into a fixed size record in a bounded ring (after Dmitry
+ * Vyukov's bounded MPMC queue), a background thread writes the records out.
+ * a producer never blocks or makes a syscall: if the ring is full the message
+ * is counted as dropped. messages from the same call site that repeat too
+ * often in one second are suppressed and counted. until log_init() is called
+ * messages are written directly. */
+
+#define LOG_RING_SIZE 4096 /* records, must be a power of 2 */
+#define LOG_TEXT_MAX 240
+#define LOG_RATE_MAX 20 /* messages per call site per second */
+#define LOG_SITES 64 /* per thread rate limit slots */
+#define LOG_IDLE_NS 10000000 /* consumer sleep when the ring is empty */
+
+struct log_rec {
+	unsigned long seq;
+	unsigned char level;
+	unsigned short len;
+	char text[LOG_TEXT_MAX];
+};
+
+static struct log_rec log_ring[LOG_RING_SIZE];
+static unsigned long log_enqueue_pos, log_dequeue_pos;
+static unsigned long log_dropped_count, log_dropped_reported;
+static int log_level_cur = LOG_INFO;
+static int log_running, log_stopping;
+static pthread_t log_thread;
+
+static const char *log_names[] = { "ERROR", "WARNING", "INFO", "DEBUG" };
+
+/* rate limiting, keyed by the format string of the call site */
+static __thread struct log_site {
+	const char *fmt;
+	unsigned long long second;
+	unsigned count, suppressed;
+} log_sites[LOG_SITES];
+
+int log_level(void)
+{
+	return __atomic_load_n(&log_level_cur, __ATOMIC_RELAXED);
+}
+
+void log_set_level(int level)
+{
+	if (level < LOG_ERROR)
+		level = LOG_ERROR;
+	if (level > LOG_DEBUG)
+		level = LOG_DEBUG;
+	__atomic_store_n(&log_level_cur, level, __ATOMIC_RELAXED);
+}
+
+/* log_level_parse() returns the level for a name such as "info", or -1. */
+int log_level_parse(const char *name)
+{
+	unsigned i;
+	for (i = 0; i < sizeof(log_names) / sizeof(*log_names); i++) {
+		if (!strcasecmp(name, log_names[i]))
+			return i;
+	}
+	return -1;
+}
+
+const char *log_level_name(int level)
+{
+	if (level < LOG_ERROR || level > LOG_DEBUG)
+		return "?";
+	return log_names[level];
+}
+
+unsigned long log_dropped(void)
+{
+	return __atomic_load_n(&log_dropped_count, __ATOMIC_RELAXED);
+}
+
+static void log_write(int level, const char *text, size_t len)
+{
+	fprintf(stderr, "%s:%.*s\n", log_names[level], (int)len, text);
+}
+
+/* claim a slot, returns NULL if the ring is full */
+static struct log_rec *log_claim(unsigned long *pos)
+{
+	unsigned long p = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		struct log_rec *rec = &log_ring[p & (LOG_RING_SIZE - 1)];
+		unsigned long seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		long dif = (long)(seq - p);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&log_enqueue_pos, &p, p + 1,
+					1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				*pos = p;
+				return rec;
+			}
+		} else if (dif < 0) {
+			return NULL; /* full */
+		} else {
+			p = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* returns non-zero if the message should be dropped */
+static int log_limit(const char *fmt, unsigned long long second, unsigned *suppressed)
+{
+	struct log_site *site = &log_sites[((unsigned long)fmt >> 3) % LOG_SITES];
+	*suppressed = 0;
+	if (site->fmt != fmt || site->second != second) {
+		if (site->fmt == fmt)
+			*suppressed = site->suppressed;
+		site->fmt = fmt;
+		site->second = second;
+		site->count = 0;
+		site->suppressed = 0;
+	}
+	if (++site->count > LOG_RATE_MAX) {
+		site->suppressed++;
+		return 1;
+	}
+	return 0;
+}
+
+void log_vprintf(int level, const char *fmt, va_list ap)
+{
+	if (level > log_level())
+		return;
+
+	if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+		char text[LOG_TEXT_MAX];
+		int n = vsnprintf(text, sizeof(text), fmt, ap);
+		if (n < 0)
+			return;
+		log_write(level, text, (size_t)n < sizeof(text) ? (size_t)n : sizeof(text) - 1);
+		return;
+	}
+
+	/* the coarse clock is read from the vDSO page, no syscall */
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	unsigned suppressed;
+	if (log_limit(fmt, ts.tv_sec, &suppressed))
+		return;
+	if (suppressed)
+		log_printf(LOG_WARNING, "log:%u repeats of \"%.40s\" suppressed", suppressed, fmt);
+
+	unsigned long pos;
+	struct log_rec *rec = log_claim(&pos);
+	if (!rec) {
+		__atomic_add_fetch(&log_dropped_count, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	int n = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+	if (n < 0)
+		n = 0;
+	else if ((size_t)n >= sizeof(rec->text))
+		n = sizeof(rec->text) - 1; /* truncated */
+	rec->len = n;
+	rec->level = level;
+	__atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+void log_printf(int level, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	log_vprintf(level, fmt, ap);
+	va_end(ap);
+}
+
+/* write out everything in the ring, returns the number of records */
+static unsigned log_drain(void)
+{
+	unsigned n = 0;
+	for (;;) {
+		unsigned long p = log_dequeue_pos;
+		struct log_rec *rec = &log_ring[p & (LOG_RING_SIZE - 1)];
+		unsigned long seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		if (seq != p + 1)
+			break; /* empty, or the producer is still writing */
+		log_write(rec->level, rec->text, rec->len);
+		__atomic_store_n(&rec->seq, p + LOG_RING_SIZE, __ATOMIC_RELEASE);
+		log_dequeue_pos = p + 1;
+		n++;
+	}
+
+	unsigned long dropped = log_dropped();
+	if (dropped != log_dropped_reported) {
+		fprintf(stderr, "WARNING:log:%lu messages dropped\n",
+			dropped - log_dropped_reported);
+		log_dropped_reported = dropped;
+	}
+	if (n)
+		fflush(stderr);
+	return n;
+}
+
+static void *log_main(void *p)
+{
+	(void)p;
+	while (!__atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE)) {
+		if (!log_drain()) {
+			struct timespec ts = { 0, LOG_IDLE_NS };
+			nanosleep(&ts, NULL);
+		}
+	}
+	log_drain();
+	return NULL;
+}
+
+/* log_init() starts the background thread. returns 0 on success, -1 on
+ * failure, in which case messages continue to be written directly. */
+int log_init(void)
+{
+	unsigned long i;
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		log_ring[i].seq = i;
+	log_enqueue_pos = log_dequeue_pos = 0;
+	__atomic_store_n(&log_stopping, 0, __ATOMIC_RELEASE);
+	int e = pthread_create(&log_thread, NULL, log_main, NULL);
+	if (e) {
+		fprintf(stderr, "ERROR:%s():%s\n", __func__, strerror(e));
+		return -1;
+	}
+	__atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* log_shutdown() writes out what is queued and stops the thread. later
+ * messages are written directly. */
+void log_shutdown(void)
+{
+	if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+		return;
+	__atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(log_thread, NULL);
+	log_drain(); /* anything that raced with the stop */
+}
@@ -0,0 +1,25 @@
+#ifndef LOG_H
+#define LOG_H
+#include <stdarg.h>
+
+#define LOG_ERROR 0
+#define LOG_WARNING 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+int log_init(void);
+void log_shutdown(void);
+int log_level(void);
+void log_set_level(int level);
+int log_level_parse(const char *name);
+const char *log_level_name(int level);
+unsigned long log_dropped(void);
+void log_vprintf(int level, const char *fmt, va_list ap);
+void log_printf(int level, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+/* the level is checked before any arguments are evaluated */
+#define log_error(...) log_printf(LOG_ERROR, __VA_ARGS__)
+#define log_warning(...) do { if (log_level() >= LOG_WARNING) log_printf(LOG_WARNING, __VA_ARGS__); } while (0)
+#define log_info(...) do { if (log_level() >= LOG_INFO) log_printf(LOG_INFO, __VA_ARGS__); } while (0)
+#define log_debug(...) do { if (log_level() >= LOG_DEBUG) log_printf(LOG_DEBUG, __VA_ARGS__); } while (0)
+#endif
@@ -0,0 +1,153 @@
+/*
+ * Copyright 2015 Jon Mayo <jon@cobra-kai.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "log.h"
+#include "mccp.h"
+
+/* settings shared by every stream, set once at startup */
+static int mccp_level = Z_DEFAULT_COMPRESSION;
+static int mccp_window = 15;
+static int mccp_flush = Z_SYNC_FLUSH;
+
+struct mccp {
+	z_stream zs;
+	struct mccp_stats stats;
+};
+
+/* mccp_config() sets the compression level (0-9), the window size in bits
+ * (9-15, each step halves the memory used per connection) and the flush mode
+ * used after each batch of output: "sync", "partial" or "full".
+ * returns 0 on success, -1 if a setting is not valid. */
+int mccp_config(int level, int window, const char *flush)
+{
+	if (level < 0 || level > 9 || window < 9 || window > 15) {
+		log_error("%s():invalid level %d or window %d", __func__, level, window);
+		return -1;
+	}
+	if (!flush || !strcmp(flush, "sync")) {
+		mccp_flush = Z_SYNC_FLUSH;
+	} else if (!strcmp(flush, "partial")) {
+		mccp_flush = Z_PARTIAL_FLUSH;
+	} else if (!strcmp(flush, "full")) {
+		mccp_flush = Z_FULL_FLUSH;
+	} else {
+		log_error("%s():unknown flush mode \"%s\"", __func__, flush);
+		return -1;
+	}
+	mccp_level = level;
+	mccp_window = window;
+	return 0;
+}
+
+struct mccp *mccp_new(void)
+{
+	struct mccp *m = calloc(1, sizeof(*m));
+	if (!m) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return NULL;
+	}
+	/* memLevel follows the window, the defaults cost about 256KB */
+	int memlevel = mccp_window - 7;
+	if (deflateInit2(&m->zs, mccp_level, Z_DEFLATED, mccp_window, memlevel,
+			Z_DEFAULT_STRATEGY) != Z_OK) {
+		log_error("%s():%s", __func__, m->zs.msg ? m->zs.msg : "deflateInit2 failed");
+		free(m);
+		return NULL;
+	}
+	return m;
+}
+
+void mccp_free(struct mccp *m)
+{
+	if (!m)
+		return;
+	deflateEnd(&m->zs);
+	free(m);
+}
+
+static unsigned long long mccp_cpu_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* run deflate until it has consumed its input and has no more to say */
+static int mccp_deflate(struct mccp *m, struct buf_chain *out, int flush)
+{
+	int e;
+	do {
+		size_t avail;
+		char *dst = buf_reserve(out, &avail);
+		if (!dst)
+			return -1;
+		m->zs.next_out = (Bytef*)dst;
+		m->zs.avail_out = avail;
+		e = deflate(&m->zs, flush);
+		buf_commit(out, avail - m->zs.avail_out);
+		m->stats.packed += avail - m->zs.avail_out;
+		if (e == Z_STREAM_ERROR) {
+			log_error("%s():deflate failed", __func__);
+			return -1;
+		}
+	} while (m->zs.avail_in || !m->zs.avail_out);
+	return 0;
+}
+
+/* mccp_compress() compresses all of in and appends it to out, followed by a
+ * flush so the peer can decode everything sent so far.
+ * returns 0 on success, -1 on failure. */
+int mccp_compress(struct mccp *m, struct buf_chain *in, struct buf_chain *out)
+{
+	unsigned long long start = mccp_cpu_ns();
+	int e = 0;
+	struct buf_ref *ref;
+
+	for (ref = in->head; ref && !e; ref = ref->next) {
+		m->zs.next_in = (Bytef*)ref->seg->data + ref->ofs;
+		m->zs.avail_in = ref->end - ref->ofs;
+		m->stats.raw += m->zs.avail_in;
+		e = mccp_deflate(m, out, Z_NO_FLUSH);
+	}
+	if (!e)
+		e = mccp_deflate(m, out, mccp_flush);
+	buf_consume(in, in->len);
+	m->stats.cpu_ns += mccp_cpu_ns() - start;
+	return e;
+}
+
+/* mccp_finish() ends the stream, the peer goes back to plain text after the
+ * output appended to out. returns 0 on success, -1 on failure. */
+int mccp_finish(struct mccp *m, struct buf_chain *out)
+{
+	unsigned long long start = mccp_cpu_ns();
+	int e = mccp_deflate(m, out, Z_FINISH);
+	m->stats.cpu_ns += mccp_cpu_ns() - start;
+	return e;
+}
+
+const struct mccp_stats *mccp_stats(const struct mccp *m)
+{
+	return &m->stats;
+}
@@ -0,0 +1,20 @@
+#ifndef MCCP_H
+#define MCCP_H
+#include "buf.h"
+
+/* totals for one compressed stream */
+struct mccp_stats {
+	unsigned long long raw; /* bytes before compression */
+	unsigned long long packed; /* bytes after compression */
+	unsigned long long cpu_ns; /* thread CPU time spent compressing */
+};
+
+struct mccp;
+
+int mccp_config(int level, int window, const char *flush);
+struct mccp *mccp_new(void);
+void mccp_free(struct mccp *m);
+int mccp_compress(struct mccp *m, struct buf_chain *in, struct buf_chain *out);
+int mccp_finish(struct mccp *m, struct buf_chain *out);
+const struct mccp_stats *mccp_stats(const struct mccp *m);
+#endif
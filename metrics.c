@@ -0,0 +1,199 @@
+/*
+ * Copyright 2015 Jon Mayo <jon@cobra-kai.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "metrics.h"
+
+/* counters and latency histograms.
+ *
+ * each thread records into its own block, so recording is a plain add with no
+ * locked instructions. readers add up the blocks of every thread, the values
+ * are only approximate while threads are recording.
+ *
+ * histograms are log-linear in the manner of HdrHistogram: every power of
+ * two is split into 8 buckets, so any value is recorded within 12.5%. */
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct metrics_hist {
+	unsigned long long count, sum, max;
+	unsigned long long bucket[HIST_BUCKETS];
+};
+
+struct metrics_local {
+	struct metrics_local *next;
+	unsigned long long counter[METRIC_COUNTER_MAX];
+	struct metrics_hist hist[METRIC_HIST_MAX];
+};
+
+static const char *metrics_counter_names[METRIC_COUNTER_MAX] = {
+	[METRIC_BYTES_READ] = "bytes.read",
+	[METRIC_BYTES_WRITTEN] = "bytes.written",
+	[METRIC_ACCEPTED] = "accepted",
+	[METRIC_TRUNCATED] = "truncated",
+	[METRIC_OBJDB_HIT] = "objdb.hit",
+	[METRIC_OBJDB_MISS] = "objdb.miss",
+	[METRIC_OBJDB_EVICT] = "objdb.evict",
+	[METRIC_OBJDB_BATCHES] = "objdb.batches",
+	[METRIC_OBJDB_SYNCED] = "objdb.synced",
+	[METRIC_OBJDB_CHECKPOINTS] = "objdb.checkpoints",
+	[METRIC_OBJDB_COMPACTIONS] = "objdb.compactions",
+};
+
+static const char *metrics_hist_names[METRIC_HIST_MAX] = {
+	[METRIC_POLL] = "poll",
+	[METRIC_FIRST_BYTE] = "first_byte",
+	[METRIC_COMMAND] = "command",
+	[METRIC_OBJDB_LOAD] = "objdb.load",
+	[METRIC_OBJDB_COMMIT] = "objdb.commit",
+	[METRIC_OBJDB_SYNC] = "objdb.sync",
+};
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_local *metrics_all;
+static __thread struct metrics_local *metrics_self;
+
+/* metrics_now() returns a monotonic time in nanoseconds */
+unsigned long long metrics_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct metrics_local *metrics_local(void)
+{
+	if (metrics_self)
+		return metrics_self;
+	/* blocks are never freed, a thread's totals outlive it */
+	struct metrics_local *m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+	pthread_mutex_lock(&metrics_lock);
+	m->next = metrics_all;
+	metrics_all = m;
+	pthread_mutex_unlock(&metrics_lock);
+	metrics_self = m;
+	return m;
+}
+
+/* only the owning thread writes, a relaxed store keeps readers tear free */
+static void metrics_add(unsigned long long *p, unsigned long long n)
+{
+	__atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+void metrics_count(enum metric_counter id, unsigned long long n)
+{
+	struct metrics_local *m = metrics_local();
+	if (m)
+		metrics_add(&m->counter[id], n);
+}
+
+static unsigned hist_index(unsigned long long v)
+{
+	if (v < HIST_SUB)
+		return v;
+	unsigned exp = 63 - __builtin_clzll(v);
+	unsigned sub = (v >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1);
+	return (exp - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+/* lowest value recorded in a bucket */
+static unsigned long long hist_value(unsigned i)
+{
+	if (i < HIST_SUB)
+		return i;
+	unsigned exp = i / HIST_SUB + HIST_SUB_BITS - 1;
+	unsigned long long sub = i % HIST_SUB;
+	return (1ULL << exp) | (sub << (exp - HIST_SUB_BITS));
+}
+
+void metrics_record(enum metric_hist id, unsigned long long ns)
+{
+	struct metrics_local *m = metrics_local();
+	if (!m)
+		return;
+	struct metrics_hist *h = &m->hist[id];
+	metrics_add(&h->bucket[hist_index(ns)], 1);
+	metrics_add(&h->count, 1);
+	metrics_add(&h->sum, ns);
+	if (ns > h->max)
+		__atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+unsigned long long metrics_counter(enum metric_counter id)
+{
+	unsigned long long total = 0;
+	struct metrics_local *m;
+	pthread_mutex_lock(&metrics_lock);
+	for (m = metrics_all; m; m = m->next)
+		total += __atomic_load_n(&m->counter[id], __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&metrics_lock);
+	return total;
+}
+
+/* metrics_summary() adds up a histogram across all threads */
+void metrics_summary(enum metric_hist id, struct metrics_summary *out)
+{
+	static const double pct[] = { 0.50, 0.90, 0.99, 0.999 };
+	static __thread unsigned long long bucket[HIST_BUCKETS];
+	unsigned long long count = 0, sum = 0, max = 0;
+	struct metrics_local *m;
+	unsigned i, j;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		bucket[i] = 0;
+	pthread_mutex_lock(&metrics_lock);
+	for (m = metrics_all; m; m = m->next) {
+		struct metrics_hist *h = &m->hist[id];
+		for (i = 0; i < HIST_BUCKETS; i++) {
+			unsigned long long n = __atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+			bucket[i] += n;
+			count += n;
+		}
+		sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+		unsigned long long hmax = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+		if (hmax > max)
+			max = hmax;
+	}
+	pthread_mutex_unlock(&metrics_lock);
+
+	out->name = metrics_hist_names[id];
+	out->count = count;
+	out->mean = count ? sum / count : 0;
+	out->max = max;
+	unsigned long long seen = 0;
+	for (i = 0, j = 0; i < HIST_BUCKETS && j < METRICS_PERCENTILES; i++) {
+		seen += bucket[i];
+		while (j < METRICS_PERCENTILES && count && seen >= pct[j] * count)
+			out->pct[j++] = hist_value(i);
+	}
+	while (j < METRICS_PERCENTILES)
+		out->pct[j++] = 0;
+}
+
+const char *metrics_counter_name(enum metric_counter id)
+{
+	return metrics_counter_names[id];
+}
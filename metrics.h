@@ -0,0 +1,44 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+enum metric_counter {
+	METRIC_BYTES_READ,
+	METRIC_BYTES_WRITTEN,
+	METRIC_ACCEPTED,
+	METRIC_TRUNCATED, /* input lines that were too long */
+	METRIC_OBJDB_HIT,
+	METRIC_OBJDB_MISS,
+	METRIC_OBJDB_EVICT,
+	METRIC_OBJDB_BATCHES, /* group commits, SYNCED / BATCHES is the mean size */
+	METRIC_OBJDB_SYNCED,
+	METRIC_OBJDB_CHECKPOINTS,
+	METRIC_OBJDB_COMPACTIONS,
+	METRIC_COUNTER_MAX
+};
+
+/* latencies, in nanoseconds */
+enum metric_hist {
+	METRIC_POLL, /* handling one batch of events, not the wait */
+	METRIC_FIRST_BYTE, /* accept to the first byte written */
+	METRIC_COMMAND,
+	METRIC_OBJDB_LOAD,
+	METRIC_OBJDB_COMMIT, /* queued to durable with group commit */
+	METRIC_OBJDB_SYNC, /* one batch of fdatasync and fsync */
+	METRIC_HIST_MAX
+};
+
+#define METRICS_PERCENTILES 4 /* 50, 90, 99 and 99.9 */
+
+struct metrics_summary {
+	const char *name;
+	unsigned long long count, mean, max;
+	unsigned long long pct[METRICS_PERCENTILES];
+};
+
+unsigned long long metrics_now(void);
+void metrics_count(enum metric_counter id, unsigned long long n);
+void metrics_record(enum metric_hist id, unsigned long long ns);
+unsigned long long metrics_counter(enum metric_counter id);
+const char *metrics_counter_name(enum metric_counter id);
+void metrics_summary(enum metric_hist id, struct metrics_summary *out);
+#endif
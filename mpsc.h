@@ -0,0 +1,15 @@
+#ifndef MPSC_H
+#define MPSC_H
+/* intrusive multi-producer single-consumer queue */
+struct mpsc_node {
+	struct mpsc_node *next;
+};
+struct mpsc {
+	struct mpsc_node *head; /* producers push here */
+	struct mpsc_node *tail; /* consumer pops here */
+	struct mpsc_node stub;
+};
+void mpsc_init(struct mpsc *q);
+void mpsc_push(struct mpsc *q, struct mpsc_node *n);
+struct mpsc_node *mpsc_pop(struct mpsc *q);
+#endif
@@ -20,22 +20,109 @@
 #include <errno.h>
 #include <string.h>
 #include <limits.h>
+#include <pthread.h>
 #include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
 
+#include "grow.h"
+#include "journal.h"
+#include "log.h"
+#include "metrics.h"
 #include "objdb.h"
 #include "object.h"
+#include "packfile.h"
 
 struct objdb_txn {
 	char *filename;
-	char *tempfile;
+	char *tempfile; /* NULL for the journal or pack, which write to buf */
 	FILE *f;
+	char *buf;
+	size_t len;
+	/* group commit */
+	struct objdb_txn *next;
+	void (*done)(void *arg, int ok); /* NULL if objdb_commit() is waiting */
+	void *arg;
+	unsigned long long start;
+	int result, finished;
 };
 
+/* loaded objects are kept in a cache shared by all threads, keyed by path.
+ * the cache holds one reference, and entries nobody else holds are evicted
+ * least recently used first once the budget is exceeded. cached objects are
+ * frozen, use obj_new_child() for a copy that can be changed. */
+struct objdb_entry {
+	struct objdb_entry *hash_next;
+	struct objdb_entry **hash_link; /* what points at this entry */
+	struct objdb_entry *lru_prev, *lru_next; /* head is most recent */
+	struct object *obj;
+	size_t size;
+	char *data; /* size bytes of a journaled object, in objdb_dirty */
+	char path[];
+};
+
+struct objdb_table {
+	struct objdb_entry **bucket; /* power of 2 buckets */
+	unsigned buckets, count;
+};
+
+static pthread_mutex_t objdb_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct objdb_table objdb_cache;
+static struct objdb_entry *objdb_lru_head, *objdb_lru_tail;
+static size_t objdb_cache_size, objdb_cache_budget = 16 << 20;
+static unsigned long objdb_cache_gen; /* changes whenever a path is forgotten */
+
+/* with group commit on, commits are queued for a sync thread. it waits up to
+ * a window for more to arrive, then makes each batch durable with one
+ * fdatasync per file before the renames and one fsync per directory after,
+ * and only then acknowledges the commits in it. */
+static pthread_mutex_t objdb_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t objdb_sync_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t objdb_sync_done = PTHREAD_COND_INITIALIZER;
+static struct objdb_txn *objdb_sync_head, **objdb_sync_tail = &objdb_sync_head;
+static unsigned objdb_sync_queued;
+static int objdb_sync_mode = 1, objdb_sync_running, objdb_sync_stopping;
+static unsigned objdb_sync_window_ms = 5, objdb_sync_batch = 64;
+static pthread_t objdb_sync_thread;
+
+/* the journal backend appends commits to one file, and keeps the latest
+ * contents of each path in objdb_dirty until a checkpoint writes them to
+ * their own files. the dirty table is changed only by the sync thread, and
+ * read by loads under objdb_cache_lock. */
+#define OBJDB_JOURNAL ".journal"
+#define OBJDB_CHECKPOINT_FILES 64 /* open at once while checkpointing */
+static struct journal *objdb_journal; /* open if there is one */
+static int objdb_journal_on; /* commits go to the journal */
+static off_t objdb_checkpoint_size = 4 << 20;
+static struct objdb_table objdb_dirty;
+
+/* the pack backend appends commits to large segment files, and loads find
+ * them through its index before looking for a file of their own. segments
+ * that are mostly superseded records are compacted by the sync thread, a
+ * bounded chunk after each batch so that commits are not held up. */
+#define OBJDB_PACK ".pack" /* the directory pack_open() uses */
+static struct pack *objdb_pack; /* open if commits go to the pack */
+
+/* objdb_load_async() requests are served by a pool of threads, so that an
+ * event loop never waits on the disk. */
+struct objdb_request {
+	struct objdb_request *next;
+	void (*done)(void *arg, struct object *obj);
+	void *arg;
+	char path[];
+};
+
+static pthread_mutex_t objdb_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t objdb_pool_wake = PTHREAD_COND_INITIALIZER;
+static struct objdb_request *objdb_pool_head, **objdb_pool_tail = &objdb_pool_head;
+static pthread_t *objdb_pool;
+static unsigned objdb_pool_size = 2, objdb_pool_running;
+static int objdb_pool_stopping;
+
 static char *objdb_root = NULL; /* this is no default path */
 static int objdb_fd = -1; /* use this directory for all openat() calls */
 
@@ -45,14 +132,14 @@ static int objdb_root_check(void)
 {
 	if (objdb_fd == -1) {
 		if (!objdb_root) {
-			fprintf(stderr, "%s():please configure DB path\n", __func__);
+			log_error("%s():please configure DB path", __func__);
 			return -1;
 		}
-		objdb_fd = open(objdb_root, O_DIRECTORY);
+		objdb_fd = open(objdb_root, O_DIRECTORY | O_CLOEXEC);
 	}
 
 	if (objdb_fd == -1) {
-		perror(objdb_root);
+		log_error("%s:%s", objdb_root, strerror(errno));
 		return -1;
 	}
 
@@ -61,22 +148,23 @@ static int objdb_root_check(void)
 
 /* objdb_temp() create a stream to store an object.
  * later the path stored in tempname will be renamed by objdb_commit() to the
- * target location. tempname is assumed to be PATH_MAX in size. */
+ * target location. tempname is assumed to be PATH_MAX in size. the temp file
+ * is made in the root, a rename from another filesystem would fail. */
 static FILE *objdb_temp(char *tempname)
 {
 	if (objdb_root_check())
 		return NULL;
 
 	/* this routine is hardcoded to have a 6 digit pattern XXXXXX */
-	int e = snprintf(tempname, PATH_MAX, "/tmp/obj.XXXXXX");
+	int e = snprintf(tempname, PATH_MAX, ".obj.XXXXXX");
 	if (e < 0 || e >= PATH_MAX) {
-		perror(tempname);
+		log_error("%s:%s", tempname, strerror(errno));
 		errno = EINVAL;
 		return NULL;
 	}
 	int tmpofs = strlen(tempname) - 6;
 	if (tmpofs <= 0) {
-		fprintf(stderr, "%s():illegal temp pattern\n", __func__);
+		log_error("%s():illegal temp pattern", __func__);
 		errno = EINVAL;
 		return NULL;
 	}
@@ -87,19 +175,19 @@ static FILE *objdb_temp(char *tempname)
 	do {
 		/* generate a sequence number using a simple Lehmer RNG */
 		seq = (16807UL * seq) % 2147483647UL;
-		snprintf(tempname + tmpofs, 6, "%06u", rand() % 1000000);
+		snprintf(tempname + tmpofs, 7, "%06u", rand() % 1000000);
 		/* these temp files are always exclusive */
-		int oflags = O_CREAT | O_EXCL | O_RDWR;
+		int oflags = O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC;
 		errno = 0;
 		fd = openat(objdb_fd, tempname, oflags, 0666);
 		if (fd < 0 && errno != EEXIST) {
-			fprintf(stderr, "%s():%s:temp file:%s\n", __func__,
+			log_error("%s():%s:temp file:%s", __func__,
 				tempname, strerror(errno));
 			return NULL;
 		}
 	} while (fd < 0 && tries--);
 	if (fd < 0) {
-		fprintf(stderr, "%s():unable to open a temp file\n", __func__);
+		log_error("%s():unable to open a temp file", __func__);
 		return NULL;
 	}
 
@@ -109,21 +197,24 @@ static FILE *objdb_temp(char *tempname)
 /* objdb_txn_destroy() frees all allocations related to a transaction. */
 static void objdb_txn_destroy(struct objdb_txn *txn)
 {
-	fclose(txn->f);
+	if (txn->f)
+		fclose(txn->f);
+	free(txn->buf);
 	free(txn->tempfile);
 	txn->tempfile = NULL;
 	free(txn->filename);
 	txn->filename = NULL;
+	free(txn);
 }
 
 /* objdb_start() creates a transaction for a target at path.
  * these transactions are destructive if committed and assume an obj_save() will be used.
  */
-struct objdb_txn *objdb_start(const char *path)
+static struct objdb_txn *objdb_start_file(const char *path)
 {
 	struct objdb_txn *txn = calloc(1, sizeof(*txn));
 	if (!txn) {
-		perror(__func__);
+		log_error("%s:%s", __func__, strerror(errno));
 		return NULL;
 	}
 
@@ -133,52 +224,1182 @@ struct objdb_txn *objdb_start(const char *path)
 	return txn;
 }
 
-struct object *objdb_load(const char *path)
+/* with the journal or pack, the object is kept in memory until it is
+ * committed. */
+static struct objdb_txn *objdb_start_buffer(const char *path)
 {
-	errno = 0;
-	int fd = openat(objdb_fd, path, O_RDONLY);
-	if (fd < 0) {
-		perror(path);
+	struct objdb_txn *txn = calloc(1, sizeof(*txn));
+	if (!txn) {
+		log_error("%s:%s", __func__, strerror(errno));
 		return NULL;
 	}
-	FILE *f = fdopen(fd, "r");
-	if (!f) {
-		perror(path);
+
+	txn->filename = strdup(path);
+	txn->f = open_memstream(&txn->buf, &txn->len);
+	if (!txn->f)
+		log_error("%s:%s", path, strerror(errno));
+	return txn;
+}
+
+struct objdb_txn *objdb_start(const char *path)
+{
+	if (objdb_journal_on || objdb_pack)
+		return objdb_start_buffer(path);
+	return objdb_start_file(path);
+}
+
+/* read the whole file at path, NULL on failure. */
+static char *objdb_read_file(const char *path, size_t *len)
+{
+	int fd = openat(objdb_fd, path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st)) {
+		log_error("%s:%s", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	char *data = malloc(st.st_size ? st.st_size : 1);
+	if (!data) {
+		log_error("%s:%s", path, strerror(errno));
 		close(fd);
 		return NULL;
 	}
-	struct object *obj = obj_load(f, path); /* use the filename as the tag for error messages */
+	size_t have = 0;
+	while (have < (size_t)st.st_size) {
+		ssize_t e = read(fd, data + have, st.st_size - have);
+		if (e < 0 && errno == EINTR)
+			continue;
+		if (e <= 0) {
+			log_error("%s:%s", path, e < 0 ? strerror(errno) : "short read");
+			free(data);
+			close(fd);
+			return NULL;
+		}
+		have += e;
+	}
+	close(fd);
+	*len = have;
+	return data;
+}
+
+/* parse len bytes of data as the object at path, and freeze it. */
+static struct object *objdb_parse(const char *path, char *data, size_t len)
+{
+	FILE *f = fmemopen(data, len, "r");
+	if (!f) {
+		log_error("%s:%s", path, strerror(errno));
+		return NULL;
+	}
+	/* one property per line, and no value is longer than its line. sizing the
+	 * object up front saves growing it once per doubling. */
+	unsigned lines = 0;
+	const char *p = data, *end = data + len;
+	while ((p = memchr(p, '\n', end - p))) {
+		lines++;
+		p++;
+	}
+	struct object *obj = obj_load_hint(f, path, lines, len); /* use the path as the tag for error messages */
 	fclose(f);
+	if (obj)
+		obj_freeze(obj);
 	return obj; /* obj could be NULL if obj_load() failed */
 }
 
+static unsigned objdb_hash(const char *path)
+{
+	/* FNV-1a */
+	unsigned h = 2166136261u;
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* return the link to the entry for path, or to where it would go. NULL if the
+ * table is empty. caller must hold objdb_cache_lock */
+static struct objdb_entry **objdb_table_find(struct objdb_table *t, const char *path)
+{
+	if (!t->buckets)
+		return NULL;
+	struct objdb_entry **p = &t->bucket[objdb_hash(path) & (t->buckets - 1)];
+	for (; *p; p = &(*p)->hash_next)
+		if (!strcmp((*p)->path, path))
+			return p;
+	return p;
+}
+
+/* caller must hold objdb_cache_lock */
+static void objdb_lru_unlink(struct objdb_entry *e)
+{
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		objdb_lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		objdb_lru_tail = e->lru_prev;
+}
+
+/* caller must hold objdb_cache_lock */
+static void objdb_lru_push(struct objdb_entry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = objdb_lru_head;
+	if (objdb_lru_head)
+		objdb_lru_head->lru_prev = e;
+	else
+		objdb_lru_tail = e;
+	objdb_lru_head = e;
+}
+
+/* put e in a bucket chain at link. caller must hold objdb_cache_lock */
+static void objdb_table_link(struct objdb_entry **link, struct objdb_entry *e)
+{
+	e->hash_next = *link;
+	if (e->hash_next)
+		e->hash_next->hash_link = &e->hash_next;
+	e->hash_link = link;
+	*link = e;
+}
+
+/* remove an entry and drop the cache's reference.
+ * caller must hold objdb_cache_lock */
+static void objdb_cache_remove(struct objdb_entry *e)
+{
+	*e->hash_link = e->hash_next;
+	if (e->hash_next)
+		e->hash_next->hash_link = e->hash_link;
+	objdb_lru_unlink(e);
+	objdb_cache_size -= e->size;
+	objdb_cache.count--;
+	obj_release(e->obj);
+	free(e);
+}
+
+/* evict the least recently used objects nobody else holds, until the cache
+ * fits the budget. an object still in use counts as recently used, it moves
+ * to the head so the next trim doesn't walk past it again. at most
+ * OBJDB_TRIM_SKIPS of them are passed over, when many objects are held the
+ * cache stays over budget until they are released rather than every insert
+ * walking the whole list. caller must hold objdb_cache_lock */
+#define OBJDB_TRIM_SKIPS 16
+static void objdb_cache_trim(void)
+{
+	struct objdb_entry *e, *prev;
+	unsigned skips = 0;
+	for (e = objdb_lru_tail; e && objdb_cache_size > objdb_cache_budget; e = prev) {
+		prev = e->lru_prev;
+		if (obj_refcount(e->obj) > 1) {
+			if (++skips > OBJDB_TRIM_SKIPS)
+				break;
+			objdb_lru_unlink(e);
+			objdb_lru_push(e);
+			continue;
+		}
+		objdb_cache_remove(e);
+		metrics_count(METRIC_OBJDB_EVICT, 1);
+	}
+}
+
+/* make room for one more entry. caller must hold objdb_cache_lock */
+static int objdb_table_grow(struct objdb_table *t)
+{
+	if (t->count < t->buckets)
+		return 0;
+	unsigned buckets = t->buckets ? t->buckets * 2 : 64;
+	struct objdb_entry **table = calloc(buckets, sizeof(*table));
+	if (!table) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return -1;
+	}
+	unsigned i;
+	for (i = 0; i < t->buckets; i++) {
+		struct objdb_entry *e, *next;
+		for (e = t->bucket[i]; e; e = next) {
+			next = e->hash_next;
+			unsigned h = objdb_hash(e->path) & (buckets - 1);
+			objdb_table_link(&table[h], e);
+		}
+	}
+	free(t->bucket);
+	t->bucket = table;
+	t->buckets = buckets;
+	return 0;
+}
+
+/* keep obj for the next objdb_load() of path, if there is room.
+ * caller must hold objdb_cache_lock */
+static void objdb_cache_add(const char *path, struct object *obj)
+{
+	size_t size = obj_size(obj);
+	if (size > objdb_cache_budget)
+		return;
+	if (objdb_table_grow(&objdb_cache))
+		return;
+	struct objdb_entry **p = objdb_table_find(&objdb_cache, path);
+	if (*p)
+		return; /* another thread loaded it first, keep theirs */
+	size_t len = strlen(path) + 1;
+	struct objdb_entry *e = malloc(sizeof(*e) + len);
+	if (!e) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return;
+	}
+	memcpy(e->path, path, len);
+	e->obj = obj;
+	e->size = size;
+	e->data = NULL;
+	obj_retain(obj);
+	objdb_table_link(p, e);
+	objdb_lru_push(e);
+	objdb_cache.count++;
+	objdb_cache_size += size;
+	objdb_cache_trim();
+}
+
+/* forget a cached path, holders keep the old object.
+ * caller must hold objdb_cache_lock */
+static void objdb_cache_forget(const char *path)
+{
+	struct objdb_entry **p = objdb_table_find(&objdb_cache, path);
+	if (p && *p)
+		objdb_cache_remove(*p);
+	objdb_cache_gen++;
+}
+
+/* contents of a journaled path, copied out, or NULL if it has none.
+ * caller must hold objdb_cache_lock */
+static char *objdb_dirty_get(const char *path, size_t *len)
+{
+	struct objdb_entry **p = objdb_table_find(&objdb_dirty, path);
+	if (!p || !*p)
+		return NULL;
+	char *data = malloc((*p)->size);
+	if (!data) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return NULL;
+	}
+	memcpy(data, (*p)->data, (*p)->size);
+	*len = (*p)->size;
+	return data;
+}
+
+/* replace the journaled contents of path, taking ownership of data.
+ * caller must hold objdb_cache_lock */
+static int objdb_dirty_set(const char *path, char *data, size_t len)
+{
+	if (objdb_table_grow(&objdb_dirty))
+		return -1;
+	struct objdb_entry **p = objdb_table_find(&objdb_dirty, path);
+	struct objdb_entry *e = *p;
+	if (!e) {
+		size_t pathlen = strlen(path) + 1;
+		e = calloc(1, sizeof(*e) + pathlen);
+		if (!e) {
+			log_error("%s:%s", __func__, strerror(errno));
+			return -1;
+		}
+		memcpy(e->path, path, pathlen);
+		objdb_table_link(p, e);
+		objdb_dirty.count++;
+	}
+	free(e->data);
+	e->data = data;
+	e->size = len;
+	return 0;
+}
+
+/* forget every journaled path. caller must hold objdb_cache_lock */
+static void objdb_dirty_clear(void)
+{
+	unsigned i;
+	for (i = 0; i < objdb_dirty.buckets; i++) {
+		struct objdb_entry *e, *next;
+		for (e = objdb_dirty.bucket[i]; e; e = next) {
+			next = e->hash_next;
+			free(e->data);
+			free(e);
+		}
+		objdb_dirty.bucket[i] = NULL;
+	}
+	objdb_dirty.count = 0;
+}
+
+/* look path up in the cache. on a miss, data is set to any journaled
+ * contents of path, and gen to the cache generation. */
+static struct object *objdb_lookup(const char *path, char **data, size_t *len, unsigned long *gen)
+{
+	pthread_mutex_lock(&objdb_cache_lock);
+	struct objdb_entry **p = objdb_table_find(&objdb_cache, path);
+	if (p && *p) {
+		struct objdb_entry *e = *p;
+		obj_retain(e->obj);
+		objdb_lru_unlink(e);
+		objdb_lru_push(e);
+		pthread_mutex_unlock(&objdb_cache_lock);
+		return e->obj;
+	}
+	*data = objdb_dirty_get(path, len);
+	*gen = objdb_cache_gen;
+	pthread_mutex_unlock(&objdb_cache_lock);
+	return NULL;
+}
+
+/* contents of path from the pack, or else its own file. */
+static char *objdb_read(const char *path, size_t *len)
+{
+	if (objdb_pack) {
+		char *data = pack_read(objdb_pack, path, len);
+		if (data || errno != ENOENT)
+			return data;
+	}
+	return objdb_read_file(path, len);
+}
+
+/* cache a loaded object, unless a commit replaced it since gen. returns
+ * non-zero if it did not fit the budget without evicting others. */
+static int objdb_keep(const char *path, struct object *obj, unsigned long gen)
+{
+	pthread_mutex_lock(&objdb_cache_lock);
+	int full = objdb_cache_size + obj_size(obj) > objdb_cache_budget;
+	if (gen == objdb_cache_gen)
+		objdb_cache_add(path, obj);
+	pthread_mutex_unlock(&objdb_cache_lock);
+	return full;
+}
+
+/* objdb_load() returns a frozen object that must be released by the caller.
+ * the same object is returned to every caller while it is cached. */
+struct object *objdb_load(const char *path)
+{
+	unsigned long long start = metrics_now();
+	char *data = NULL;
+	size_t len = 0;
+	unsigned long gen = 0;
+	struct object *obj = objdb_lookup(path, &data, &len, &gen);
+	if (obj) {
+		metrics_count(METRIC_OBJDB_HIT, 1);
+		metrics_record(METRIC_OBJDB_LOAD, metrics_now() - start);
+		return obj;
+	}
+
+	/* read unlocked, other paths can be served meanwhile */
+	metrics_count(METRIC_OBJDB_MISS, 1);
+	if (!data)
+		data = objdb_read(path, &len);
+	if (data) {
+		obj = objdb_parse(path, data, len);
+		free(data);
+	}
+	if (obj)
+		objdb_keep(path, obj, gen);
+	metrics_record(METRIC_OBJDB_LOAD, metrics_now() - start);
+	return obj;
+}
+
+static void *objdb_pool_main(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&objdb_pool_lock);
+	while (1) {
+		while (!objdb_pool_head && !objdb_pool_stopping)
+			pthread_cond_wait(&objdb_pool_wake, &objdb_pool_lock);
+		struct objdb_request *req = objdb_pool_head;
+		if (!req)
+			break; /* stopping, and nothing left to do */
+		objdb_pool_head = req->next;
+		if (!objdb_pool_head)
+			objdb_pool_tail = &objdb_pool_head;
+		pthread_mutex_unlock(&objdb_pool_lock);
+
+		req->done(req->arg, objdb_load(req->path));
+		free(req);
+
+		pthread_mutex_lock(&objdb_pool_lock);
+	}
+	pthread_mutex_unlock(&objdb_pool_lock);
+	return NULL;
+}
+
+/* objdb_load_async() loads path on a pool thread, and calls done from that
+ * thread with the object, or NULL on failure. the caller of done must
+ * release the object. returns -1 if the request could not be queued, and
+ * done will not be called. */
+int objdb_load_async(const char *path, void (*done)(void *arg, struct object *obj), void *arg)
+{
+	size_t len = strlen(path) + 1;
+	struct objdb_request *req = malloc(sizeof(*req) + len);
+	if (!req) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return -1;
+	}
+	req->next = NULL;
+	req->done = done;
+	req->arg = arg;
+	memcpy(req->path, path, len);
+
+	pthread_mutex_lock(&objdb_pool_lock);
+	/* start the pool on first use */
+	while (objdb_pool_running < objdb_pool_size) {
+		if (!objdb_pool) {
+			objdb_pool = calloc(objdb_pool_size, sizeof(*objdb_pool));
+			if (!objdb_pool)
+				break;
+		}
+		int e = pthread_create(&objdb_pool[objdb_pool_running], NULL, objdb_pool_main, NULL);
+		if (e) {
+			log_error("%s:%s", __func__, strerror(e));
+			break;
+		}
+		objdb_pool_running++;
+	}
+	if (!objdb_pool_running) {
+		pthread_mutex_unlock(&objdb_pool_lock);
+		free(req);
+		return -1;
+	}
+	*objdb_pool_tail = req;
+	objdb_pool_tail = &req->next;
+	pthread_cond_signal(&objdb_pool_wake);
+	pthread_mutex_unlock(&objdb_pool_lock);
+	return 0;
+}
+
+/* objdb_pool_config() sets the number of threads for objdb_load_async(),
+ * before its first use. */
+void objdb_pool_config(unsigned threads)
+{
+	pthread_mutex_lock(&objdb_pool_lock);
+	if (!objdb_pool)
+		objdb_pool_size = threads ? threads : 1;
+	pthread_mutex_unlock(&objdb_pool_lock);
+}
+
+/* objdb_cache_config() sets the memory budget of the cache in bytes, 0 turns
+ * caching off. */
+void objdb_cache_config(size_t budget)
+{
+	pthread_mutex_lock(&objdb_cache_lock);
+	objdb_cache_budget = budget;
+	objdb_cache_trim();
+	pthread_mutex_unlock(&objdb_cache_lock);
+}
+
+/* objdb_cache_stats() reports the number of cached objects and their size. */
+void objdb_cache_stats(unsigned *count, size_t *size)
+{
+	pthread_mutex_lock(&objdb_cache_lock);
+	*count = objdb_cache.count;
+	*size = objdb_cache_size;
+	pthread_mutex_unlock(&objdb_cache_lock);
+}
+
+/* objdb_preload() fills the cache before the server starts. */
+struct objdb_preload {
+	char **paths;
+	unsigned count, max;
+	unsigned next; /* the next path to claim */
+	unsigned loaded, failed;
+	int full; /* the cache budget is spent */
+	unsigned long long read_ns, parse_ns; /* summed over threads */
+	pthread_mutex_t lock;
+	pthread_cond_t finished;
+	unsigned running;
+};
+
+static int objdb_preload_add(void *arg, const char *path)
+{
+	struct objdb_preload *pl = arg;
+	char *copy = strdup(path);
+	if (!copy || grow(&pl->paths, &pl->max, pl->count + 1, sizeof(*pl->paths))) {
+		log_error("%s:%s", __func__, strerror(errno));
+		free(copy);
+		return -1;
+	}
+	pl->paths[pl->count++] = copy;
+	return 0;
+}
+
+/* add every object file under dir, "" for the root. dot files are not
+ * objects, nor are the journal, the pack or temp files. */
+static int objdb_preload_walk(struct objdb_preload *pl, const char *dir)
+{
+	int fd = openat(objdb_fd, *dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *d = fd < 0 ? NULL : fdopendir(fd);
+	if (!d) {
+		log_error("%s:%s", *dir ? dir : objdb_root, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	struct dirent *de;
+	int ret = 0;
+	while (!ret && (de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		char path[PATH_MAX];
+		if ((unsigned)snprintf(path, sizeof(path), "%s%s%s", dir, *dir ? "/" : "",
+				de->d_name) >= sizeof(path)) {
+			log_warning("%s/%s:path too long, not preloaded", dir, de->d_name);
+			continue;
+		}
+		unsigned char type = de->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+			if (fstatat(objdb_fd, path, &st, AT_SYMLINK_NOFOLLOW))
+				continue;
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+		if (type == DT_DIR)
+			ret = objdb_preload_walk(pl, path);
+		else if (type == DT_REG)
+			ret = objdb_preload_add(pl, path);
+	}
+	closedir(d);
+	return ret;
+}
+
+static void *objdb_preload_main(void *arg)
+{
+	struct objdb_preload *pl = arg;
+	unsigned long long read_ns = 0, parse_ns = 0;
+	unsigned i;
+
+	while ((i = __atomic_fetch_add(&pl->next, 1, __ATOMIC_RELAXED)) < pl->count) {
+		const char *path = pl->paths[i];
+		char *data = NULL;
+		size_t len = 0;
+		unsigned long gen = 0;
+		struct object *obj = objdb_lookup(path, &data, &len, &gen);
+		if (!obj) {
+			unsigned long long start = metrics_now();
+			if (!data)
+				data = objdb_read(path, &len);
+			unsigned long long now = metrics_now();
+			read_ns += now - start;
+			if (data) {
+				obj = objdb_parse(path, data, len);
+				free(data);
+				parse_ns += metrics_now() - now;
+			}
+			if (obj && objdb_keep(path, obj, gen))
+				__atomic_store_n(&pl->full, 1, __ATOMIC_RELAXED);
+		}
+		if (obj) {
+			obj_release(obj);
+			__atomic_add_fetch(&pl->loaded, 1, __ATOMIC_RELAXED);
+		} else {
+			__atomic_add_fetch(&pl->failed, 1, __ATOMIC_RELAXED);
+		}
+		if (__atomic_load_n(&pl->full, __ATOMIC_RELAXED))
+			break;
+	}
+
+	pthread_mutex_lock(&pl->lock);
+	pl->read_ns += read_ns;
+	pl->parse_ns += parse_ns;
+	pl->running--;
+	pthread_cond_signal(&pl->finished);
+	pthread_mutex_unlock(&pl->lock);
+	return NULL;
+}
+
+/* objdb_preload() loads every object in the db into the cache with threads
+ * threads, until the cache budget is spent, and returns once they are done.
+ * progress is logged every second. returns -1 if the db can't be walked. */
+int objdb_preload(unsigned threads)
+{
+	if (!threads)
+		return 0;
+	if (objdb_root_check())
+		return -1;
+	unsigned long long start = metrics_now();
+	struct objdb_preload pl = {0};
+	pthread_mutex_init(&pl.lock, NULL);
+	pthread_cond_init(&pl.finished, NULL);
+	int ret = objdb_preload_walk(&pl, "");
+	if (!ret && objdb_pack)
+		ret = pack_foreach(objdb_pack, objdb_preload_add, &pl);
+	unsigned long long walked = metrics_now();
+	if (!ret)
+		log_info("preload:%u objects found in %llu ms, loading with %u threads",
+			pl.count, (walked - start) / 1000000, threads);
+
+	pthread_t *tid = ret ? NULL : calloc(threads, sizeof(*tid));
+	if (!ret && !tid) {
+		log_error("%s:%s", __func__, strerror(errno));
+		ret = -1;
+	}
+	/* threads that finish early wait here for running to be counted */
+	pthread_mutex_lock(&pl.lock);
+	unsigned i;
+	for (i = 0; !ret && i < threads; i++) {
+		int e = pthread_create(&tid[i], NULL, objdb_preload_main, &pl);
+		if (e) {
+			log_error("%s:%s", __func__, strerror(e));
+			break; /* the threads already started finish the job */
+		}
+		pl.running++;
+	}
+	if (!ret && !pl.running)
+		ret = -1;
+
+	/* report progress until every thread has finished */
+	while (pl.running) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec++;
+		if (pthread_cond_timedwait(&pl.finished, &pl.lock, &deadline) == ETIMEDOUT)
+			log_info("preload:%u/%u objects",
+				__atomic_load_n(&pl.loaded, __ATOMIC_RELAXED) +
+				__atomic_load_n(&pl.failed, __ATOMIC_RELAXED), pl.count);
+	}
+	pthread_mutex_unlock(&pl.lock);
+	unsigned n = i;
+	for (i = 0; tid && i < n; i++)
+		pthread_join(tid[i], NULL);
+	free(tid);
+
+	if (!ret) {
+		unsigned long long done = metrics_now();
+		log_info("preload:%u objects in %llu ms (walk %llu ms, load %llu ms; thread time read %llu ms, parse %llu ms)",
+			pl.loaded, (done - start) / 1000000, (walked - start) / 1000000,
+			(done - walked) / 1000000, pl.read_ns / 1000000, pl.parse_ns / 1000000);
+		if (pl.failed)
+			log_warning("preload:%u objects failed to load", pl.failed);
+		if (pl.full)
+			log_info("preload:cache budget reached, %u objects left to load on demand",
+				pl.count - pl.loaded - pl.failed);
+	}
+	for (i = 0; i < pl.count; i++)
+		free(pl.paths[i]);
+	free(pl.paths);
+	pthread_cond_destroy(&pl.finished);
+	pthread_mutex_destroy(&pl.lock);
+	return ret;
+}
+
 /* objdb_f() return the FILE* handle for the current object. */
 FILE *objdb_f(struct objdb_txn *txn)
 {
 	return txn->f;
 }
 
+/* move a finished temp file into place, return 0 on success. */
+static int objdb_rename(struct objdb_txn *txn)
+{
+	int e = renameat(objdb_fd, txn->tempfile, objdb_fd, txn->filename);
+	if (e) {
+		log_error("%s:%s", txn->filename, strerror(errno));
+	}
+	/* the next load must see the new contents */
+	pthread_mutex_lock(&objdb_cache_lock);
+	objdb_cache_forget(txn->filename);
+	pthread_mutex_unlock(&objdb_cache_lock);
+	return e;
+}
+
+/* length of the directory part of a path, 0 for the root. */
+static size_t objdb_dirlen(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	return slash ? (size_t)(slash - path) : 0;
+}
+
+/* flush a directory entry to disk, dir is relative to the root. */
+static int objdb_sync_dir(const char *dir)
+{
+	int fd = *dir ? openat(objdb_fd, dir, O_RDONLY | O_DIRECTORY) : dup(objdb_fd);
+	if (fd < 0 || fsync(fd)) {
+		log_error("%s:fsync:%s", *dir ? dir : objdb_root, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/* make a batch of temp files durable in their places, and set the result of
+ * every commit in it. */
+static void objdb_sync_files(struct objdb_txn *batch)
+{
+	struct objdb_txn *txn;
+
+	/* the data of every file first, so that no rename can expose a file
+	 * that is not on disk yet */
+	for (txn = batch; txn; txn = txn->next) {
+		txn->result = 0;
+		if (fflush(txn->f) || fdatasync(fileno(txn->f))) {
+			log_error("%s:%s", txn->tempfile, strerror(errno));
+			txn->result = -1;
+		}
+	}
+	for (txn = batch; txn; txn = txn->next)
+		if (!txn->result)
+			txn->result = objdb_rename(txn);
+
+	/* then each directory that gained an entry, once. a directory that
+	 * failed is tried again for the next file in it. */
+	struct objdb_txn *other;
+	for (txn = batch; txn; txn = txn->next) {
+		if (txn->result)
+			continue;
+		size_t len = objdb_dirlen(txn->filename);
+		for (other = batch; other != txn; other = other->next)
+			if (!other->result && objdb_dirlen(other->filename) == len &&
+					!memcmp(other->filename, txn->filename, len))
+				break;
+		if (other != txn)
+			continue; /* already done */
+		char dir[PATH_MAX];
+		snprintf(dir, sizeof(dir), "%.*s", (int)len, txn->filename);
+		if (objdb_sync_dir(dir))
+			txn->result = -1;
+	}
+}
+
+/* make a batch of checkpointed files durable and free it. returns 0 if every
+ * file is in place. */
+static int objdb_checkpoint_batch(struct objdb_txn *batch)
+{
+	struct objdb_txn *txn, *next;
+	int e = 0;
+
+	objdb_sync_files(batch);
+	for (txn = batch; txn; txn = next) {
+		next = txn->next;
+		if (txn->result) {
+			e = -1;
+			objdb_rollback(txn);
+		} else {
+			objdb_txn_destroy(txn);
+		}
+	}
+	return e;
+}
+
+/* write every journaled object to its own file, then empty the journal.
+ * files are written in batches of OBJDB_CHECKPOINT_FILES, so that a large
+ * journal neither runs out of descriptors nor holds them all at once.
+ * only the sync thread, or a single thread before it starts, may call this. */
+static int objdb_checkpoint(void)
+{
+	struct objdb_txn *batch = NULL, **tail = &batch, *txn, *next;
+	unsigned i, n = 0;
+
+	/* the dirty table only changes on this thread, reading needs no lock */
+	for (i = 0; i < objdb_dirty.buckets; i++) {
+		struct objdb_entry *d;
+		for (d = objdb_dirty.bucket[i]; d; d = d->hash_next) {
+			txn = objdb_start_file(d->path);
+			if (!txn)
+				goto failed;
+			*tail = txn;
+			tail = &txn->next;
+			if (!txn->f || fwrite(d->data, 1, d->size, txn->f) != d->size)
+				goto failed;
+			if (++n < OBJDB_CHECKPOINT_FILES)
+				continue;
+			int e = objdb_checkpoint_batch(batch);
+			batch = NULL;
+			tail = &batch;
+			n = 0;
+			if (e)
+				return -1; /* keep the journal, try again next time */
+		}
+	}
+	if (objdb_checkpoint_batch(batch))
+		return -1;
+
+	pthread_mutex_lock(&objdb_cache_lock);
+	objdb_dirty_clear();
+	pthread_mutex_unlock(&objdb_cache_lock);
+	metrics_count(METRIC_OBJDB_CHECKPOINTS, 1);
+	return journal_reset(objdb_journal);
+failed:
+	log_error("%s():unable to write objects", __func__);
+	for (txn = batch; txn; txn = next) {
+		next = txn->next;
+		if (txn->f)
+			objdb_rollback(txn);
+		else
+			objdb_txn_destroy(txn);
+	}
+	return -1;
+}
+
+/* append a batch to the journal with one fdatasync for all of it. */
+static void objdb_sync_journal(struct objdb_txn *batch)
+{
+	struct objdb_txn *txn;
+	int appended = 0;
+
+	for (txn = batch; txn; txn = txn->next) {
+		txn->result = -1;
+		if (!txn->f)
+			continue;
+		/* closing the stream leaves the object in buf */
+		fclose(txn->f);
+		txn->f = NULL;
+		if (!journal_append(objdb_journal, txn->filename, txn->buf, txn->len)) {
+			txn->result = 0;
+			appended++;
+		}
+	}
+	if (appended && objdb_sync_mode && journal_sync(objdb_journal))
+		for (txn = batch; txn; txn = txn->next)
+			txn->result = -1;
+
+	/* loads see the new contents from now on */
+	pthread_mutex_lock(&objdb_cache_lock);
+	for (txn = batch; txn; txn = txn->next) {
+		if (txn->result)
+			continue;
+		if (objdb_dirty_set(txn->filename, txn->buf, txn->len))
+			txn->result = -1;
+		else
+			txn->buf = NULL; /* owned by the dirty table now */
+		objdb_cache_forget(txn->filename);
+	}
+	pthread_mutex_unlock(&objdb_cache_lock);
+
+	if (journal_size(objdb_journal) >= objdb_checkpoint_size)
+		objdb_checkpoint();
+}
+
+/* append a batch to the pack with one fdatasync for all of it, then take the
+ * next step of compacting a segment. */
+static void objdb_sync_pack(struct objdb_txn *batch)
+{
+	struct objdb_txn *txn;
+	int appended = 0;
+
+	for (txn = batch; txn; txn = txn->next) {
+		txn->result = -1;
+		if (!txn->f)
+			continue;
+		fclose(txn->f);
+		txn->f = NULL;
+		if (!pack_append(objdb_pack, txn->filename, txn->buf, txn->len)) {
+			txn->result = 0;
+			appended++;
+		}
+	}
+	if (appended && objdb_sync_mode && pack_sync(objdb_pack))
+		for (txn = batch; txn; txn = txn->next)
+			txn->result = -1;
+
+	pthread_mutex_lock(&objdb_cache_lock);
+	for (txn = batch; txn; txn = txn->next)
+		if (!txn->result)
+			objdb_cache_forget(txn->filename);
+	pthread_mutex_unlock(&objdb_cache_lock);
+
+	if (pack_compact(objdb_pack) > 0)
+		metrics_count(METRIC_OBJDB_COMPACTIONS, 1);
+}
+
+/* make a batch durable, and set the result of every commit in it. returns the
+ * batch, reordered. */
+static struct objdb_txn *objdb_sync_batch_run(struct objdb_txn *batch)
+{
+	struct objdb_txn *files = NULL, **files_tail = &files;
+	struct objdb_txn *buffered = NULL, **buffered_tail = &buffered;
+	struct objdb_txn *txn, *next;
+	unsigned n = 0;
+
+	/* the backend is chosen at startup, but keep to each txn's own */
+	for (txn = batch; txn; txn = next, n++) {
+		next = txn->next;
+		txn->next = NULL;
+		if (txn->tempfile) {
+			*files_tail = txn;
+			files_tail = &txn->next;
+		} else {
+			*buffered_tail = txn;
+			buffered_tail = &txn->next;
+		}
+	}
+	if (files)
+		objdb_sync_files(files);
+	if (buffered && objdb_pack)
+		objdb_sync_pack(buffered);
+	else if (buffered)
+		objdb_sync_journal(buffered);
+	metrics_count(METRIC_OBJDB_BATCHES, 1);
+	metrics_count(METRIC_OBJDB_SYNCED, n);
+	/* put the batch back together, order no longer matters */
+	*files_tail = buffered;
+	return files;
+}
+
+static void *objdb_sync_main(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&objdb_sync_lock);
+	while (1) {
+		while (!objdb_sync_head && !objdb_sync_stopping)
+			pthread_cond_wait(&objdb_sync_wake, &objdb_sync_lock);
+		if (!objdb_sync_head)
+			break; /* stopping, and nothing left to do */
+
+		/* give a storm of commits a chance to share this batch */
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += objdb_sync_window_ms * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		while (objdb_sync_queued < objdb_sync_batch && !objdb_sync_stopping &&
+				!pthread_cond_timedwait(&objdb_sync_wake, &objdb_sync_lock, &deadline))
+			;
+
+		struct objdb_txn *batch = objdb_sync_head;
+		objdb_sync_head = NULL;
+		objdb_sync_tail = &objdb_sync_head;
+		objdb_sync_queued = 0;
+		pthread_mutex_unlock(&objdb_sync_lock);
+
+		unsigned long long start = metrics_now();
+		batch = objdb_sync_batch_run(batch);
+		unsigned long long now = metrics_now();
+		metrics_record(METRIC_OBJDB_SYNC, now - start);
+
+		/* acknowledge, a waiting objdb_commit() owns its txn again as soon
+		 * as it is marked finished */
+		struct objdb_txn *txn, *next;
+		pthread_mutex_lock(&objdb_sync_lock);
+		for (txn = batch; txn; txn = next) {
+			next = txn->next;
+			metrics_record(METRIC_OBJDB_COMMIT, now - txn->start);
+			if (txn->done) {
+				pthread_mutex_unlock(&objdb_sync_lock);
+				txn->done(txn->arg, txn->result == 0);
+				objdb_txn_destroy(txn);
+				pthread_mutex_lock(&objdb_sync_lock);
+			} else {
+				txn->finished = 1;
+			}
+		}
+		pthread_cond_broadcast(&objdb_sync_done);
+	}
+	pthread_mutex_unlock(&objdb_sync_lock);
+	return NULL;
+}
+
+/* queue a commit, caller must hold objdb_sync_lock. */
+static int objdb_sync_queue(struct objdb_txn *txn)
+{
+	if (!objdb_sync_running) {
+		int e = pthread_create(&objdb_sync_thread, NULL, objdb_sync_main, NULL);
+		if (e) {
+			log_error("%s:%s", __func__, strerror(e));
+			return -1;
+		}
+		objdb_sync_running = 1;
+	}
+	txn->start = metrics_now();
+	txn->next = NULL;
+	*objdb_sync_tail = txn;
+	objdb_sync_tail = &txn->next;
+	if (++objdb_sync_queued == 1 || objdb_sync_queued >= objdb_sync_batch)
+		pthread_cond_signal(&objdb_sync_wake);
+	return 0;
+}
+
+/* objdb_commit_async() queues a commit and returns at once, done is called
+ * from the sync thread once it is durable, or has failed. ok is non-zero on
+ * success. without group commit done is called before returning. */
+int objdb_commit_async(struct objdb_txn *txn, void (*done)(void *arg, int ok), void *arg)
+{
+	if (objdb_root_check())
+		return -1;
+
+	if (!objdb_sync_mode && txn->tempfile) {
+		int ok = objdb_commit(txn);
+		if (done)
+			done(arg, ok);
+		return 0;
+	}
+
+	txn->done = done;
+	txn->arg = arg;
+	pthread_mutex_lock(&objdb_sync_lock);
+	int e = objdb_sync_queue(txn);
+	pthread_mutex_unlock(&objdb_sync_lock);
+	if (e) {
+		objdb_rollback(txn);
+		if (done)
+			done(arg, 0);
+	}
+	return 0;
+}
+
+/* objdb_commit() returns non-zero once the object is in place, and with group
+ * commit on, durable. */
 int objdb_commit(struct objdb_txn *txn)
 {
 	if (objdb_root_check())
 		return NULL;
 
-	int e = renameat(objdb_fd, txn->tempfile, objdb_fd, txn->filename);
-	if (e) {
-		perror(txn->filename);
+	/* the journal and pack always go through the sync thread, which skips the
+	 * fdatasync when group commit is off */
+	if (!objdb_sync_mode && txn->tempfile) {
+		unsigned long long start = metrics_now();
+		int e = objdb_rename(txn);
+		objdb_txn_destroy(txn);
+		metrics_record(METRIC_OBJDB_COMMIT, metrics_now() - start);
+		return e == 0;
+	}
+
+	txn->done = NULL;
+	pthread_mutex_lock(&objdb_sync_lock);
+	if (objdb_sync_queue(txn)) {
+		pthread_mutex_unlock(&objdb_sync_lock);
+		objdb_rollback(txn);
+		return 0;
 	}
+	while (!txn->finished)
+		pthread_cond_wait(&objdb_sync_done, &objdb_sync_lock);
+	pthread_mutex_unlock(&objdb_sync_lock);
+	int e = txn->result;
 	objdb_txn_destroy(txn);
 	return e == 0;
 }
 
+/* objdb_sync_config() turns group commit on or off. window_ms is how long a
+ * batch waits for more commits, batch is the most it waits for. */
+void objdb_sync_config(int on, unsigned window_ms, unsigned batch)
+{
+	pthread_mutex_lock(&objdb_sync_lock);
+	objdb_sync_mode = on;
+	objdb_sync_window_ms = window_ms;
+	objdb_sync_batch = batch ? batch : 1;
+	pthread_mutex_unlock(&objdb_sync_lock);
+}
+
+/* objdb_backend_config() picks where commits go, "files" renames each object
+ * into place, "journal" appends them to one file and "pack" appends them to
+ * segment files of up to segment bytes. the journal is written back to the
+ * object files once it grows past checkpoint bytes, the pack is not, so a
+ * root that has a pack refuses any other backend rather than lose the
+ * objects in it. call it before the first commit. */
+int objdb_backend_config(const char *name, size_t checkpoint, size_t segment)
+{
+	if (objdb_root_check())
+		return -1;
+	objdb_checkpoint_size = checkpoint;
+	if ((!name || strcmp(name, "pack")) && !faccessat(objdb_fd, OBJDB_PACK, F_OK, 0)) {
+		log_error("%s/%s:objects are in the pack, objdb.backend must be pack",
+			objdb_root, OBJDB_PACK);
+		return -1;
+	}
+	if (!name || !strcmp(name, "files")) {
+		objdb_journal_on = 0;
+		return 0;
+	}
+	if (!strcmp(name, "pack")) {
+		if (!objdb_pack)
+			objdb_pack = pack_open(objdb_fd, segment);
+		return objdb_pack ? 0 : -1;
+	}
+	if (strcmp(name, "journal")) {
+		log_error("objdb.backend:unknown backend \"%s\"", name);
+		return -1;
+	}
+	if (!objdb_journal)
+		objdb_journal = journal_open(objdb_fd, OBJDB_JOURNAL);
+	if (!objdb_journal)
+		return -1;
+	objdb_journal_on = 1;
+	return 0;
+}
+
+/* objdb_shutdown() completes every queued load and commit, and stops their
+ * threads.
+ * the journal is written back, so that it need not be replayed, and the
+ * pack index is saved, so that the segments need not be scanned. the pack
+ * stays open for loads still to come. */
+void objdb_shutdown(void)
+{
+	/* loads first, their callers may still commit */
+	pthread_mutex_lock(&objdb_pool_lock);
+	objdb_pool_stopping = 1;
+	pthread_cond_broadcast(&objdb_pool_wake);
+	pthread_mutex_unlock(&objdb_pool_lock);
+	unsigned i;
+	for (i = 0; i < objdb_pool_running; i++)
+		pthread_join(objdb_pool[i], NULL);
+	free(objdb_pool);
+	objdb_pool = NULL;
+	objdb_pool_running = 0;
+	objdb_pool_stopping = 0;
+
+	pthread_mutex_lock(&objdb_sync_lock);
+	if (objdb_sync_running) {
+		objdb_sync_stopping = 1;
+		pthread_cond_signal(&objdb_sync_wake);
+		pthread_mutex_unlock(&objdb_sync_lock);
+		pthread_join(objdb_sync_thread, NULL);
+		pthread_mutex_lock(&objdb_sync_lock);
+		objdb_sync_running = 0;
+		objdb_sync_stopping = 0;
+	}
+	pthread_mutex_unlock(&objdb_sync_lock);
+	if (objdb_journal && journal_size(objdb_journal))
+		objdb_checkpoint();
+	if (objdb_pack)
+		pack_save_index(objdb_pack);
+}
+
+/* keep a record found in the journal. */
+static int objdb_replay(void *p, const char *path, const void *data, size_t len)
+{
+	(void)p;
+	char *copy = malloc(len);
+	if (!copy) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return -1;
+	}
+	memcpy(copy, data, len);
+	pthread_mutex_lock(&objdb_cache_lock);
+	int e = objdb_dirty_set(path, copy, len);
+	pthread_mutex_unlock(&objdb_cache_lock);
+	if (e)
+		free(copy);
+	return e;
+}
+
+/* a journal left behind by a crash is replayed and written back, whichever
+ * backend is configured later. */
+static int objdb_recover(void)
+{
+	if (faccessat(objdb_fd, OBJDB_JOURNAL, F_OK, 0))
+		return 0; /* nothing to recover */
+	objdb_journal = journal_open(objdb_fd, OBJDB_JOURNAL);
+	if (!objdb_journal)
+		return -1;
+	long n = journal_replay(objdb_journal, objdb_replay, NULL);
+	if (n < 0)
+		return -1;
+	if (n)
+		log_info("%s:replayed %ld records", OBJDB_JOURNAL, n);
+	if (journal_size(objdb_journal) && objdb_checkpoint())
+		return -1;
+	return 0;
+}
+
 int objdb_rollback(struct objdb_txn *txn)
 {
 	if (objdb_root_check())
 		return NULL;
 
-	int e = unlinkat(objdb_fd, txn->tempfile, 0);
+	int e = txn->tempfile ? unlinkat(objdb_fd, txn->tempfile, 0) : 0;
 	if (e) {
-		perror(txn->tempfile);
+		log_error("%s:%s", txn->tempfile, strerror(errno));
 	}
 	objdb_txn_destroy(txn);
 	return e == 0;
@@ -193,10 +1414,12 @@ int objdb_setroot(const char *path)
 		 * and weird things could potentially happen, like the /tmp
 		 * file and the target file could end up in different
 		 * directories. -jon */
-		fprintf(stderr, "%s():changing DB path not permitted after initialization\n", __func__);
+		log_error("%s():changing DB path not permitted after initialization", __func__);
 		return -1;
 	}
 	free(objdb_root);
 	objdb_root = strdup(path);
-	return objdb_root_check();
+	if (objdb_root_check())
+		return -1;
+	return objdb_recover();
 }
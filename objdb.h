@@ -1,5 +1,6 @@
 #ifndef OBJDB_H
 #define OBJDB_H
+#include <stddef.h>
 #include <stdio.h>
 
 struct objdb_txn;
@@ -7,7 +8,16 @@ struct objdb_txn;
 struct objdb_txn *objdb_start(const char *path);
 FILE *objdb_f(struct objdb_txn *txn);
 struct object *objdb_load(const char *path);
+int objdb_load_async(const char *path, void (*done)(void *arg, struct object *obj), void *arg);
 int objdb_commit(struct objdb_txn *txn);
+int objdb_commit_async(struct objdb_txn *txn, void (*done)(void *arg, int ok), void *arg);
 int objdb_rollback(struct objdb_txn *txn);
 int objdb_setroot(const char *path);
+void objdb_cache_config(size_t budget);
+void objdb_cache_stats(unsigned *count, size_t *size);
+void objdb_pool_config(unsigned threads);
+int objdb_preload(unsigned threads);
+void objdb_sync_config(int on, unsigned window_ms, unsigned batch);
+int objdb_backend_config(const char *name, size_t checkpoint, size_t segment);
+void objdb_shutdown(void);
 #endif
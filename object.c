@@ -15,35 +15,113 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  *
  */
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "atom.h"
+#include "log.h"
 #include "object.h"
-#include "rc.h"
 #include "cencode.h"
 
+/* properties are kept in insertion order in prop, and found through an open
+ * addressed hash index. names are atoms, so a lookup compares pointers and
+ * never the strings. sorting for obj_save() is done on demand, by the first
+ * iterator after a new property was added.
+ *
+ * prop and index share one allocation, and every value is packed into one
+ * arena. an overwritten value is left behind as garbage until there is
+ * enough of it to be worth compacting the arena. numbers are held in the
+ * property itself. */
+struct obj_prop {
+	const struct atom *name;
+	unsigned type; /* enum obj_type */
+	unsigned len; /* of a string or ref, not counting the terminator */
+	union {
+		unsigned ofs; /* of a string or ref in the arena */
+		int64_t i;
+		double d;
+	} v;
+};
+
+/* strings and refs are kept in the arena */
+#define OBJ_IN_ARENA(p) ((p)->type == OBJ_STRING || (p)->type == OBJ_REF)
+
+struct obj_slot {
+	unsigned hash;
+	unsigned pos; /* offset into prop plus one, 0 for an empty slot */
+};
+
 struct object
 {
 	unsigned prop_len, prop_max;
-	char **prop; /* entries are stored as "key\0value\0" */
+	struct obj_prop *prop; /* the index follows prop_max entries */
+	struct obj_slot *index; /* 2 * prop_max slots */
+	char *arena;
+	unsigned arena_len, arena_max, arena_garbage;
+	int sorted; /* prop is in name order */
+	int frozen; /* no more changes, safe to share between threads */
+	struct object *parent; /* prototype for properties not set here */
 	int rc;
 };
 
+/* compact once this much of the arena, and over half of it, is garbage */
+#define OBJ_GARBAGE_MIN 256
+
 struct object *obj_new(void)
 {
 	struct object *o = calloc(1, sizeof(*o));
-	RETAIN(o);
+	if (!o) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return NULL;
+	}
+	o->rc = 1;
+	return o;
+}
+
+/* a new object that inherits every property of parent it doesn't set itself.
+ * parent is frozen, and can then be shared by children on any thread. */
+struct object *obj_new_child(struct object *parent)
+{
+	struct object *o = obj_new();
+	if (!o)
+		return NULL;
+	obj_freeze(parent);
+	obj_retain(parent);
+	o->parent = parent;
 	return o;
 }
 
+struct object *obj_parent(struct object *o)
+{
+	return o->parent;
+}
+
+/* references may be held by several threads through children */
 void obj_retain(struct object *o)
 {
-	RETAIN(o);
+	__atomic_add_fetch(&o->rc, 1, __ATOMIC_RELAXED);
 }
 
 void obj_release(struct object *o)
 {
-	RELEASE(o, obj_free);
+	if (o && !__atomic_sub_fetch(&o->rc, 1, __ATOMIC_ACQ_REL))
+		obj_free(o);
+}
+
+/* the number of references, for caches that may drop an unused object */
+int obj_refcount(struct object *o)
+{
+	return __atomic_load_n(&o->rc, __ATOMIC_ACQUIRE);
+}
+
+/* memory used by the object, not counting its parent */
+size_t obj_size(struct object *o)
+{
+	return sizeof(*o) + o->prop_max * (sizeof(*o->prop) + 2 * sizeof(*o->index)) +
+		o->arena_max;
 }
 
 void obj_free(struct object *o)
@@ -52,120 +130,510 @@ void obj_free(struct object *o)
 		return;
 	/* print an warning about destruction of referenced object */
 	if (o->rc) {
-		fprintf(stderr,
-			"WARNING:%s():object %p still have references (rc=%d)\n",
+		log_warning(
+			"%s():object %p still have references (rc=%d)",
 			__func__, o, o->rc);
 	}
-	while (o->prop_len) {
-		unsigned i = --o->prop_len;
-		free(o->prop[i]);
-		o->prop[i] = NULL;
-	}
+	if (o->parent)
+		obj_release(o->parent);
 	free(o->prop);
+	free(o->arena);
 	free(o);
 }
 
-static int obj_compar(const void *a, const void *b)
+/* put prop[pos] in the index, the index must have a free slot */
+static void obj_index_insert(struct object *o, unsigned hash, unsigned pos)
 {
-	return strcmp(*(char**)a, *(char**)b);
+	unsigned mask = o->prop_max * 2 - 1;
+	unsigned i = hash & mask;
+	while (o->index[i].pos)
+		i = (i + 1) & mask; /* linear probing */
+	o->index[i].hash = hash;
+	o->index[i].pos = pos + 1;
+}
+
+static void obj_index_rebuild(struct object *o)
+{
+	memset(o->index, 0, o->prop_max * 2 * sizeof(*o->index));
+	unsigned i;
+	for (i = 0; i < o->prop_len; i++)
+		obj_index_insert(o, atom_hash(o->prop[i].name), i);
+}
+
+/* make room for max properties, and the index with it. max is a power of 2 */
+static int obj_prop_resize(struct object *o, unsigned max)
+{
+	struct obj_prop *prop = malloc(max * sizeof(*prop) +
+		max * 2 * sizeof(*o->index));
+	if (!prop) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return -1;
+	}
+	if (o->prop_len)
+		memcpy(prop, o->prop, o->prop_len * sizeof(*prop));
+	free(o->prop);
+	o->prop = prop;
+	o->prop_max = max;
+	o->index = (struct obj_slot*)(prop + max);
+	obj_index_rebuild(o);
+	return 0;
+}
+
+/* double the room for properties */
+static int obj_prop_grow(struct object *o)
+{
+	return obj_prop_resize(o, o->prop_max ? o->prop_max * 2 : 4);
+}
+
+/* make room for props properties and bytes of strings up front, for a caller
+ * that knows roughly how big the object will be. */
+int obj_reserve(struct object *o, unsigned props, size_t bytes)
+{
+	unsigned max = o->prop_max ? o->prop_max : 4;
+	while (max < props)
+		max *= 2;
+	if (max > o->prop_max && obj_prop_resize(o, max))
+		return -1;
+	if (bytes > o->arena_max) {
+		char *arena = realloc(o->arena, bytes);
+		if (!arena) {
+			log_error("%s:%s", __func__, strerror(errno));
+			return -1;
+		}
+		o->arena = arena;
+		o->arena_max = bytes;
+	}
+	return 0;
+}
+
+/* copy live values into a new arena, at least len bytes bigger. */
+static int obj_arena_compact(struct object *o, unsigned len)
+{
+	unsigned max = 64;
+	while (max < o->arena_len - o->arena_garbage + len)
+		max *= 2;
+	char *arena = malloc(max);
+	if (!arena) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return -1;
+	}
+	unsigned cur = 0, i;
+	for (i = 0; i < o->prop_len; i++) {
+		struct obj_prop *p = &o->prop[i];
+		if (!OBJ_IN_ARENA(p))
+			continue;
+		memcpy(arena + cur, o->arena + p->v.ofs, p->len + 1);
+		p->v.ofs = cur;
+		cur += p->len + 1;
+	}
+	free(o->arena);
+	o->arena = arena;
+	o->arena_len = cur;
+	o->arena_max = max;
+	o->arena_garbage = 0;
+	return 0;
+}
+
+/* copy value to the end of the arena, return its offset or -1 on error. */
+static long obj_arena_add(struct object *o, const char *value, unsigned len)
+{
+	if (o->arena_len + len + 1 > o->arena_max) {
+		/* value may be one of our own */
+		long self = -1;
+		if (value >= o->arena && value < o->arena + o->arena_len)
+			self = value - o->arena;
+		if (o->arena_garbage >= OBJ_GARBAGE_MIN &&
+				o->arena_garbage * 2 >= o->arena_len) {
+			/* copy value out, compacting may move or drop it */
+			char *tmp = NULL;
+			if (self >= 0) {
+				tmp = strdup(value);
+				if (!tmp) {
+					log_error("%s:%s", __func__, strerror(errno));
+					return -1;
+				}
+			}
+			int e = obj_arena_compact(o, len + 1);
+			if (!e && tmp) {
+				memcpy(o->arena + o->arena_len, tmp, len + 1);
+				value = NULL; /* already in place */
+			}
+			free(tmp);
+			if (e)
+				return -1;
+		} else {
+			unsigned max = o->arena_max ? o->arena_max : 64;
+			while (max < o->arena_len + len + 1)
+				max *= 2;
+			char *arena = realloc(o->arena, max);
+			if (!arena) {
+				log_error("%s:%s", __func__, strerror(errno));
+				return -1;
+			}
+			o->arena = arena;
+			o->arena_max = max;
+			if (self >= 0)
+				value = arena + self;
+		}
+	}
+	unsigned ofs = o->arena_len;
+	if (value)
+		memcpy(o->arena + ofs, value, len + 1);
+	o->arena_len += len + 1;
+	return ofs;
 }
 
 /* return offset or -1 on error. */
-static int obj_lookup_offset(struct object *o, const char *name)
+static int obj_lookup_offset(struct object *o, const struct atom *name)
 {
 	if (!o->prop_len)
 		return -1; /* no match because list is empty */
-	char **res = bsearch(&name, o->prop, o->prop_len, sizeof(*o->prop), obj_compar);
-
-	if (res)
-		return res - o->prop;
+	unsigned hash = atom_hash(name);
+	unsigned mask = o->prop_max * 2 - 1;
+	unsigned i = hash & mask;
+	for (; o->index[i].pos; i = (i + 1) & mask) {
+		unsigned ofs = o->index[i].pos - 1;
+		if (o->prop[ofs].name == name)
+			return ofs;
+	}
 
 	return -1; /* no match */
 }
 
-const char *obj_get(struct object *o, const char *name)
+/* numbers are formatted into a few rotating buffers for obj_get(), enough
+ * for several in one printf. */
+#define OBJ_FMT_MAX 8
+static __thread char obj_fmt_buf[OBJ_FMT_MAX][32];
+static __thread unsigned obj_fmt_next;
+
+/* return the value of any type as a string. */
+static const char *obj_prop_string(struct object *o, const struct obj_prop *p)
+{
+	if (OBJ_IN_ARENA(p))
+		return o->arena + p->v.ofs;
+	char *buf = obj_fmt_buf[obj_fmt_next++ % OBJ_FMT_MAX];
+	if (p->type == OBJ_INT)
+		snprintf(buf, sizeof(obj_fmt_buf[0]), "%" PRId64, p->v.i);
+	else
+		snprintf(buf, sizeof(obj_fmt_buf[0]), "%.17g", p->v.d);
+	return buf;
+}
+
+/* find a property set on o itself. */
+static struct obj_prop *obj_prop_local(struct object *o, const struct atom *name)
 {
 	int ofs = obj_lookup_offset(o, name);
-	if (ofs < 0)
-		return NULL;
-	char *s = o->prop[ofs];
-	return s + strlen(s) + 1;
+	return ofs < 0 ? NULL : &o->prop[ofs];
 }
 
-/* create a new entry. */
-static char *obj_alloc_buffer(const char *name, const char *value)
+/* find a property on o or its parents, *op is set to the owner. */
+static struct obj_prop *obj_prop_find(struct object **op, const struct atom *name)
 {
-	int namelen = strlen(name) + 1;
-	int valuelen = strlen(value) + 1;
+	struct object *o;
+	for (o = *op; o; o = o->parent) {
+		int ofs = obj_lookup_offset(o, name);
+		if (ofs >= 0) {
+			*op = o;
+			return &o->prop[ofs];
+		}
+	}
+	return NULL;
+}
 
-	char *s = malloc(namelen + valuelen);
-	if (!s) {
-		perror(__func__);
-		return NULL;
+/* a name that was never interned can't be a property */
+static struct obj_prop *obj_prop_find_name(struct object **op, const char *name)
+{
+	const struct atom *a = atom_find(name);
+	return a ? obj_prop_find(op, a) : NULL;
+}
+
+/* append a new property, there must be room for it. */
+static struct obj_prop *obj_prop_add(struct object *o, const struct atom *name)
+{
+	obj_index_insert(o, atom_hash(name), o->prop_len);
+	o->sorted = !o->prop_len || (o->sorted &&
+		strcmp(atom_name(o->prop[o->prop_len - 1].name), atom_name(name)) < 0);
+	struct obj_prop *p = &o->prop[o->prop_len++];
+	p->name = name;
+	p->type = OBJ_INT;
+	p->len = 0;
+	p->v.i = 0;
+	return p;
+}
+
+/* the value returned is only good until the object is next modified. numbers
+ * are formatted on every call. */
+const char *obj_get_atom(struct object *o, const struct atom *name)
+{
+	struct obj_prop *p = obj_prop_find(&o, name);
+	return p ? obj_prop_string(o, p) : NULL;
+}
+
+const char *obj_get(struct object *o, const char *name)
+{
+	struct obj_prop *p = obj_prop_find_name(&o, name);
+	return p ? obj_prop_string(o, p) : NULL;
+}
+
+/* parse all of s as a base 10 integer. returns -1 if it isn't one, or is
+ * out of range. */
+static int obj_parse_int(const char *s, int64_t *out)
+{
+	char *end;
+	errno = 0;
+	long long n = strtoll(s, &end, 10);
+	if (end == s || *end || errno == ERANGE)
+		return -1;
+	*out = n;
+	return 0;
+}
+
+/* parse all of s as a double. returns -1 if it isn't one, or overflows. */
+static int obj_parse_double(const char *s, double *out)
+{
+	char *end;
+	errno = 0;
+	double d = strtod(s, &end);
+	if (end == s || *end || (errno == ERANGE && (d == HUGE_VAL || d == -HUGE_VAL)))
+		return -1;
+	*out = d;
+	return 0;
+}
+
+static int64_t obj_prop_int(struct object *o, struct obj_prop *p, int64_t def)
+{
+	if (!p)
+		return def;
+	int64_t n;
+	switch (p->type) {
+	case OBJ_INT:
+		return p->v.i;
+	case OBJ_DOUBLE:
+		/* out of range doubles are clamped, the cast would be undefined */
+		if (isnan(p->v.d))
+			return def;
+		if (p->v.d >= 9223372036854775808.0)
+			return INT64_MAX;
+		if (p->v.d < -9223372036854775808.0)
+			return INT64_MIN;
+		return p->v.d;
 	}
-	memcpy(s, name, namelen);
-	memcpy(s + namelen, value, valuelen);
-	return s;
+	return obj_parse_int(o->arena + p->v.ofs, &n) ? def : n;
 }
 
-int obj_set(struct object *o, const char *name, const char *value)
+static double obj_prop_double(struct object *o, struct obj_prop *p, double def)
 {
-	int ofs = obj_lookup_offset(o, name);
-	if (ofs >= 0) {
-		char *s = obj_alloc_buffer(name, value);
-		if (!s) {
-			return -1;
-		}
+	if (!p)
+		return def;
+	switch (p->type) {
+	case OBJ_INT:
+		return p->v.i;
+	case OBJ_DOUBLE:
+		return p->v.d;
+	}
+	double d;
+	return obj_parse_double(o->arena + p->v.ofs, &d) ? def : d;
+}
+
+/* numbers are converted between int and double. strings are parsed, def is
+ * returned if the property is missing or not a number. */
+int64_t obj_get_int_atom(struct object *o, const struct atom *name, int64_t def)
+{
+	struct obj_prop *p = obj_prop_find(&o, name);
+	return obj_prop_int(o, p, def);
+}
+
+int64_t obj_get_int(struct object *o, const char *name, int64_t def)
+{
+	struct obj_prop *p = obj_prop_find_name(&o, name);
+	return obj_prop_int(o, p, def);
+}
+
+double obj_get_double_atom(struct object *o, const struct atom *name, double def)
+{
+	struct obj_prop *p = obj_prop_find(&o, name);
+	return obj_prop_double(o, p, def);
+}
+
+double obj_get_double(struct object *o, const char *name, double def)
+{
+	struct obj_prop *p = obj_prop_find_name(&o, name);
+	return obj_prop_double(o, p, def);
+}
+
+/* return the path of a referenced object, or NULL if not a reference. */
+const char *obj_get_ref(struct object *o, const char *name)
+{
+	struct obj_prop *p = obj_prop_find_name(&o, name);
+	if (!p || p->type != OBJ_REF)
+		return NULL;
+	return o->arena + p->v.ofs;
+}
+
+/* return the enum obj_type of a property, or -1 if it is not set. */
+int obj_type(struct object *o, const char *name)
+{
+	struct obj_prop *p = obj_prop_find_name(&o, name);
+	return p ? (int)p->type : -1;
+}
 
-		free(o->prop[ofs]); /* free the old entry */
-		o->prop[ofs] = s; /* use the new entry */
+/* set a string or a ref. */
+static int obj_set_text(struct object *o, const struct atom *name,
+	unsigned type, const char *value)
+{
+	if (o->frozen) {
+		log_error("%s():object %p is frozen", __func__, o);
+		return -1;
+	}
+	unsigned len = strlen(value);
+	struct obj_prop *p = obj_prop_local(o, name);
+	if (p) {
+		if (OBJ_IN_ARENA(p) && len <= p->len) {
+			/* fits in the old value, memmove in case it overlaps */
+			memmove(o->arena + p->v.ofs, value, len + 1);
+			o->arena_garbage += p->len - len;
+			p->type = type;
+			p->len = len;
+			return 0;
+		}
+		long v = obj_arena_add(o, value, len);
+		if (v < 0)
+			return -1;
+		/* compacting keeps the old value too, it is garbage either way */
+		if (OBJ_IN_ARENA(p))
+			o->arena_garbage += p->len + 1;
+		p->type = type;
+		p->v.ofs = v;
+		p->len = len;
 
 		return 0; /* successfully updated */
 	}
 
 	/* make space if the length would exceed the allocated space */
-	if (o->prop_len >= o->prop_max) {
-		unsigned newsize = (o->prop_len + 1) * sizeof(*o->prop);
-
-		/* round up to next power of 2 */
-		newsize--;
-		newsize |= newsize >> 1;
-		newsize |= newsize >> 2;
-		newsize |= newsize >> 4;
-		newsize |= newsize >> 8;
-		newsize |= newsize >> 16;
-		newsize++;
-
-		char **newprop = realloc(o->prop, newsize);
-		if (!newprop) {
-			perror(__func__);
-			return -1;
-		}
-		o->prop = newprop;
-		o->prop_max = newsize / sizeof(*o->prop);
-	}
+	if (o->prop_len >= o->prop_max && obj_prop_grow(o))
+		return -1;
 
-	char *s = obj_alloc_buffer(name, value);
-	if (!s) {
+	long v = obj_arena_add(o, value, len);
+	if (v < 0)
 		return -1;
-	}
 
 	/* set new entry and increment length */
-	o->prop[o->prop_len++] = s;
+	p = obj_prop_add(o, name);
+	p->type = type;
+	p->v.ofs = v;
+	p->len = len;
 
-	/* the bsearch() requires the array to be sorted */
-	qsort(o->prop, o->prop_len, sizeof(*o->prop), obj_compar);
+	return 0;
+}
 
+/* find or add a property for a number, dropping any old string. */
+static struct obj_prop *obj_prop_number(struct object *o, const struct atom *name)
+{
+	if (o->frozen) {
+		log_error("%s():object %p is frozen", __func__, o);
+		return NULL;
+	}
+	struct obj_prop *p = obj_prop_local(o, name);
+	if (p) {
+		if (OBJ_IN_ARENA(p))
+			o->arena_garbage += p->len + 1;
+		p->len = 0;
+		return p;
+	}
+	if (o->prop_len >= o->prop_max && obj_prop_grow(o))
+		return NULL;
+	return obj_prop_add(o, name);
+}
+
+int obj_set_atom(struct object *o, const struct atom *name, const char *value)
+{
+	return obj_set_text(o, name, OBJ_STRING, value);
+}
+
+int obj_set(struct object *o, const char *name, const char *value)
+{
+	const struct atom *a = atom_intern(name);
+	if (!a)
+		return -1;
+	return obj_set_text(o, a, OBJ_STRING, value);
+}
+
+int obj_set_int_atom(struct object *o, const struct atom *name, int64_t value)
+{
+	struct obj_prop *p = obj_prop_number(o, name);
+	if (!p)
+		return -1;
+	p->type = OBJ_INT;
+	p->v.i = value;
 	return 0;
 }
 
-/* creates an iterator, but it's important that object is not modified until completed. */
+int obj_set_int(struct object *o, const char *name, int64_t value)
+{
+	const struct atom *a = atom_intern(name);
+	if (!a)
+		return -1;
+	return obj_set_int_atom(o, a, value);
+}
+
+int obj_set_double_atom(struct object *o, const struct atom *name, double value)
+{
+	struct obj_prop *p = obj_prop_number(o, name);
+	if (!p)
+		return -1;
+	p->type = OBJ_DOUBLE;
+	p->v.d = value;
+	return 0;
+}
+
+int obj_set_double(struct object *o, const char *name, double value)
+{
+	const struct atom *a = atom_intern(name);
+	if (!a)
+		return -1;
+	return obj_set_double_atom(o, a, value);
+}
+
+/* path is the objdb path of the referenced object. */
+int obj_set_ref(struct object *o, const char *name, const char *path)
+{
+	const struct atom *a = atom_intern(name);
+	if (!a)
+		return -1;
+	return obj_set_text(o, a, OBJ_REF, path);
+}
+
+static int obj_compar(const void *a, const void *b)
+{
+	const struct obj_prop *pa = a, *pb = b;
+	return strcmp(atom_name(pa->name), atom_name(pb->name));
+}
+
+/* creates an iterator, but it's important that object is not modified until
+ * completed. properties are visited in name order, only those set on the
+ * object itself and not inherited from its parent. */
 struct object_iter obj_iter_new(struct object *o)
 {
 	struct object_iter it = { .o = o };
+	if (!o->sorted && o->prop_len) {
+		qsort(o->prop, o->prop_len, sizeof(*o->prop), obj_compar);
+		/* positions have moved */
+		obj_index_rebuild(o);
+		o->sorted = 1;
+	}
 	return it;
 }
 
+/* no more changes are allowed. sorting is done now so that iterating over a
+ * shared object never modifies it. */
+void obj_freeze(struct object *o)
+{
+	if (o->frozen)
+		return;
+	obj_iter_new(o);
+	o->frozen = 1;
+}
+
 /* return 0 on end of list, and 1 if there are more items */
 int obj_iter_next(struct object_iter *it, const char **name, const char **value)
 {
@@ -173,12 +641,12 @@ int obj_iter_next(struct object_iter *it, const char **name, const char **value)
 	if (it->i >= o->prop_len) {
 		return 0;
 	}
-	const char *s = o->prop[it->i++];
+	const struct obj_prop *p = &o->prop[it->i++];
 
 	if (name)
-		*name = s;
+		*name = atom_name(p->name);
 	if (value)
-		*value = s + strlen(s) + 1;
+		*value = obj_prop_string(o, p);
 	return 1;
 }
 
@@ -186,23 +654,83 @@ int obj_iter_next(struct object_iter *it, const char **name, const char **value)
 static __thread char obj_line_buf[1 << 20];
 static __thread int obj_line_buf_max = sizeof(obj_line_buf);
 
-/* save to an open file */
+/* the type of a value is saved as a tag on the name */
+static const char *obj_type_tag[] = {
+	[OBJ_STRING] = "",
+	[OBJ_INT] = ":int",
+	[OBJ_DOUBLE] = ":double",
+	[OBJ_REF] = ":ref",
+};
+
+/* copy one property of src into dst. */
+static int obj_prop_copy(struct object *dst, struct object *src,
+	const struct obj_prop *p)
+{
+	switch (p->type) {
+	case OBJ_INT:
+		return obj_set_int_atom(dst, p->name, p->v.i);
+	case OBJ_DOUBLE:
+		return obj_set_double_atom(dst, p->name, p->v.d);
+	}
+	return obj_set_text(dst, p->name, p->type, src->arena + p->v.ofs);
+}
+
+/* copy every property of o, parents first so that overrides are set last. */
+static int obj_flatten(struct object *dst, struct object *o)
+{
+	if (o->parent && obj_flatten(dst, o->parent))
+		return -1;
+	unsigned i;
+	for (i = 0; i < o->prop_len; i++)
+		if (obj_prop_copy(dst, o, &o->prop[i]))
+			return -1;
+	return 0;
+}
+
+/* save to an open file. inherited properties are saved too, the result loads
+ * as an object without a parent. */
 int obj_save(struct object *o, FILE *f)
 {
-	struct object_iter it = obj_iter_new(o);
-	const char *name, *value;
-	while (obj_iter_next(&it, &name, &value)) {
+	if (o->parent) {
+		struct object *flat = obj_new();
+		if (!flat)
+			return -1;
+		int e = obj_flatten(flat, o) ? -1 : obj_save_local(flat, f);
+		obj_release(flat);
+		return e;
+	}
+	return obj_save_local(o, f);
+}
+
+/* save only the properties set on o itself, not those it inherits. load the
+ * result with obj_load_child() to get the same object back. */
+int obj_save_local(struct object *o, FILE *f)
+{
+	obj_iter_new(o); /* sorts the properties */
+	unsigned i;
+	for (i = 0; i < o->prop_len; i++) {
+		const struct obj_prop *p = &o->prop[i];
+		const char *name = atom_name(p->name);
+		const char *value = obj_prop_string(o, p);
+		const char *tag = obj_type_tag[p->type];
 		int outlen;
 		char *cur = obj_line_buf;
 		int rem = obj_line_buf_max - 1;
 		/* name */
 		size_t namelen = strlen(name);
-		/* TODO: remove '=' from the key as it will mess up obj_load() */
-		outlen = c_encode(cur, rem, name, namelen);
+		/* escape the separators, the type tag and '=' must be the only ones */
+		outlen = c_encode_special(cur, rem, name, namelen, ":=");
 		if (outlen == -1 || outlen > rem - 1)
 			return -1; /* failure */
 		cur += outlen;
 		rem -= outlen;
+		/* type */
+		size_t taglen = strlen(tag);
+		if (taglen > (size_t)rem - 2)
+			return -1; /* failure */
+		memcpy(cur, tag, taglen);
+		cur += taglen;
+		rem -= taglen;
 		/* seperator */
 		*cur++ = '=';
 		rem--;
@@ -224,11 +752,39 @@ int obj_save(struct object *o, FILE *f)
 	return 0;
 }
 
+static struct object *obj_load_into(struct object *o, FILE *f, const char *tag);
+
 /* create a new object and load from an open file.
  * optionally a tag can be provided for error messages. */
 struct object *obj_load(FILE *f, const char *tag)
+{
+	return obj_load_hint(f, tag, 0, 0);
+}
+
+/* like obj_load, with room reserved for props properties and bytes of strings.
+ * the hint only saves allocations, it need not be exact. */
+struct object *obj_load_hint(FILE *f, const char *tag, unsigned props, size_t bytes)
 {
 	struct object *o = obj_new();
+	if (!o || obj_reserve(o, props, bytes)) {
+		obj_release(o);
+		return NULL;
+	}
+	return obj_load_into(o, f, tag);
+}
+
+/* like obj_load, the new object inherits from parent. */
+struct object *obj_load_child(FILE *f, const char *tag, struct object *parent)
+{
+	struct object *o = parent ? obj_new_child(parent) : obj_new();
+	if (!o)
+		return NULL;
+	return obj_load_into(o, f, tag);
+}
+
+/* load properties into o, which is released on failure. */
+static struct object *obj_load_into(struct object *o, FILE *f, const char *tag)
+{
 	int end_of_file = 0; /* look for "%%END%%" */
 	int line = 0;
 	if (!tag)
@@ -238,10 +794,10 @@ struct object *obj_load(FILE *f, const char *tag)
 		line++;
 		char *end = strrchr(obj_line_buf, '\n');
 		if (!end) {
-			fprintf(stderr,
-				"ERROR:%s:%d:truncated file or line exceeds maximum length!\n",
+			log_error(
+				"%s:%d:truncated file or line exceeds maximum length!",
 				tag, line);
-			RELEASE(o, obj_free);
+			obj_release(o);
 			return NULL;
 		}
 		*end = 0; /* discard the newline */
@@ -252,18 +808,33 @@ struct object *obj_load(FILE *f, const char *tag)
 		/* process the line as name=value */
 		char *value = strchr(obj_line_buf, '=');
 		if (!value) {
-			fprintf(stderr,
-				"ERROR:%s:%d:line missing separator!\n",
+			log_error(
+				"%s:%d:line missing separator!",
 				tag, line);
-			RELEASE(o, obj_free);
+			obj_release(o);
 			return NULL;
 		}
 		*value = 0;
 		value++;
 
+		/* an optional type follows the name, a ':' in the name itself
+		 * is escaped so the tag is found before decoding */
+		char *name = obj_line_buf;
+		unsigned type = OBJ_STRING;
+		char *sep = strrchr(name, ':');
+		if (sep) {
+			unsigned t;
+			for (t = OBJ_INT; t <= OBJ_REF; t++)
+				if (!strcmp(sep, obj_type_tag[t]))
+					break;
+			if (t <= OBJ_REF) {
+				*sep = 0;
+				type = t;
+			}
+		}
+
 		int e;
 		/* obj_line_buf is name, decode name in place */
-		char *name = obj_line_buf;
 		size_t namemax = strlen(obj_line_buf) + 1;
 		e = c_decode(obj_line_buf, namemax, obj_line_buf, namemax);
 		if (e == -1)
@@ -274,29 +845,47 @@ struct object *obj_load(FILE *f, const char *tag)
 		if (e == -1)
 			goto parse_error;
 
-		e = obj_set(o, name, value);
+		int64_t num_int;
+		double num_double;
+		switch (type) {
+		case OBJ_STRING:
+			e = obj_set(o, name, value);
+			break;
+		case OBJ_INT:
+			if (obj_parse_int(value, &num_int))
+				goto parse_error;
+			e = obj_set_int(o, name, num_int);
+			break;
+		case OBJ_DOUBLE:
+			if (obj_parse_double(value, &num_double))
+				goto parse_error;
+			e = obj_set_double(o, name, num_double);
+			break;
+		default:
+			e = obj_set_ref(o, name, value);
+		}
 		if (e == -1) {
-			fprintf(stderr,
-				"ERROR:%s:%d:unable to set property!\n",
+			log_error(
+				"%s:%d:unable to set property!",
 				tag, line);
-			RELEASE(o, obj_free);
+			obj_release(o);
 			return NULL;
 		}
 	}
 
 	if (!end_of_file) {
-		fprintf(stderr,
-			"ERROR:%s:%d:truncated file missing END tag!\n",
+		log_error(
+			"%s:%d:truncated file missing END tag!",
 			tag, line);
-		RELEASE(o, obj_free);
+		obj_release(o);
 		return NULL;
 	}
 
 	return o;
 parse_error:
-	fprintf(stderr,
-		"ERROR:%s:%d:parse error!\n",
+	log_error(
+		"%s:%d:parse error!",
 		tag, line);
-	RELEASE(o, obj_free);
+	obj_release(o);
 	return NULL;
 }
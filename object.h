@@ -1,18 +1,44 @@
 #ifndef OBJECT_H
 #define OBJECT_H
+#include <stddef.h>
+#include <stdint.h>
 struct object;
+struct atom;
+enum obj_type { OBJ_STRING, OBJ_INT, OBJ_DOUBLE, OBJ_REF };
 struct object_iter {
 	struct object *o;
 	unsigned i;
 };
 struct object *obj_new(void);
+struct object *obj_new_child(struct object *parent);
+struct object *obj_parent(struct object *o);
+void obj_freeze(struct object *o);
 void obj_retain(struct object *o);
 void obj_release(struct object *o);
 void obj_free(struct object *o);
+int obj_refcount(struct object *o);
+size_t obj_size(struct object *o);
+int obj_reserve(struct object *o, unsigned props, size_t bytes);
 const char *obj_get(struct object *o, const char *name);
 int obj_set(struct object *o, const char *name, const char *value);
+const char *obj_get_atom(struct object *o, const struct atom *name);
+int obj_set_atom(struct object *o, const struct atom *name, const char *value);
+int64_t obj_get_int(struct object *o, const char *name, int64_t def);
+int64_t obj_get_int_atom(struct object *o, const struct atom *name, int64_t def);
+int obj_set_int(struct object *o, const char *name, int64_t value);
+int obj_set_int_atom(struct object *o, const struct atom *name, int64_t value);
+double obj_get_double(struct object *o, const char *name, double def);
+double obj_get_double_atom(struct object *o, const struct atom *name, double def);
+int obj_set_double(struct object *o, const char *name, double value);
+int obj_set_double_atom(struct object *o, const struct atom *name, double value);
+const char *obj_get_ref(struct object *o, const char *name);
+int obj_set_ref(struct object *o, const char *name, const char *path);
+int obj_type(struct object *o, const char *name);
 struct object_iter obj_iter_new(struct object *o);
 int obj_iter_next(struct object_iter *it, const char **name, const char **value);
 int obj_save(struct object *o, FILE *f);
+int obj_save_local(struct object *o, FILE *f);
 struct object *obj_load(FILE *f, const char *tag);
+struct object *obj_load_hint(FILE *f, const char *tag, unsigned props, size_t bytes);
+struct object *obj_load_child(FILE *f, const char *tag, struct object *parent);
 #endif
@@ -0,0 +1,795 @@
+/*
+ * Copyright 2015 Jon Mayo <jon@cobra-kai.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "grow.h"
+#include "log.h"
+#include "packfile.h"
+
+/* objects are appended as records to large segment files, and found through
+ * an index of path to (segment, offset). a newer record for a path makes the
+ * old one dead, and a segment that is mostly dead is compacted by copying
+ * its live records to the end of the active segment. compaction copies at
+ * most PACK_COMPACT_CHUNK bytes of a segment per call, so that a large
+ * segment never holds up the thread that commits.
+ *
+ * the index is saved when the pack is closed. records after the saved index
+ * are found again by scanning the segments when the pack is opened, so the
+ * segments alone are enough to rebuild it.
+ *
+ * only one thread may change the pack. readers may run on any thread. */
+
+#define PACK_DIR ".pack"
+#define PACK_INDEX "index"
+#define PACK_RECORD_MAGIC 0x4b434150u /* "PACK" */
+#define PACK_INDEX_MAGIC 0x58444950u /* "PIDX" */
+#define PACK_COMPACT_CHUNK (1 << 20)
+
+struct pack_record {
+	uint32_t magic;
+	uint32_t pathlen, datalen;
+	uint32_t crc; /* of path and data */
+};
+
+struct pack_seg {
+	int fd; /* -1 if there is no such segment */
+	int unsynced; /* appended since the last pack_sync() */
+	off_t size, dead; /* dead bytes belong to superseded records */
+};
+
+struct pack_entry {
+	struct pack_entry *next;
+	unsigned seg;
+	uint32_t len; /* of the whole record */
+	off_t off;
+	char path[];
+};
+
+struct pack {
+	int dirfd;
+	int dir_unsynced; /* a segment was created or removed */
+	pthread_rwlock_t lock; /* readers against changes to the index */
+	size_t segment_max;
+	struct pack_seg *segs; /* indexed by segment number */
+	unsigned nsegs, segs_max, active;
+	struct pack_entry **bucket; /* power of 2 buckets */
+	unsigned buckets, count;
+	int compacting; /* compact_seg is copied up to compact_ofs */
+	unsigned compact_seg;
+	off_t compact_ofs, compact_moved;
+};
+
+static unsigned pack_hash(const char *path)
+{
+	/* FNV-1a */
+	unsigned h = 2166136261u;
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/* return the link to the entry for path, or to where it would go. */
+static struct pack_entry **pack_find(struct pack *p, const char *path)
+{
+	struct pack_entry **e = &p->bucket[pack_hash(path) & (p->buckets - 1)];
+	for (; *e; e = &(*e)->next)
+		if (!strcmp((*e)->path, path))
+			break;
+	return e;
+}
+
+static int pack_index_grow(struct pack *p)
+{
+	if (p->count < p->buckets)
+		return 0;
+	unsigned buckets = p->buckets ? p->buckets * 2 : 1024;
+	struct pack_entry **table = calloc(buckets, sizeof(*table));
+	if (!table) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return -1;
+	}
+	unsigned i;
+	for (i = 0; i < p->buckets; i++) {
+		struct pack_entry *e, *next;
+		for (e = p->bucket[i]; e; e = next) {
+			next = e->next;
+			unsigned h = pack_hash(e->path) & (buckets - 1);
+			e->next = table[h];
+			table[h] = e;
+		}
+	}
+	free(p->bucket);
+	p->bucket = table;
+	p->buckets = buckets;
+	return 0;
+}
+
+/* point path at a record, the record it replaces becomes dead.
+ * caller must hold the write lock, or be the only thread. */
+static int pack_index_set(struct pack *p, const char *path, unsigned seg, off_t off, uint32_t len)
+{
+	if (pack_index_grow(p))
+		return -1;
+	struct pack_entry **link = pack_find(p, path);
+	struct pack_entry *e = *link;
+	if (e) {
+		p->segs[e->seg].dead += e->len;
+	} else {
+		size_t pathlen = strlen(path) + 1;
+		e = malloc(sizeof(*e) + pathlen);
+		if (!e) {
+			log_error("%s:%s", __func__, strerror(errno));
+			return -1;
+		}
+		memcpy(e->path, path, pathlen);
+		e->next = NULL;
+		*link = e;
+		p->count++;
+	}
+	e->seg = seg;
+	e->off = off;
+	e->len = len;
+	return 0;
+}
+
+static void pack_seg_name(char *name, size_t max, unsigned seg)
+{
+	snprintf(name, max, "%08u.seg", seg);
+}
+
+/* open segment seg, creating it if create is set. */
+static int pack_seg_open(struct pack *p, unsigned seg, int create)
+{
+	if (seg >= p->nsegs) {
+		if (grow(&p->segs, &p->segs_max, seg + 1, sizeof(*p->segs)))
+			return -1;
+		unsigned i;
+		for (i = p->nsegs; i <= seg; i++)
+			p->segs[i].fd = -1;
+		p->nsegs = seg + 1;
+	}
+	char name[32];
+	pack_seg_name(name, sizeof(name), seg);
+	int fd = openat(p->dirfd, name, O_RDWR | O_APPEND | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0666);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st)) {
+		log_error("%s/%s:%s", PACK_DIR, name, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	p->segs[seg].fd = fd;
+	p->segs[seg].size = st.st_size;
+	p->segs[seg].dead = 0;
+	p->segs[seg].unsynced = 0;
+	if (create)
+		p->dir_unsynced = 1;
+	return 0;
+}
+
+/* read len bytes of a segment at off, -1 on failure. */
+static int pack_seg_pread(struct pack *p, unsigned seg, char *buf, size_t len, off_t off)
+{
+	size_t have = 0;
+	while (have < len) {
+		ssize_t e = pread(p->segs[seg].fd, buf + have, len - have, off + have);
+		if (e <= 0) {
+			log_error("%s:segment %u:%s", PACK_DIR, seg, e < 0 ? strerror(errno) : "short read");
+			return -1;
+		}
+		have += e;
+	}
+	return 0;
+}
+
+/* read a whole segment, NULL on failure. */
+static char *pack_seg_read(struct pack *p, unsigned seg)
+{
+	struct pack_seg *s = &p->segs[seg];
+	char *buf = malloc(s->size ? s->size : 1);
+	if (!buf) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return NULL;
+	}
+	if (pack_seg_pread(p, seg, buf, s->size, 0)) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/* return the length of the valid record at buf, or 0 if it is not one. */
+static size_t pack_record_check(const char *buf, size_t avail)
+{
+	struct pack_record rec;
+	if (avail < sizeof(rec))
+		return 0;
+	memcpy(&rec, buf, sizeof(rec));
+	if (rec.magic != PACK_RECORD_MAGIC || rec.pathlen >= PATH_MAX ||
+			sizeof(rec) + rec.pathlen + rec.datalen > avail ||
+			memchr(buf + sizeof(rec), 0, rec.pathlen))
+		return 0;
+	const Bytef *path = (const Bytef*)buf + sizeof(rec);
+	if (crc32(crc32(0, path, rec.pathlen), path + rec.pathlen, rec.datalen) != rec.crc)
+		return 0;
+	return sizeof(rec) + rec.pathlen + rec.datalen;
+}
+
+/* index the records of a segment from offset start. a torn record ends the
+ * segment, and it is cut off there. */
+static int pack_seg_scan(struct pack *p, unsigned seg, off_t start)
+{
+	struct pack_seg *s = &p->segs[seg];
+	if (start >= s->size)
+		return 0;
+	char *buf = pack_seg_read(p, seg);
+	if (!buf)
+		return -1;
+	off_t ofs = start;
+	char path[PATH_MAX];
+	while (ofs < s->size) {
+		size_t len = pack_record_check(buf + ofs, s->size - ofs);
+		if (!len)
+			break;
+		struct pack_record rec;
+		memcpy(&rec, buf + ofs, sizeof(rec));
+		memcpy(path, buf + ofs + sizeof(rec), rec.pathlen);
+		path[rec.pathlen] = 0;
+		if (pack_index_set(p, path, seg, ofs, len)) {
+			free(buf);
+			return -1;
+		}
+		ofs += len;
+	}
+	free(buf);
+	if (ofs < s->size) {
+		log_warning("%s:segment %u:torn record at offset %lld, discarding %lld bytes",
+			PACK_DIR, seg, (long long)ofs, (long long)(s->size - ofs));
+		if (ftruncate(s->fd, ofs)) {
+			log_error("%s:%s", PACK_DIR, strerror(errno));
+			return -1;
+		}
+		s->size = ofs;
+	}
+	return 0;
+}
+
+/* the saved index is a header, then the size and dead bytes indexed of each
+ * segment, then every entry followed by its path, then a crc of it all. */
+struct pack_index_header {
+	uint32_t magic;
+	uint32_t nsegs, count;
+};
+
+struct pack_index_seg {
+	uint64_t size, dead;
+};
+
+struct pack_index_entry {
+	uint32_t seg, len, pathlen;
+	uint64_t off;
+};
+
+/* load the saved index, and set start[] to the indexed size of each segment.
+ * returns -1 if there is no usable index, the caller clears what was loaded. */
+static int pack_index_load(struct pack *p, off_t *start)
+{
+	int fd = openat(p->dirfd, PACK_INDEX, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	char *buf = NULL;
+	if (fstat(fd, &st) || st.st_size < (off_t)(sizeof(struct pack_index_header) + 4) ||
+			!(buf = malloc(st.st_size)) || pread(fd, buf, st.st_size, 0) != st.st_size) {
+		close(fd);
+		free(buf);
+		return -1;
+	}
+	close(fd);
+
+	size_t size = st.st_size - 4, ofs = sizeof(struct pack_index_header);
+	uint32_t crc;
+	memcpy(&crc, buf + size, 4);
+	struct pack_index_header h;
+	memcpy(&h, buf, sizeof(h));
+	if (crc != crc32(0, (const Bytef*)buf, size) || h.magic != PACK_INDEX_MAGIC ||
+			h.nsegs > p->nsegs ||
+			ofs + h.nsegs * sizeof(struct pack_index_seg) > size) {
+		log_warning("%s/%s:invalid, rebuilding", PACK_DIR, PACK_INDEX);
+		free(buf);
+		return -1;
+	}
+	unsigned i;
+	for (i = 0; i < h.nsegs; i++, ofs += sizeof(struct pack_index_seg)) {
+		struct pack_index_seg s;
+		memcpy(&s, buf + ofs, sizeof(s));
+		if (p->segs[i].fd < 0)
+			continue; /* compacted away since */
+		if ((off_t)s.size > p->segs[i].size) {
+			/* cut short by a crash, the order of records is lost */
+			log_warning("%s/%s:segment %u is short, rebuilding", PACK_DIR, PACK_INDEX, i);
+			free(buf);
+			return -1;
+		}
+		start[i] = s.size;
+		p->segs[i].dead = s.dead;
+	}
+	char path[PATH_MAX];
+	for (i = 0; i < h.count; i++) {
+		struct pack_index_entry e;
+		if (ofs + sizeof(e) > size)
+			break;
+		memcpy(&e, buf + ofs, sizeof(e));
+		ofs += sizeof(e);
+		if (e.pathlen >= sizeof(path) || ofs + e.pathlen > size)
+			break;
+		memcpy(path, buf + ofs, e.pathlen);
+		path[e.pathlen] = 0;
+		ofs += e.pathlen;
+		/* the live records of a compacted segment were copied, the scan finds them */
+		if (e.seg < h.nsegs && start[e.seg] && (off_t)(e.off + e.len) <= start[e.seg])
+			if (pack_index_set(p, path, e.seg, e.off, e.len))
+				break;
+	}
+	free(buf);
+	if (i < h.count) {
+		log_warning("%s/%s:invalid, rebuilding", PACK_DIR, PACK_INDEX);
+		return -1;
+	}
+	return 0;
+}
+
+static void pack_index_clear(struct pack *p)
+{
+	unsigned i;
+	for (i = 0; i < p->buckets; i++) {
+		struct pack_entry *e, *next;
+		for (e = p->bucket[i]; e; e = next) {
+			next = e->next;
+			free(e);
+		}
+		p->bucket[i] = NULL;
+	}
+	p->count = 0;
+	for (i = 0; i < p->nsegs; i++)
+		p->segs[i].dead = 0;
+}
+
+/* write buf to f, and add it to the crc. */
+static void pack_index_write(FILE *f, uLong *crc, const void *buf, size_t len)
+{
+	*crc = crc32(*crc, buf, len);
+	fwrite(buf, 1, len, f);
+}
+
+int pack_save_index(struct pack *p)
+{
+	static const char temp[] = PACK_INDEX ".tmp";
+	int fd = openat(p->dirfd, temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	FILE *f = fd < 0 ? NULL : fdopen(fd, "w");
+	if (!f) {
+		log_error("%s/%s:%s", PACK_DIR, temp, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	uLong crc = crc32(0, NULL, 0);
+	struct pack_index_header h = {PACK_INDEX_MAGIC, p->nsegs, p->count};
+	pack_index_write(f, &crc, &h, sizeof(h));
+	unsigned i;
+	for (i = 0; i < p->nsegs; i++) {
+		struct pack_index_seg s = {p->segs[i].size, p->segs[i].dead};
+		pack_index_write(f, &crc, &s, sizeof(s));
+	}
+	for (i = 0; i < p->buckets; i++) {
+		struct pack_entry *e;
+		for (e = p->bucket[i]; e; e = e->next) {
+			struct pack_index_entry ie = {e->seg, e->len, strlen(e->path), e->off};
+			pack_index_write(f, &crc, &ie, sizeof(ie));
+			pack_index_write(f, &crc, e->path, ie.pathlen);
+		}
+	}
+	uint32_t sum = crc;
+	fwrite(&sum, 1, sizeof(sum), f);
+	if (fflush(f) || ferror(f) || fdatasync(fileno(f))) {
+		log_error("%s/%s:%s", PACK_DIR, temp, strerror(errno));
+		fclose(f);
+		unlinkat(p->dirfd, temp, 0);
+		return -1;
+	}
+	fclose(f);
+	if (renameat(p->dirfd, temp, p->dirfd, PACK_INDEX) || fsync(p->dirfd)) {
+		log_error("%s/%s:%s", PACK_DIR, PACK_INDEX, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* start a new active segment. */
+static int pack_roll(struct pack *p)
+{
+	unsigned seg = p->nsegs;
+	/* readers look at segs, which may move */
+	pthread_rwlock_wrlock(&p->lock);
+	int ret = pack_seg_open(p, seg, 1);
+	pthread_rwlock_unlock(&p->lock);
+	if (ret)
+		return -1;
+	p->active = seg;
+	return 0;
+}
+
+/* find the segments and load or rebuild the index. */
+static int pack_load(struct pack *p)
+{
+	DIR *d;
+	int fd = dup(p->dirfd);
+	if (fd < 0 || !(d = fdopendir(fd))) {
+		log_error("%s:%s", PACK_DIR, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	struct dirent *de;
+	int ret = 0;
+	while (!ret && (de = readdir(d))) {
+		unsigned seg;
+		char name[32], end;
+		if (sscanf(de->d_name, "%u.se%c", &seg, &end) != 2 || end != 'g')
+			continue;
+		pack_seg_name(name, sizeof(name), seg);
+		if (strcmp(name, de->d_name))
+			continue;
+		ret = pack_seg_open(p, seg, 0);
+	}
+	closedir(d);
+	if (ret)
+		return -1;
+
+	off_t *start = calloc(p->nsegs + 1, sizeof(*start));
+	if (!start) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return -1;
+	}
+	if (pack_index_load(p, start)) {
+		pack_index_clear(p);
+		memset(start, 0, (p->nsegs + 1) * sizeof(*start));
+	}
+	/* records after the index, in the order they were written */
+	unsigned i;
+	for (i = 0; i < p->nsegs; i++)
+		if (p->segs[i].fd >= 0 && pack_seg_scan(p, i, start[i])) {
+			free(start);
+			return -1;
+		}
+	free(start);
+
+	if (!p->nsegs || p->segs[p->nsegs - 1].size >= (off_t)p->segment_max)
+		return pack_roll(p);
+	p->active = p->nsegs - 1;
+	return 0;
+}
+
+static void pack_free(struct pack *p)
+{
+	if (p->bucket)
+		pack_index_clear(p);
+	free(p->bucket);
+	unsigned i;
+	for (i = 0; i < p->nsegs; i++)
+		if (p->segs[i].fd >= 0)
+			close(p->segs[i].fd);
+	free(p->segs);
+	if (p->dirfd >= 0)
+		close(p->dirfd);
+	pthread_rwlock_destroy(&p->lock);
+	free(p);
+}
+
+struct pack *pack_open(int rootfd, size_t segment_max)
+{
+	struct pack *p = calloc(1, sizeof(*p));
+	if (!p) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return NULL;
+	}
+	p->segment_max = segment_max;
+	pthread_rwlock_init(&p->lock, NULL);
+	if (mkdirat(rootfd, PACK_DIR, 0777) ? errno != EEXIST : fsync(rootfd)) {
+		/* a new directory is lost with every segment in it unless its
+		 * entry in the root is on disk */
+		log_error("%s:%s", PACK_DIR, strerror(errno));
+		p->dirfd = -1;
+	} else {
+		p->dirfd = openat(rootfd, PACK_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (p->dirfd < 0)
+			log_error("%s:%s", PACK_DIR, strerror(errno));
+	}
+	if (p->dirfd < 0 || pack_index_grow(p) || pack_load(p)) {
+		pack_free(p);
+		return NULL;
+	}
+	unsigned i, n = 0;
+	for (i = 0; i < p->nsegs; i++)
+		n += p->segs[i].fd >= 0;
+	log_info("%s:%u objects in %u segments", PACK_DIR, p->count, n);
+	return p;
+}
+
+int pack_close(struct pack *p)
+{
+	if (!p)
+		return 0;
+	int ret = pack_sync(p) | pack_save_index(p);
+	pack_free(p);
+	return ret;
+}
+
+/* write one whole record at the end of the active segment. */
+static int pack_write(struct pack *p, const char *path, struct iovec *iov, int iovcnt, size_t len)
+{
+	struct pack_seg *s = &p->segs[p->active];
+	if (s->size && s->size + (off_t)len > (off_t)p->segment_max) {
+		if (pack_roll(p))
+			return -1;
+		s = &p->segs[p->active];
+	}
+	ssize_t e = writev(s->fd, iov, iovcnt);
+	if (e != (ssize_t)len) {
+		log_error("%s:segment %u:%s", PACK_DIR, p->active, e < 0 ? strerror(errno) : "short write");
+		/* don't leave a torn record in front of the next one */
+		if (e > 0 && ftruncate(s->fd, s->size))
+			log_error("%s:segment %u:%s", PACK_DIR, p->active, strerror(errno));
+		return -1;
+	}
+	off_t off = s->size;
+	s->unsynced = 1;
+	pthread_rwlock_wrlock(&p->lock);
+	s->size += len;
+	int ret = pack_index_set(p, path, p->active, off, len);
+	pthread_rwlock_unlock(&p->lock);
+	return ret;
+}
+
+int pack_append(struct pack *p, const char *path, const void *data, size_t len)
+{
+	size_t pathlen = strlen(path);
+	if (pathlen >= PATH_MAX || len > UINT32_MAX - sizeof(struct pack_record) - pathlen) {
+		errno = ENAMETOOLONG;
+		log_error("%s:%s", path, strerror(errno));
+		return -1;
+	}
+	struct pack_record rec = {PACK_RECORD_MAGIC, pathlen, len, 0};
+	rec.crc = crc32(crc32(0, (const Bytef*)path, pathlen), data, len);
+	struct iovec iov[3] = {
+		{&rec, sizeof(rec)},
+		{(void*)path, pathlen},
+		{(void*)data, len},
+	};
+	return pack_write(p, path, iov, 3, sizeof(rec) + pathlen + len);
+}
+
+int pack_sync(struct pack *p)
+{
+	int ret = 0;
+	unsigned i;
+	for (i = 0; i < p->nsegs; i++) {
+		struct pack_seg *s = &p->segs[i];
+		if (!s->unsynced)
+			continue;
+		if (fdatasync(s->fd)) {
+			log_error("%s:segment %u:%s", PACK_DIR, i, strerror(errno));
+			ret = -1;
+			continue;
+		}
+		s->unsynced = 0;
+	}
+	if (p->dir_unsynced) {
+		if (fsync(p->dirfd)) {
+			log_error("%s:%s", PACK_DIR, strerror(errno));
+			ret = -1;
+		} else {
+			p->dir_unsynced = 0;
+		}
+	}
+	return ret;
+}
+
+void *pack_read(struct pack *p, const char *path, size_t *len)
+{
+	pthread_rwlock_rdlock(&p->lock);
+	struct pack_entry *e = *pack_find(p, path);
+	if (!e) {
+		pthread_rwlock_unlock(&p->lock);
+		errno = ENOENT;
+		return NULL;
+	}
+	unsigned seg = e->seg;
+	size_t reclen = e->len;
+	char *buf = malloc(reclen);
+	ssize_t got = -1;
+	if (buf)
+		got = pread(p->segs[seg].fd, buf, reclen, e->off);
+	int err = errno;
+	pthread_rwlock_unlock(&p->lock);
+	if (!buf || got != (ssize_t)reclen || pack_record_check(buf, reclen) != reclen) {
+		log_error("%s:segment %u:%s", path, seg,
+			!buf || got < 0 ? strerror(err) : "bad record");
+		free(buf);
+		errno = EIO;
+		return NULL;
+	}
+	struct pack_record rec;
+	memcpy(&rec, buf, sizeof(rec));
+	memmove(buf, buf + sizeof(rec) + rec.pathlen, rec.datalen);
+	*len = rec.datalen;
+	return buf;
+}
+
+/* copy the live records of the next chunk of the segment being compacted.
+ * returns 1 once the whole segment is copied, 0 if there is more, -1 on
+ * failure. */
+static int pack_compact_step(struct pack *p)
+{
+	unsigned seg = p->compact_seg;
+	off_t ofs = p->compact_ofs, size = p->segs[seg].size;
+	if (ofs >= size)
+		return 1;
+	size_t want = size - ofs < PACK_COMPACT_CHUNK ? size - ofs : PACK_COMPACT_CHUNK;
+	/* a record bigger than the chunk is read whole */
+	struct pack_record rec;
+	if (size - ofs >= (off_t)sizeof(rec) &&
+			!pack_seg_pread(p, seg, (char*)&rec, sizeof(rec), ofs) &&
+			rec.magic == PACK_RECORD_MAGIC) {
+		off_t first = sizeof(rec) + (off_t)rec.pathlen + rec.datalen;
+		if (first > (off_t)want && first <= size - ofs)
+			want = first;
+	}
+	char *buf = malloc(want);
+	if (!buf) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return -1;
+	}
+	if (pack_seg_pread(p, seg, buf, want, ofs)) {
+		free(buf);
+		return -1;
+	}
+	/* copy the records the index still points at, one cut off by the end
+	 * of the chunk is left for the next step */
+	size_t pos = 0;
+	char path[PATH_MAX];
+	while (pos < want) {
+		size_t len = pack_record_check(buf + pos, want - pos);
+		if (!len)
+			break;
+		memcpy(&rec, buf + pos, sizeof(rec));
+		memcpy(path, buf + pos + sizeof(rec), rec.pathlen);
+		path[rec.pathlen] = 0;
+		struct pack_entry *e = *pack_find(p, path);
+		if (e && e->seg == seg && e->off == ofs + (off_t)pos) {
+			struct iovec iov = {buf + pos, len};
+			if (pack_write(p, path, &iov, 1, len)) {
+				free(buf);
+				return -1;
+			}
+			p->compact_moved += len;
+		}
+		pos += len;
+	}
+	free(buf);
+	if (!pos) {
+		log_error("%s:segment %u:bad record at offset %lld, not compacting",
+			PACK_DIR, seg, (long long)ofs);
+		return -1;
+	}
+	p->compact_ofs = ofs + pos;
+	return p->compact_ofs >= size;
+}
+
+/* take the next step of compacting, starting on the segment with the most
+ * dead bytes if at least half of it is. returns 1 when a segment has been
+ * removed, 0 if there was nothing to do or there is more to do, -1 on
+ * failure. */
+int pack_compact(struct pack *p)
+{
+	unsigned i, seg = p->nsegs;
+	if (!p->compacting) {
+		for (i = 0; i < p->nsegs; i++) {
+			struct pack_seg *s = &p->segs[i];
+			if (i == p->active || s->fd < 0 || !s->size || s->dead * 2 < s->size)
+				continue;
+			if (seg == p->nsegs || s->dead > p->segs[seg].dead)
+				seg = i;
+		}
+		if (seg == p->nsegs)
+			return 0;
+		p->compacting = 1;
+		p->compact_seg = seg;
+		p->compact_ofs = 0;
+		p->compact_moved = 0;
+	}
+	seg = p->compact_seg;
+	int e = pack_compact_step(p);
+	if (e < 0)
+		p->compacting = 0; /* start over later */
+	if (e <= 0)
+		return e;
+	p->compacting = 0;
+
+	/* the copies must be durable before the originals go */
+	if (pack_sync(p))
+		return -1;
+	struct pack_seg *s = &p->segs[seg];
+	off_t size = s->size;
+	char name[32];
+	pack_seg_name(name, sizeof(name), seg);
+	pthread_rwlock_wrlock(&p->lock);
+	int fd = s->fd;
+	s->fd = -1;
+	s->size = 0;
+	s->dead = 0;
+	pthread_rwlock_unlock(&p->lock);
+	close(fd);
+	if (unlinkat(p->dirfd, name, 0)) {
+		log_error("%s/%s:%s", PACK_DIR, name, strerror(errno));
+		return -1;
+	}
+	p->dir_unsynced = 1;
+	log_debug("%s:compacted segment %u, %lld of %lld bytes moved",
+		PACK_DIR, seg, (long long)p->compact_moved, (long long)size);
+	return 1;
+}
+
+unsigned pack_count(struct pack *p)
+{
+	pthread_rwlock_rdlock(&p->lock);
+	unsigned n = p->count;
+	pthread_rwlock_unlock(&p->lock);
+	return n;
+}
+
+/* call f for the path of every object in the pack, stopping early if it
+ * returns non-zero. */
+int pack_foreach(struct pack *p, int (*f)(void *arg, const char *path), void *arg)
+{
+	int ret = 0;
+	unsigned i;
+	pthread_rwlock_rdlock(&p->lock);
+	for (i = 0; !ret && i < p->buckets; i++) {
+		struct pack_entry *e;
+		for (e = p->bucket[i]; !ret && e; e = e->next)
+			ret = f(arg, e->path);
+	}
+	pthread_rwlock_unlock(&p->lock);
+	return ret;
+}
@@ -0,0 +1,14 @@
+#ifndef PACKFILE_H
+#define PACKFILE_H
+#include <stddef.h>
+struct pack;
+struct pack *pack_open(int rootfd, size_t segment_max);
+int pack_close(struct pack *p);
+int pack_append(struct pack *p, const char *path, const void *data, size_t len);
+int pack_sync(struct pack *p);
+void *pack_read(struct pack *p, const char *path, size_t *len);
+int pack_compact(struct pack *p);
+int pack_save_index(struct pack *p);
+unsigned pack_count(struct pack *p);
+int pack_foreach(struct pack *p, int (*f)(void *arg, const char *path), void *arg);
+#endif
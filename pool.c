@@ -0,0 +1,77 @@
+/*
+ * Copyright 2015 Jon Mayo <jon@cobra-kai.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "pool.h"
+
+/* items are carved out of slabs that are never given back, freed items are
+ * kept on a free list for the next pool_alloc(). a pool is not locked, give
+ * each thread its own. */
+
+struct pool_slab {
+	struct pool_slab *next;
+};
+
+static int pool_grow(struct pool *pool)
+{
+	size_t size = pool->size < sizeof(void*) ? sizeof(void*) : pool->size;
+	/* keep every item aligned for any type */
+	size = (size + sizeof(long double) - 1) & ~(sizeof(long double) - 1);
+	size_t head = (sizeof(struct pool_slab) + sizeof(long double) - 1) & ~(sizeof(long double) - 1);
+	struct pool_slab *slab = malloc(head + size * pool->per_slab);
+	if (!slab) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return -1;
+	}
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+	/* thread the new items onto the free list */
+	char *item = (char*)slab + head;
+	unsigned i;
+	for (i = 0; i < pool->per_slab; i++, item += size) {
+		*(void**)item = pool->free;
+		pool->free = item;
+	}
+	pool->total += pool->per_slab;
+	return 0;
+}
+
+/* pool_alloc() returns an uninitialized item, or NULL on failure. */
+void *pool_alloc(struct pool *pool)
+{
+	if (!pool->free && pool_grow(pool))
+		return NULL;
+	void *item = pool->free;
+	pool->free = *(void**)item;
+	pool->used++;
+	return item;
+}
+
+void pool_free(struct pool *pool, void *item)
+{
+	if (!item)
+		return;
+	*(void**)item = pool->free;
+	pool->free = item;
+	pool->used--;
+}
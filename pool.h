@@ -0,0 +1,18 @@
+#ifndef POOL_H
+#define POOL_H
+#include <stddef.h>
+
+/* fixed size items allocated a slab at a time */
+struct pool {
+	size_t size; /* of one item */
+	unsigned per_slab;
+	unsigned used, total; /* items handed out, items in all slabs */
+	void *free;
+	struct pool_slab *slabs;
+};
+
+#define POOL_INIT(size, per_slab) { (size), (per_slab), 0, 0, NULL, NULL }
+
+void *pool_alloc(struct pool *pool);
+void pool_free(struct pool *pool, void *item);
+#endif
@@ -0,0 +1,221 @@
+/*
+ * Copyright 2015 Jon Mayo <jon@cobra-kai.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "sched.h"
+#include "timer.h"
+
+/* fair command scheduler.
+ *
+ * input is queued per entity rather than run as it is read. every pass takes
+ * the entities with work in round-robin order and runs at most a quantum of
+ * commands from each. a token bucket limits how many commands an entity can
+ * run per second, a full queue drops new commands. so a flood only delays the
+ * entity sending it.
+ *
+ * every thread has its own run list, entities are scheduled on the thread
+ * that owns them. */
+
+/* limits shared by every entity, set once at startup */
+static unsigned long sched_rate = 20; /* commands per second */
+static unsigned long sched_burst = 40; /* commands that can be saved up */
+static unsigned sched_quantum = 4; /* commands per entity per pass */
+static unsigned sched_depth = 100; /* commands queued per entity */
+
+#define SCHED_TOKEN 1000 /* tokens are counted in thousandths */
+
+static __thread struct sched_entity *sched_head, **sched_tail;
+static __thread struct sched_stats sched_totals;
+static __thread struct timer sched_timer;
+
+/* sched_config() sets the limits, a rate of 0 turns off the token bucket. */
+void sched_config(unsigned long rate, unsigned long burst, unsigned quantum, unsigned depth)
+{
+	sched_rate = rate;
+	sched_burst = burst ? burst : 1;
+	sched_quantum = quantum ? quantum : 1;
+	sched_depth = depth ? depth : 1;
+}
+
+void sched_init(struct sched_entity *e, int (*run)(struct sched_entity *e, const char *line, size_t len))
+{
+	memset(e, 0, sizeof(*e));
+	e->tail = &e->head;
+	e->tokens = sched_burst * SCHED_TOKEN;
+	e->last = timer_now();
+	e->run = run;
+}
+
+static void sched_link(struct sched_entity *e)
+{
+	if (!sched_tail)
+		sched_tail = &sched_head;
+	e->next = NULL;
+	e->prev = sched_tail;
+	*sched_tail = e;
+	sched_tail = &e->next;
+	sched_totals.runnable++;
+}
+
+static void sched_unlink(struct sched_entity *e)
+{
+	if (!e->prev)
+		return;
+	*e->prev = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		sched_tail = e->prev;
+	e->next = NULL;
+	e->prev = NULL;
+	sched_totals.runnable--;
+}
+
+/* sched_push() queues a copy of a command line.
+ * returns 0 on success, -1 if it was dropped. */
+int sched_push(struct sched_entity *e, const char *line, size_t len)
+{
+	if (e->depth >= sched_depth) {
+		e->dropped++;
+		sched_totals.dropped++;
+		return -1;
+	}
+	struct sched_cmd *cmd = malloc(sizeof(*cmd) + len + 1);
+	if (!cmd) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return -1;
+	}
+	cmd->next = NULL;
+	cmd->len = len;
+	memcpy(cmd->line, line, len);
+	cmd->line[len] = 0;
+	*e->tail = cmd;
+	e->tail = &cmd->next;
+	e->depth++;
+	sched_totals.queued++;
+	if (e->depth > sched_totals.max_depth)
+		sched_totals.max_depth = e->depth;
+	if (!e->prev)
+		sched_link(e);
+	return 0;
+}
+
+/* sched_remove() discards everything queued and takes e off the run list. */
+void sched_remove(struct sched_entity *e)
+{
+	sched_unlink(e);
+	while (e->head) {
+		struct sched_cmd *cmd = e->head;
+		e->head = cmd->next;
+		free(cmd);
+	}
+	e->tail = &e->head;
+	sched_totals.queued -= e->depth;
+	e->depth = 0;
+}
+
+static void sched_refill(struct sched_entity *e, unsigned long long now)
+{
+	unsigned long long max = sched_burst * SCHED_TOKEN;
+	if (now > e->last && e->tokens < max) {
+		unsigned long long add = (now - e->last) * sched_rate;
+		e->tokens = add >= max - e->tokens ? max : e->tokens + add;
+	}
+	e->last = now;
+}
+
+/* milliseconds until e has a token */
+static unsigned long sched_wait(const struct sched_entity *e)
+{
+	if (!sched_rate || e->tokens >= SCHED_TOKEN)
+		return 0;
+	return (SCHED_TOKEN - e->tokens + sched_rate - 1) / sched_rate;
+}
+
+static void sched_timeout(struct timer *t, void *p)
+{
+	(void)t;
+	(void)p;
+	sched_run();
+}
+
+/* sched_run() makes one pass over the entities with work. if work is left,
+ * a timer makes sure the event loop comes back for it. */
+void sched_run(void)
+{
+	unsigned long long now = timer_now();
+	unsigned n = sched_totals.runnable;
+	unsigned long wait = ~0UL;
+
+	while (n-- > 0 && sched_head) {
+		struct sched_entity *e = sched_head;
+		unsigned quantum = sched_quantum;
+		int gone = 0;
+
+		/* move to the back first, a command may remove e */
+		sched_unlink(e);
+		if (sched_rate)
+			sched_refill(e, now);
+		while (quantum-- > 0 && e->head) {
+			if (sched_rate) {
+				if (e->tokens < SCHED_TOKEN) {
+					e->throttled++;
+					sched_totals.throttled++;
+					break;
+				}
+				e->tokens -= SCHED_TOKEN;
+			}
+			struct sched_cmd *cmd = e->head;
+			e->head = cmd->next;
+			if (!e->head)
+				e->tail = &e->head;
+			e->depth--;
+			sched_totals.queued--;
+			sched_totals.ran++;
+			gone = e->run(e, cmd->line, cmd->len);
+			free(cmd);
+			if (gone)
+				break;
+		}
+		if (gone || !e->head)
+			continue;
+		if (!e->prev)
+			sched_link(e);
+		unsigned long w = sched_wait(e);
+		if (w < wait)
+			wait = w;
+	}
+
+	if (!sched_head) {
+		timer_cancel(&sched_timer);
+		return;
+	}
+	if (!sched_timer.fn)
+		timer_init(&sched_timer, sched_timeout, NULL);
+	timer_add(&sched_timer, wait);
+}
+
+/* sched_stats() returns the totals for this thread. */
+const struct sched_stats *sched_stats(void)
+{
+	return &sched_totals;
+}
@@ -0,0 +1,36 @@
+#ifndef SCHED_H
+#define SCHED_H
+#include <stddef.h>
+
+struct sched_cmd {
+	struct sched_cmd *next;
+	size_t len;
+	char line[];
+};
+
+/* embedded in anything that runs commands */
+struct sched_entity {
+	struct sched_entity *next, **prev; /* on the run list while it has work */
+	struct sched_cmd *head, **tail;
+	unsigned depth; /* commands queued */
+	unsigned long long tokens; /* token bucket, in thousandths */
+	unsigned long long last; /* time of the last refill */
+	unsigned long dropped, throttled;
+	/* return non-zero if e was closed and must not be touched again */
+	int (*run)(struct sched_entity *e, const char *line, size_t len);
+};
+
+struct sched_stats {
+	unsigned runnable; /* entities with work */
+	unsigned queued; /* commands waiting */
+	unsigned max_depth; /* deepest queue seen */
+	unsigned long long ran, dropped, throttled;
+};
+
+void sched_config(unsigned long rate, unsigned long burst, unsigned quantum, unsigned depth);
+void sched_init(struct sched_entity *e, int (*run)(struct sched_entity *e, const char *line, size_t len));
+int sched_push(struct sched_entity *e, const char *line, size_t len);
+void sched_remove(struct sched_entity *e);
+void sched_run(void);
+const struct sched_stats *sched_stats(void);
+#endif
@@ -0,0 +1,850 @@
+/*
+ * Copyright 2015 Jon Mayo <jon@cobra-kai.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "grow.h"
+#include "log.h"
+#include "metrics.h"
+#include "rc.h"
+#include "sock.h"
+#include "timer.h"
+
+/* maximum number of events collected by one epoll_wait() */
+#define SOCKPOLL_BATCH 256
+
+/* io_uring sizing */
+#define URING_SQ_ENTRIES 1024
+#define URING_CQ_ENTRIES 16384
+#define URING_RBUF_SIZE 4096 /* receive staging buffer per connection */
+#define URING_WBUF_MIN 4096
+#define URING_WBUF_MAX (256 * 1024) /* send buffer limit per connection */
+
+/* an operation submitted to the ring. the op owns its buffer, so it can
+ * outlive the socket if the socket is closed while the op is in flight. */
+struct sockop {
+	SOCKET fd;
+	unsigned char type;
+	unsigned char inflight;
+	unsigned char orphan; /* socket was closed, free on completion */
+	unsigned char latched; /* recv hit EOF or an error, see res */
+	int res; /* 0 for EOF, -errno for errors */
+	unsigned ofs, len, max;
+	char *buf;
+};
+
+#define SOCKOP_ACCEPT (1)
+#define SOCKOP_RECV (2)
+#define SOCKOP_SEND (3)
+
+/* the table is indexed by fd and grows on demand. each thread has its own
+ * table and poller, so a thread only sees the sockets it added. */
+static __thread struct socket_info {
+	struct sockbase *ptr;
+	long events; /* EVENT_READ and EVENT_WRITE currently registered */
+	/* io_uring state */
+	long ready; /* events waiting to be dispatched */
+	unsigned char listener;
+	struct sockop *rd; /* accept or recv */
+	struct sockop *wr; /* send */
+	SOCKET *accepted; /* connections completed by multishot accept */
+	unsigned accepted_len, accepted_max;
+} *sockets;
+static __thread unsigned sockets_max;
+static __thread int sockets_count;
+static __thread int sockets_epfd = -1;
+static __thread int sockets_uring; /* non-zero if the io_uring backend is active */
+
+/* io_uring backend: sockets with completions waiting to be dispatched */
+static __thread SOCKET *sockets_pending;
+static __thread unsigned sockets_pending_len, sockets_pending_max;
+
+static __thread struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned to_submit;
+	int multishot; /* cleared if the kernel rejects multishot accept */
+} uring = { .fd = -1 };
+
+void sockerror(const char *reason)
+{
+	log_error("%s:%s", reason, strerror(errno));
+}
+
+static struct socket_info *sockinfo(SOCKET fd)
+{
+	if (fd == INVALID_SOCKET || (unsigned)fd >= sockets_max)
+		return NULL;
+	if (!sockets[fd].ptr)
+		return NULL;
+	return &sockets[fd];
+}
+
+/******************************************************************************/
+/* io_uring backend */
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, int timeout)
+{
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout / 1000,
+		.tv_nsec = (timeout % 1000) * 1000000L,
+	};
+	struct io_uring_getevents_arg arg = {
+		.sigmask_sz = _NSIG / 8,
+		.ts = timeout < 0 ? 0 : (unsigned long)&ts, /* -1 waits forever */
+	};
+	unsigned flags = IORING_ENTER_EXT_ARG;
+	if (min_complete)
+		flags |= IORING_ENTER_GETEVENTS;
+	int e = syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete,
+		flags, &arg, sizeof(arg));
+	if (e >= 0)
+		uring.to_submit -= (unsigned)e < uring.to_submit ? (unsigned)e : uring.to_submit;
+	return e;
+}
+
+static int uring_init(void)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_CQ_ENTRIES;
+
+	int fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+	if (fd < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+		errno = ENOTSUP;
+		close(fd);
+		return -1;
+	}
+
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_size > sq_size)
+			sq_size = cq_size;
+		cq_size = sq_size;
+	}
+
+	char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	char *cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) {
+			munmap(sq, sq_size);
+			close(fd);
+			return -1;
+		}
+	}
+	void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+		IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		if (cq != sq)
+			munmap(cq, cq_size);
+		munmap(sq, sq_size);
+		close(fd);
+		return -1;
+	}
+
+	uring.fd = fd;
+	uring.sq_head = (unsigned*)(sq + p.sq_off.head);
+	uring.sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	uring.sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	uring.sq_entries = (unsigned*)(sq + p.sq_off.ring_entries);
+	uring.sq_array = (unsigned*)(sq + p.sq_off.array);
+	uring.cq_head = (unsigned*)(cq + p.cq_off.head);
+	uring.cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	uring.cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	uring.sqes = sqes;
+	uring.multishot = 1;
+	return 0;
+}
+
+/* uring_sqe() returns a cleared submission entry. the entry is queued and
+ * will be submitted in a batch by the next sockpoll(). */
+static struct io_uring_sqe *uring_sqe(void)
+{
+	unsigned tail = *uring.sq_tail;
+	unsigned head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head >= *uring.sq_entries) {
+		/* submission queue is full, push it to the kernel early */
+		if (uring_enter(uring.to_submit, 0, 0) < 0)
+			return NULL;
+		head = __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head >= *uring.sq_entries)
+			return NULL;
+	}
+	unsigned idx = tail & *uring.sq_mask;
+	struct io_uring_sqe *sqe = &uring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	uring.sq_array[idx] = idx;
+	__atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	uring.to_submit++;
+	return sqe;
+}
+
+static struct sockop *sockop_new(SOCKET fd, int type, unsigned max)
+{
+	struct sockop *op = calloc(1, sizeof(*op));
+	if (!op) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return NULL;
+	}
+	op->fd = fd;
+	op->type = type;
+	if (max) {
+		op->buf = malloc(max);
+		if (!op->buf) {
+			log_error("%s:%s", __func__, strerror(errno));
+			free(op);
+			return NULL;
+		}
+		op->max = max;
+	}
+	return op;
+}
+
+static void sockop_free(struct sockop *op)
+{
+	if (!op)
+		return;
+	free(op->buf);
+	free(op);
+}
+
+/* queue fd for dispatch by sockpoll() */
+static void uring_ready(SOCKET fd, struct socket_info *info, long event)
+{
+	if (!info->ready) {
+		if (grow(&sockets_pending, &sockets_pending_max,
+				sockets_pending_len + 1, sizeof(*sockets_pending)))
+			return;
+		sockets_pending[sockets_pending_len++] = fd;
+	}
+	info->ready |= event;
+}
+
+/* arm an accept or receive on fd if one isn't already outstanding */
+static void uring_arm_read(SOCKET fd, struct socket_info *info)
+{
+	if (!(info->events & EVENT_READ))
+		return;
+	if (!info->rd) {
+		info->rd = info->listener ?
+			sockop_new(fd, SOCKOP_ACCEPT, 0) :
+			sockop_new(fd, SOCKOP_RECV, URING_RBUF_SIZE);
+		if (!info->rd)
+			return;
+	}
+	struct sockop *op = info->rd;
+	if (op->inflight || op->latched || op->ofs < op->len)
+		return; /* busy, finished, or data waiting to be consumed */
+
+	struct io_uring_sqe *sqe = uring_sqe();
+	if (!sqe)
+		return;
+	sqe->fd = fd;
+	sqe->user_data = (unsigned long)op;
+	if (op->type == SOCKOP_ACCEPT) {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		if (uring.multishot)
+			sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+	} else {
+		/* a read rather than a recv, so eventfds work too */
+		sqe->opcode = IORING_OP_READ;
+		sqe->off = -1; /* current position, required for streams */
+		sqe->addr = (unsigned long)op->buf;
+		sqe->len = op->max;
+		op->ofs = op->len = 0;
+	}
+	op->inflight = 1;
+}
+
+/* arm a send of any buffered output */
+static void uring_arm_write(SOCKET fd, struct socket_info *info)
+{
+	struct sockop *op = info->wr;
+	if (!op || op->inflight || op->latched || op->ofs >= op->len)
+		return;
+	struct io_uring_sqe *sqe = uring_sqe();
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)(op->buf + op->ofs);
+	sqe->len = op->len - op->ofs;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (unsigned long)op;
+	op->inflight = 1;
+}
+
+static int uring_writable(struct socket_info *info)
+{
+	struct sockop *op = info->wr;
+	return !op || op->latched || op->len < URING_WBUF_MAX;
+}
+
+/* uring_cancel() detaches an op from its socket. */
+static void uring_cancel(struct sockop *op)
+{
+	if (!op)
+		return;
+	if (!op->inflight) {
+		sockop_free(op);
+		return;
+	}
+	op->orphan = 1;
+	struct io_uring_sqe *sqe = uring_sqe();
+	if (sqe) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = (unsigned long)op;
+		sqe->user_data = 0; /* completion is ignored */
+	}
+}
+
+static void uring_complete(struct sockop *op, int res, unsigned flags)
+{
+	if (op->type == SOCKOP_ACCEPT && op->orphan && res >= 0)
+		close(res); /* listener is gone */
+	if (!(flags & IORING_CQE_F_MORE))
+		op->inflight = 0;
+	if (op->orphan) {
+		if (!op->inflight)
+			sockop_free(op);
+		return;
+	}
+
+	SOCKET fd = op->fd;
+	struct socket_info *info = sockinfo(fd);
+	if (!info) {
+		/* should not happen, sockclose() orphans all ops */
+		log_error("%s:fd %d has no owner!", __func__, fd);
+		return;
+	}
+
+	switch (op->type) {
+	case SOCKOP_ACCEPT:
+		if (res == -EINVAL && uring.multishot) {
+			/* older kernel, use one shot accepts from now on */
+			uring.multishot = 0;
+		} else if (res >= 0) {
+			if (grow(&info->accepted, &info->accepted_max,
+					info->accepted_len + 1, sizeof(*info->accepted))) {
+				close(res);
+				break;
+			}
+			info->accepted[info->accepted_len++] = res;
+			uring_ready(fd, info, EVENT_READ);
+		} else if (res != -EAGAIN && res != -EINTR && res != -ECANCELED) {
+			errno = -res;
+			sockerror("accept()");
+		}
+		uring_arm_read(fd, info);
+		break;
+	case SOCKOP_RECV:
+		if (res > 0) {
+			op->ofs = 0;
+			op->len = res;
+		} else if (res == -EAGAIN || res == -EINTR) {
+			uring_arm_read(fd, info);
+			break;
+		} else {
+			op->latched = 1;
+			op->res = res;
+		}
+		uring_ready(fd, info, EVENT_READ);
+		break;
+	case SOCKOP_SEND:
+		if (res >= 0) {
+			op->ofs += res;
+			if (op->ofs >= op->len)
+				op->ofs = op->len = 0;
+		} else if (res != -EAGAIN && res != -EINTR) {
+			op->latched = 1;
+			op->res = res;
+		}
+		uring_arm_write(fd, info);
+		if (!op->inflight && !op->latched && !op->len) {
+			/* drained, idle connections don't keep a send buffer */
+			info->wr = NULL;
+			sockop_free(op);
+		}
+		if (info->events & EVENT_WRITE)
+			uring_ready(fd, info, EVENT_WRITE);
+		break;
+	}
+}
+
+static void uring_reap(void)
+{
+	unsigned head = *uring.cq_head;
+	unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+		struct sockop *op = (struct sockop*)(unsigned long)cqe->user_data;
+		int res = cqe->res;
+		unsigned flags = cqe->flags;
+		head++;
+		/* release the slot before the callback can queue more */
+		__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+		if (op)
+			uring_complete(op, res, flags);
+		tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+	}
+}
+
+static int uring_poll(int timeout, unsigned long long *start)
+{
+	/* submit everything queued since the last poll in one syscall */
+	unsigned wait = sockets_pending_len ? 0 : 1;
+	int e = uring_enter(uring.to_submit, wait, timeout);
+	if (e < 0 && errno != EINTR && errno != ETIME && errno != EBUSY) {
+		sockerror("io_uring_enter()");
+		return -1;
+	}
+	*start = metrics_now();
+	uring_reap();
+
+	/* dispatch only what was pending before the callbacks ran */
+	unsigned i, n = sockets_pending_len;
+	for (i = 0; i < n; i++) {
+		SOCKET fd = sockets_pending[i];
+		struct socket_info *info = sockinfo(fd);
+		if (!info)
+			continue;
+		long event = info->ready & info->events;
+		info->ready = 0;
+		if (!event)
+			continue;
+		struct sockbase *s = info->ptr;
+		RETAIN(s);
+		s->event(fd, s, event);
+		/* like level triggered polling, revisit unconsumed input */
+		info = sockinfo(fd);
+		if (info && info->ptr == s && (info->events & EVENT_READ) &&
+				info->rd && info->rd->type == SOCKOP_RECV &&
+				!info->rd->inflight &&
+				(info->rd->ofs < info->rd->len || info->rd->latched))
+			uring_ready(fd, info, EVENT_READ);
+		RELEASE(s, s->free);
+	}
+	sockets_pending_len -= n;
+	memmove(sockets_pending, sockets_pending + n,
+		sockets_pending_len * sizeof(*sockets_pending));
+	return 0;
+}
+
+/******************************************************************************/
+
+static int epoll_init(void)
+{
+	if (sockets_epfd == -1) {
+		sockets_epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (sockets_epfd == -1) {
+			sockerror("epoll_create1()");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* sockinit() selects the polling backend, "epoll" or "uring". if the backend
+ * is unavailable epoll is used. must be called before sockadd(). */
+int sockinit(const char *backend)
+{
+	if (sockets_count) {
+		log_error("%s():sockets already in use", __func__);
+		return -1;
+	}
+	if (backend && !strcmp(backend, "uring")) {
+		if (!uring_init()) {
+			sockets_uring = 1;
+			return 0;
+		}
+		log_warning("io_uring unavailable (%s), using epoll", strerror(errno));
+	} else if (backend && strcmp(backend, "epoll")) {
+		log_warning("unknown io backend \"%s\", using epoll", backend);
+	}
+	return epoll_init();
+}
+
+/* sockbackend() returns the name of the active backend */
+const char *sockbackend(void)
+{
+	return sockets_uring ? "uring" : "epoll";
+}
+
+static int sockupdate(SOCKET fd, struct socket_info *info, long events)
+{
+	if (info->events == events)
+		return 0; /* no change, skip the syscall */
+	if (sockets_uring) {
+		info->events = events;
+		if (events & EVENT_READ) {
+			uring_arm_read(fd, info);
+			if (info->accepted_len || (info->rd &&
+					(info->rd->ofs < info->rd->len || info->rd->latched)))
+				uring_ready(fd, info, EVENT_READ);
+		}
+		if ((events & EVENT_WRITE) && uring_writable(info))
+			uring_ready(fd, info, EVENT_WRITE);
+		return 0;
+	}
+	struct epoll_event ev = { .data.fd = fd };
+	if (events & EVENT_READ)
+		ev.events |= EPOLLIN;
+	if (events & EVENT_WRITE)
+		ev.events |= EPOLLOUT;
+	if (epoll_ctl(sockets_epfd, EPOLL_CTL_MOD, fd, &ev)) {
+		sockerror("epoll_ctl()");
+		return -1;
+	}
+	info->events = events;
+	return 0;
+}
+
+/* sockclose() closes the fd. if the fd was registered with sockadd() then the
+ * reference held by the table is released. */
+void sockclose(SOCKET fd)
+{
+	if (fd == INVALID_SOCKET) {
+		log_error("%s:fd is invalid!", __func__);
+		return;
+	}
+
+	struct sockbase *ptr = NULL;
+	struct socket_info *info = sockinfo(fd);
+	if (info) {
+		ptr = info->ptr;
+		if (sockets_uring) {
+			uring_cancel(info->rd);
+			uring_cancel(info->wr);
+			while (info->accepted_len)
+				close(info->accepted[--info->accepted_len]);
+			free(info->accepted);
+		} else {
+			epoll_ctl(sockets_epfd, EPOLL_CTL_DEL, fd, NULL);
+		}
+		memset(info, 0, sizeof(*info));
+		sockets_count--;
+	}
+	close(fd);
+	if (ptr)
+		RELEASE(ptr, ptr->free);
+}
+
+int sockset(SOCKET fd, long events)
+{
+	struct socket_info *info = sockinfo(fd);
+	if (!info)
+		return -1;
+	return sockupdate(fd, info, info->events | events);
+}
+
+int sockclr(SOCKET fd, long events)
+{
+	struct socket_info *info = sockinfo(fd);
+	if (!info)
+		return -1;
+	return sockupdate(fd, info, info->events & ~events);
+}
+
+/* sockadd() registers fd with the poller. the table takes over the caller's
+ * reference to ptr, it is released by sockclose(). */
+int sockadd(SOCKET fd, struct sockbase *ptr, long events,
+	void (*event)(SOCKET fd, struct sockbase *ptr, long event),
+	void (*free)(struct sockbase *ptr))
+{
+	if (fd == INVALID_SOCKET)
+		return -1;
+	if (!sockets_uring && epoll_init())
+		return -1;
+	if (grow(&sockets, &sockets_max, fd + 1, sizeof(*sockets)))
+		return -1;
+	if (sockets[fd].ptr) {
+		log_error("%s:fd %d already registered!", __func__, fd);
+		return -1;
+	}
+	events &= EVENT_READ | EVENT_WRITE;
+
+	if (sockets_uring) {
+		/* listening sockets get accepts, everything else gets reads */
+		int listener = 0;
+		socklen_t len = sizeof(listener);
+		if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listener, &len))
+			listener = 0;
+		sockets[fd].listener = listener != 0;
+	} else {
+		struct epoll_event ev = { .data.fd = fd };
+		if (events & EVENT_READ)
+			ev.events |= EPOLLIN;
+		if (events & EVENT_WRITE)
+			ev.events |= EPOLLOUT;
+		if (epoll_ctl(sockets_epfd, EPOLL_CTL_ADD, fd, &ev)) {
+			sockerror("epoll_ctl()");
+			return -1;
+		}
+	}
+
+	sockets_count++;
+	sockets[fd].ptr = ptr;
+	ptr->event = event;
+	ptr->free = (void(*)(void*))free;
+	if (sockets_uring)
+		sockupdate(fd, &sockets[fd], events);
+	else
+		sockets[fd].events = events;
+	return 0;
+}
+
+/* sockread() reads from a connection registered with sockadd().
+ * same return values as read(). */
+ssize_t sockread(SOCKET fd, void *buf, size_t len)
+{
+	if (!sockets_uring)
+		return read(fd, buf, len);
+
+	struct socket_info *info = sockinfo(fd);
+	struct sockop *op = info ? info->rd : NULL;
+	if (!op || op->type != SOCKOP_RECV) {
+		errno = info ? EAGAIN : EBADF;
+		return -1;
+	}
+	if (op->ofs < op->len) {
+		size_t n = op->len - op->ofs;
+		if (n > len)
+			n = len;
+		memcpy(buf, op->buf + op->ofs, n);
+		op->ofs += n;
+		if (op->ofs >= op->len)
+			uring_arm_read(fd, info); /* keep a receive in flight */
+		return n;
+	}
+	if (op->latched) {
+		if (!op->res)
+			return 0; /* EOF */
+		errno = -op->res;
+		return -1;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+/* sockwrite() writes to a connection registered with sockadd().
+ * same return values as write(). with io_uring the data is copied to a send
+ * buffer and submitted with everything else on the next sockpoll(). */
+ssize_t sockwrite(SOCKET fd, const void *buf, size_t len)
+{
+	if (!sockets_uring)
+		return send(fd, buf, len, MSG_NOSIGNAL);
+
+	struct socket_info *info = sockinfo(fd);
+	if (!info) {
+		errno = EBADF;
+		return -1;
+	}
+	if (!info->wr) {
+		info->wr = sockop_new(fd, SOCKOP_SEND, URING_WBUF_MIN);
+		if (!info->wr)
+			return -1;
+	}
+	struct sockop *op = info->wr;
+	if (op->latched) {
+		errno = -op->res;
+		return -1;
+	}
+	if (!op->inflight) {
+		/* the kernel isn't looking at the buffer, so we can move it */
+		if (op->ofs) {
+			memmove(op->buf, op->buf + op->ofs, op->len - op->ofs);
+			op->len -= op->ofs;
+			op->ofs = 0;
+		}
+		unsigned want = op->len + len;
+		if (want > URING_WBUF_MAX)
+			want = URING_WBUF_MAX;
+		if (want > op->max && grow(&op->buf, &op->max, want, 1))
+			return -1;
+	}
+	size_t n = op->max - op->len;
+	if (n > len)
+		n = len;
+	if (!n) {
+		errno = EAGAIN;
+		return -1;
+	}
+	memcpy(op->buf + op->len, buf, n);
+	op->len += n;
+	uring_arm_write(fd, info);
+	return n;
+}
+
+/* sockwritev() is the gathering form of sockwrite(). */
+ssize_t sockwritev(SOCKET fd, const struct iovec *iov, int iovcnt)
+{
+	if (!sockets_uring) {
+		struct msghdr msg = {
+			.msg_iov = (struct iovec*)iov,
+			.msg_iovlen = iovcnt,
+		};
+		return sendmsg(fd, &msg, MSG_NOSIGNAL);
+	}
+
+	/* copy as much as the send buffer takes, it goes out in one SEND */
+	ssize_t total = 0;
+	int i;
+	for (i = 0; i < iovcnt; i++) {
+		ssize_t e = sockwrite(fd, iov[i].iov_base, iov[i].iov_len);
+		if (e < 0)
+			return total ? total : -1;
+		total += e;
+		if ((size_t)e < iov[i].iov_len)
+			break;
+	}
+	return total;
+}
+
+/* sockaccept() accepts a connection on a listener registered with sockadd().
+ * same return values as accept4(fd, sa, salen, SOCK_NONBLOCK | SOCK_CLOEXEC).
+ */
+SOCKET sockaccept(SOCKET fd, struct sockaddr *sa, socklen_t *salen)
+{
+	if (!sockets_uring)
+		return accept4(fd, sa, salen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+	struct socket_info *info = sockinfo(fd);
+	if (!info || !info->accepted_len) {
+		errno = info ? EAGAIN : EBADF;
+		return INVALID_SOCKET;
+	}
+	SOCKET newfd = info->accepted[0];
+	info->accepted_len--;
+	memmove(info->accepted, info->accepted + 1,
+		info->accepted_len * sizeof(*info->accepted));
+	if (sa && getpeername(newfd, sa, salen))
+		*salen = 0;
+	return newfd;
+}
+
+/* sockpoll() waits for activity and dispatches only the ready sockets. */
+int sockpoll(void)
+{
+	if (!sockets_count)
+		return -1;
+
+	/* sleep until the next timer is due */
+	int timeout = timer_next();
+	unsigned long long start;
+	if (sockets_uring) {
+		if (uring_poll(timeout, &start))
+			return -1;
+		timer_run();
+		metrics_record(METRIC_POLL, metrics_now() - start);
+		return 0;
+	}
+
+	struct epoll_event ready[SOCKPOLL_BATCH];
+	int n = epoll_wait(sockets_epfd, ready, SOCKPOLL_BATCH, timeout);
+	start = metrics_now();
+	if (n < 0) {
+		if (errno == EINTR) {
+			timer_run();
+			return 0;
+		}
+		sockerror("epoll_wait()");
+		return -1;
+	}
+
+	int i;
+	for (i = 0; i < n; i++) {
+		SOCKET fd = ready[i].data.fd;
+		/* an earlier callback in this batch may have closed it */
+		struct socket_info *info = sockinfo(fd);
+		if (!info)
+			continue;
+		uint32_t revents = ready[i].events;
+		long event = 0;
+		if (revents & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			event |= EVENT_READ;
+		if (revents & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			event |= EVENT_WRITE;
+		event &= info->events;
+
+		if (event) {
+			struct sockbase *s = info->ptr;
+			RETAIN(s);
+			s->event(fd, s, event);
+			RELEASE(s, s->free);
+		}
+	}
+
+	timer_run();
+	metrics_record(METRIC_POLL, metrics_now() - start);
+
+	return 0;
+}
+
+/* sockget() returns the object registered for fd, or NULL. */
+struct sockbase *sockget(SOCKET fd)
+{
+	struct socket_info *info = sockinfo(fd);
+	return info ? info->ptr : NULL;
+}
+
+/* sockpending() returns the number of bytes accepted by sockwrite() that have
+ * not been handed to the kernel yet. always 0 with epoll. */
+size_t sockpending(SOCKET fd)
+{
+	if (!sockets_uring)
+		return 0;
+	struct socket_info *info = sockinfo(fd);
+	struct sockop *op = info ? info->wr : NULL;
+	if (!op || op->latched)
+		return 0;
+	return op->len - op->ofs;
+}
+
+/* sockcount() returns the number of registered sockets. */
+int sockcount(void)
+{
+	return sockets_count;
+}
@@ -0,0 +1,38 @@
+#ifndef SOCK_H
+#define SOCK_H
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* flags for struct sockbase->event() */
+#define EVENT_READ (1)
+#define EVENT_WRITE (2)
+
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+
+struct sockbase {
+	SOCKET fd;
+	int rc;
+	void (*event)(SOCKET fd, struct sockbase *ptr, long event);
+	void (*free)(void *ptr);
+};
+
+void sockerror(const char *reason);
+int sockinit(const char *backend);
+const char *sockbackend(void);
+void sockclose(SOCKET fd);
+int sockset(SOCKET fd, long events);
+int sockclr(SOCKET fd, long events);
+int sockadd(SOCKET fd, struct sockbase *ptr, long events,
+	void (*event)(SOCKET fd, struct sockbase *ptr, long event),
+	void (*free)(struct sockbase *ptr));
+ssize_t sockread(SOCKET fd, void *buf, size_t len);
+ssize_t sockwrite(SOCKET fd, const void *buf, size_t len);
+ssize_t sockwritev(SOCKET fd, const struct iovec *iov, int iovcnt);
+SOCKET sockaccept(SOCKET fd, struct sockaddr *sa, socklen_t *salen);
+int sockpoll(void);
+struct sockbase *sockget(SOCKET fd);
+size_t sockpending(SOCKET fd);
+int sockcount(void);
+#endif
@@ -0,0 +1,155 @@
+/*
+ * Copyright 2015 Jon Mayo <jon@cobra-kai.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <string.h>
+
+#include "telnet.h"
+
+enum {
+	TELNET_STATE_DATA,
+	TELNET_STATE_CR, /* drop the NUL in a CR NUL pair */
+	TELNET_STATE_IAC,
+	TELNET_STATE_OPT,
+	TELNET_STATE_SB,
+	TELNET_STATE_SB_IAC,
+};
+
+void telnet_init(struct telnet *t, void *p)
+{
+	memset(t, 0, sizeof(*t));
+	t->state = TELNET_STATE_DATA;
+	t->p = p;
+}
+
+/* telnet_negotiate() sends IAC <cmd> <opt> */
+void telnet_negotiate(struct telnet *t, unsigned char cmd, unsigned char opt)
+{
+	unsigned char msg[3] = { TELNET_IAC, cmd, opt };
+	if (cmd == TELNET_WILL)
+		t->us[opt / 8] |= 1 << (opt % 8);
+	else if (cmd == TELNET_WONT)
+		t->us[opt / 8] &= ~(1 << (opt % 8));
+	if (t->send)
+		t->send(t->p, msg, sizeof(msg));
+}
+
+/* telnet_enabled() returns non-zero if we have offered or agreed to opt */
+int telnet_enabled(const struct telnet *t, unsigned char opt)
+{
+	return (t->us[opt / 8] >> (opt % 8)) & 1;
+}
+
+static void telnet_option(struct telnet *t, unsigned char cmd, unsigned char opt)
+{
+	int ok = t->option ? t->option(t->p, cmd, opt) : 0;
+	/* only changes are answered, or we would loop with the peer */
+	switch (cmd) {
+	case TELNET_DO:
+		if (!ok)
+			telnet_negotiate(t, TELNET_WONT, opt);
+		else if (!telnet_enabled(t, opt))
+			telnet_negotiate(t, TELNET_WILL, opt);
+		break;
+	case TELNET_DONT:
+		if (telnet_enabled(t, opt))
+			telnet_negotiate(t, TELNET_WONT, opt);
+		break;
+	case TELNET_WILL:
+		telnet_negotiate(t, ok ? TELNET_DO : TELNET_DONT, opt);
+		break;
+	}
+}
+
+/* telnet_parse() removes telnet commands from buf in place, and handles them.
+ * the state is kept between calls, so a sequence may be split across reads.
+ * returns the length of the data that remains. */
+size_t telnet_parse(struct telnet *t, char *buf, size_t len)
+{
+	unsigned char *in = (unsigned char*)buf, *end = in + len;
+	unsigned char *out = in;
+
+	/* fast path, nothing to strip so far */
+	if (t->state == TELNET_STATE_DATA) {
+		while (in < end && *in != TELNET_IAC && *in != '\r')
+			in++;
+		out = in;
+	}
+
+	while (in < end) {
+		unsigned char c = *in++;
+		switch (t->state) {
+		case TELNET_STATE_CR:
+			t->state = TELNET_STATE_DATA;
+			if (!c)
+				break;
+			/* fall through */
+		case TELNET_STATE_DATA:
+			if (c == TELNET_IAC) {
+				t->state = TELNET_STATE_IAC;
+				break;
+			}
+			if (c == '\r')
+				t->state = TELNET_STATE_CR;
+			*out++ = c;
+			break;
+		case TELNET_STATE_IAC:
+			switch (c) {
+			case TELNET_IAC: /* escaped 255 */
+				*out++ = c;
+				t->state = TELNET_STATE_DATA;
+				break;
+			case TELNET_WILL:
+			case TELNET_WONT:
+			case TELNET_DO:
+			case TELNET_DONT:
+				t->cmd = c;
+				t->state = TELNET_STATE_OPT;
+				break;
+			case TELNET_SB:
+				t->sb_len = 0;
+				t->state = TELNET_STATE_SB;
+				break;
+			default: /* NOP, GA, AYT, ... are ignored */
+				t->state = TELNET_STATE_DATA;
+			}
+			break;
+		case TELNET_STATE_OPT:
+			t->state = TELNET_STATE_DATA;
+			telnet_option(t, t->cmd, c);
+			break;
+		case TELNET_STATE_SB:
+			if (c == TELNET_IAC)
+				t->state = TELNET_STATE_SB_IAC;
+			else if (t->sb_len < TELNET_SB_MAX)
+				t->sb[t->sb_len++] = c;
+			break;
+		case TELNET_STATE_SB_IAC:
+			if (c == TELNET_SE) {
+				t->state = TELNET_STATE_DATA;
+				if (t->subneg && t->sb_len)
+					t->subneg(t->p, t->sb, t->sb_len);
+			} else {
+				/* IAC IAC is a literal 255 */
+				if (t->sb_len < TELNET_SB_MAX)
+					t->sb[t->sb_len++] = c;
+				t->state = TELNET_STATE_SB;
+			}
+			break;
+		}
+	}
+	return out - (unsigned char*)buf;
+}
@@ -0,0 +1,37 @@
+#ifndef TELNET_H
+#define TELNET_H
+#include <stddef.h>
+
+#define TELNET_SE (240)
+#define TELNET_NOP (241)
+#define TELNET_SB (250)
+#define TELNET_WILL (251)
+#define TELNET_WONT (252)
+#define TELNET_DO (253)
+#define TELNET_DONT (254)
+#define TELNET_IAC (255)
+
+#define TELNET_OPT_MCCP2 (86) /* MUD client compression protocol v2 */
+
+#define TELNET_SB_MAX 64 /* longer subnegotiations are truncated */
+
+struct telnet {
+	unsigned char state;
+	unsigned char cmd; /* WILL, WONT, DO or DONT in progress */
+	unsigned char sb_len;
+	unsigned char us[32]; /* bitmap of options we have said WILL to */
+	unsigned char sb[TELNET_SB_MAX]; /* option followed by its data */
+	/* send raw bytes to the peer */
+	void (*send)(void *p, const void *data, size_t len);
+	/* return non-zero to accept an option, the reply is sent for you */
+	int (*option)(void *p, unsigned char cmd, unsigned char opt);
+	/* a complete subnegotiation, may be NULL */
+	void (*subneg)(void *p, const unsigned char *data, size_t len);
+	void *p;
+};
+
+void telnet_init(struct telnet *t, void *p);
+size_t telnet_parse(struct telnet *t, char *buf, size_t len);
+void telnet_negotiate(struct telnet *t, unsigned char cmd, unsigned char opt);
+int telnet_enabled(const struct telnet *t, unsigned char opt);
+#endif
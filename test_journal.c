@@ -0,0 +1,250 @@
+/*
+ * Copyright 2015 Jon Mayo <jon@cobra-kai.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "journal.h"
+#include "objdb.h"
+#include "object.h"
+
+#define OBJECTS 150 /* more than one checkpoint batch */
+
+struct replayed {
+	long count;
+	int bad;
+};
+
+/* records hold their own path as data */
+static int check(void *p, const char *path, const void *data, size_t len)
+{
+	struct replayed *r = p;
+	if (len != strlen(path) || memcmp(path, data, len))
+		r->bad = 1;
+	r->count++;
+	return 0;
+}
+
+/* reopen the journal and replay it, returns the number of records or -1 */
+static long replay(int dirfd, off_t *size)
+{
+	struct journal *j = journal_open(dirfd, ".journal");
+	if (!j)
+		return -1;
+	struct replayed r = { 0, 0 };
+	long n = journal_replay(j, check, &r);
+	*size = journal_size(j);
+	journal_close(j);
+	return r.bad || n != r.count ? -1 : n;
+}
+
+/* commit value to path through objdb */
+static int save(const char *path, int value, const char *padding)
+{
+	struct objdb_txn *txn = objdb_start(path);
+	if (!txn)
+		return -1;
+	struct object *o = obj_new();
+	obj_set_int(o, "value", value);
+	if (padding)
+		obj_set(o, "padding", padding);
+	int e = obj_save(o, objdb_f(txn));
+	obj_release(o);
+	if (e) {
+		objdb_rollback(txn);
+		return -1;
+	}
+	return objdb_commit(txn) ? 0 : -1;
+}
+
+/* the value in the object file of path itself, or -1 */
+static int file_value(int dirfd, const char *path)
+{
+	int fd = openat(dirfd, path, O_RDONLY);
+	FILE *f = fd < 0 ? NULL : fdopen(fd, "r");
+	if (!f)
+		return -1;
+	struct object *o = obj_load(f, path);
+	fclose(f);
+	int v = o ? obj_get_int(o, "value", -1) : -1;
+	obj_release(o);
+	return v;
+}
+
+static int cleanup(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void)st; (void)flag; (void)ftw;
+	return remove(path);
+}
+
+int main()
+{
+	char root[] = "/tmp/test_journal.XXXXXX";
+	if (!mkdtemp(root)) {
+		perror(root);
+		return EXIT_FAILURE;
+	}
+	int dirfd = open(root, O_RDONLY | O_DIRECTORY);
+	if (dirfd < 0) {
+		perror(root);
+		return EXIT_FAILURE;
+	}
+	char path[64];
+	int i;
+	off_t size, good;
+
+	{
+		/* replay test */
+		struct journal *j = journal_open(dirfd, ".journal");
+		if (!j) {
+			fprintf(stderr, "%s():error!\n", "journal_open");
+			return EXIT_FAILURE;
+		}
+		for (i = 0; i < 3; i++) {
+			snprintf(path, sizeof(path), "record/%d", i);
+			journal_append(j, path, path, strlen(path));
+		}
+		good = journal_size(j);
+		journal_sync(j);
+		journal_close(j);
+		int ok = replay(dirfd, &size) == 3 && size == good;
+		fprintf(stderr, "TEST1: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	{
+		/* torn tail test, a partly written record is cut off */
+		struct journal *j = journal_open(dirfd, ".journal");
+		journal_append(j, "record/3", "record/3", 8);
+		off_t full = journal_size(j);
+		journal_close(j);
+		char file[sizeof(root) + 16];
+		snprintf(file, sizeof(file), "%s/.journal", root);
+		int ok = !truncate(file, full - 3);
+		ok = ok && replay(dirfd, &size) == 3 && size == good;
+		/* and it stays cut off */
+		struct stat st;
+		ok = ok && !stat(file, &st) && st.st_size == good;
+		fprintf(stderr, "TEST2: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	{
+		/* crc test, a damaged record ends the journal */
+		char file[sizeof(root) + 16];
+		snprintf(file, sizeof(file), "%s/.journal", root);
+		FILE *f = fopen(file, "r+");
+		/* the last byte of the second record's data, they are all the
+		 * same size */
+		off_t second = good / 3 * 2 - 1;
+		int ok = f && !fseeko(f, second, SEEK_SET) && fputc('X', f) != EOF;
+		if (f)
+			fclose(f);
+		ok = ok && replay(dirfd, &size) == 1 && size == good / 3;
+		fprintf(stderr, "TEST3: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	{
+		/* recovery test, a journal left by a crash is replayed and
+		 * written back when the root is opened, a later record for a
+		 * path wins */
+		struct journal *j = journal_open(dirfd, ".journal");
+		journal_reset(j);
+		char data[64];
+		for (i = 0; i < OBJECTS * 2; i++) {
+			snprintf(path, sizeof(path), "obj%d", i % OBJECTS);
+			int len = snprintf(data, sizeof(data), "value:int=%d\n%%%%END%%%%\n", i);
+			journal_append(j, path, data, len);
+		}
+		journal_append(j, "torn", "torn", 4);
+		off_t full = journal_size(j);
+		journal_sync(j);
+		journal_close(j);
+		char file[sizeof(root) + 16];
+		snprintf(file, sizeof(file), "%s/.journal", root);
+		int ok = !truncate(file, full - 1);
+
+		ok = ok && !objdb_setroot(root);
+		struct stat st;
+		ok = ok && !stat(file, &st) && st.st_size == 0;
+		for (i = 0; ok && i < OBJECTS; i++) {
+			snprintf(path, sizeof(path), "obj%d", i);
+			struct object *o = objdb_load(path);
+			ok = o && obj_get_int(o, "value", -1) == i + OBJECTS;
+			obj_release(o);
+		}
+		ok = ok && !faccessat(dirfd, "obj0", F_OK, 0) &&
+			faccessat(dirfd, "torn", F_OK, 0);
+		fprintf(stderr, "TEST4: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	{
+		/* journal backend test, loads see commits before the checkpoint
+		 * writes them back, which happens once the journal passes the
+		 * checkpoint size */
+		int ok = !objdb_backend_config("journal", 1024, 0);
+		for (i = 0; ok && i < 10; i++) {
+			snprintf(path, sizeof(path), "obj%d", i);
+			ok = !save(path, i, NULL);
+		}
+		char file[sizeof(root) + 16];
+		snprintf(file, sizeof(file), "%s/.journal", root);
+		struct stat st;
+		ok = ok && !stat(file, &st) && st.st_size > 0 && st.st_size < 1024;
+		for (i = 0; ok && i < 10; i++) {
+			snprintf(path, sizeof(path), "obj%d", i);
+			struct object *o = objdb_load(path);
+			ok = o && obj_get_int(o, "value", -1) == i &&
+				file_value(dirfd, path) == i + OBJECTS;
+			obj_release(o);
+		}
+		char padding[1024];
+		memset(padding, 'x', sizeof(padding) - 1);
+		padding[sizeof(padding) - 1] = 0;
+		ok = ok && !save("padding", 0, padding);
+		ok = ok && !stat(file, &st) && st.st_size == 0;
+		for (i = 0; ok && i < 10; i++) {
+			snprintf(path, sizeof(path), "obj%d", i);
+			ok = file_value(dirfd, path) == i && file_value(dirfd, "padding") == 0;
+		}
+		fprintf(stderr, "TEST5: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	objdb_shutdown();
+	close(dirfd);
+	nftw(root, cleanup, 8, FTW_DEPTH | FTW_PHYS);
+	return 0;
+}
@@ -0,0 +1,377 @@
+/*
+ * Copyright 2015 Jon Mayo <jon@cobra-kai.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "metrics.h"
+#include "objdb.h"
+#include "object.h"
+
+static int save(const char *path, int value)
+{
+	struct objdb_txn *txn = objdb_start(path);
+	if (!txn)
+		return -1;
+	struct object *o = obj_new();
+	obj_set_int(o, "value", value);
+	int e = obj_save(o, objdb_f(txn));
+	obj_release(o);
+	if (e) {
+		objdb_rollback(txn);
+		return -1;
+	}
+	return objdb_commit(txn) ? 0 : -1;
+}
+
+/* load path and return its value, or -1 */
+static int load(const char *path)
+{
+	struct object *o = objdb_load(path);
+	if (!o)
+		return -1;
+	int v = obj_get_int(o, "value", -1);
+	obj_release(o);
+	return v;
+}
+
+static unsigned long long hits, misses, evicts;
+
+/* counters since the last call */
+static void counted(void)
+{
+	hits = metrics_counter(METRIC_OBJDB_HIT);
+	misses = metrics_counter(METRIC_OBJDB_MISS);
+	evicts = metrics_counter(METRIC_OBJDB_EVICT);
+}
+
+static int expect(unsigned long long hit, unsigned long long miss, unsigned long long evict)
+{
+	int ok = metrics_counter(METRIC_OBJDB_HIT) - hits == hit &&
+		metrics_counter(METRIC_OBJDB_MISS) - misses == miss &&
+		metrics_counter(METRIC_OBJDB_EVICT) - evicts == evict;
+	counted();
+	return ok;
+}
+
+#define COMMIT_THREADS 4
+#define COMMITS 10
+
+/* commit COMMITS objects named after the thread */
+static void *commit_thread(void *arg)
+{
+	int t = *(int*)arg, i;
+	char path[16];
+	for (i = 0; i < COMMITS; i++) {
+		snprintf(path, sizeof(path), "g%d_%d", t, i);
+		if (save(path, t * COMMITS + i))
+			return "FAIL";
+	}
+	return NULL;
+}
+
+/* a completion, signalled from an objdb thread */
+struct completion {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done, ok;
+	struct object *obj;
+};
+
+static void loaded(void *arg, struct object *obj)
+{
+	struct completion *c = arg;
+	pthread_mutex_lock(&c->lock);
+	c->obj = obj;
+	c->done = 1;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void committed(void *arg, int ok)
+{
+	struct completion *c = arg;
+	pthread_mutex_lock(&c->lock);
+	c->ok = ok;
+	c->done = 1;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void wait_for(struct completion *c)
+{
+	pthread_mutex_lock(&c->lock);
+	while (!c->done)
+		pthread_cond_wait(&c->cond, &c->lock);
+	c->done = 0;
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* the name of the i-th object committed by the tests, NULL past the end */
+static const char *object_name(char *buf, size_t max, int i)
+{
+	static const char *const fixed[] = { "a", "b", "c", "d", "e", "async", };
+	int nfixed = sizeof(fixed) / sizeof(*fixed);
+	if (i < nfixed)
+		return fixed[i];
+	i -= nfixed;
+	if (i < 40) {
+		snprintf(buf, max, "p%d", i);
+		return buf;
+	}
+	i -= 40;
+	if (i < COMMIT_THREADS * COMMITS) {
+		snprintf(buf, max, "g%d_%d", i / COMMITS, i % COMMITS);
+		return buf;
+	}
+	return NULL;
+}
+
+static int cleanup(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void)st; (void)flag; (void)ftw;
+	return remove(path);
+}
+
+int main()
+{
+	char root[] = "/tmp/test_objdb.XXXXXX";
+	if (!mkdtemp(root)) {
+		perror(root);
+		return EXIT_FAILURE;
+	}
+	if (objdb_setroot(root)) {
+		fprintf(stderr, "%s():%s:error!\n", "objdb_setroot", root);
+		return EXIT_FAILURE;
+	}
+	objdb_sync_config(0, 0, 1);
+	const char *names[] = { "a", "b", "c", "d", "e", NULL, };
+	int i;
+	for (i = 0; names[i]; i++) {
+		if (save(names[i], i)) {
+			fprintf(stderr, "%s():%s:error!\n", "objdb_commit", names[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* every object has the same size, budget room for three of them */
+	unsigned count;
+	size_t size;
+	objdb_cache_config(1 << 20);
+	load("a");
+	objdb_cache_stats(&count, &size);
+	objdb_cache_config(size * 3 + size / 2);
+	counted();
+
+	{
+		/* LRU test, the least recently used object is evicted first */
+		int ok = load("b") == 1 && load("c") == 2 && expect(0, 2, 0);
+		ok = ok && load("a") == 0 && expect(1, 0, 0); /* a is now newest */
+		ok = ok && load("d") == 3 && expect(0, 1, 1); /* evicts b */
+		ok = ok && load("a") == 0 && load("c") == 2 && load("d") == 3 &&
+			expect(3, 0, 0);
+		ok = ok && load("b") == 1 && expect(0, 1, 1); /* evicts a */
+		ok = ok && load("a") == 0 && expect(0, 1, 1);
+		fprintf(stderr, "TEST1: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	{
+		/* budget test, objects in use are not evicted, the cache shrinks
+		 * back once they are released. a, b and d are cached from TEST1 */
+		struct object *held[4];
+		held[0] = objdb_load("a");
+		held[1] = objdb_load("b");
+		held[2] = objdb_load("d");
+		held[3] = objdb_load("e");
+		objdb_cache_stats(&count, &size);
+		int ok = held[3] && count == 4 && expect(3, 1, 0);
+		for (i = 0; i < 4; i++)
+			obj_release(held[i]);
+		ok = ok && load("c") == 2 && expect(0, 1, 2);
+		objdb_cache_stats(&count, &size);
+		size_t one = size / count;
+		ok = ok && count == 3;
+		/* shrinking the budget evicts at once, an object bigger than the
+		 * budget is never cached */
+		objdb_cache_config(one * 2);
+		objdb_cache_stats(&count, &size);
+		ok = ok && count == 2 && size <= one * 2 && expect(0, 0, 1);
+		objdb_cache_config(one / 2);
+		ok = ok && load("c") == 2 && load("c") == 2 && expect(0, 2, 2);
+		objdb_cache_stats(&count, &size);
+		ok = ok && count == 0 && size == 0;
+		fprintf(stderr, "TEST2: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	{
+		/* a commit replaces the cached object */
+		objdb_cache_config(1 << 20);
+		int ok = load("e") == 4 && load("e") == 4 && !save("e", 40) &&
+			load("e") == 40;
+		fprintf(stderr, "TEST3: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	{
+		/* pinned test, many objects in use don't make every insert walk
+		 * them, and the cache is trimmed once they are released */
+		enum { pinned = 40 };
+		struct object *held[pinned];
+		char path[16];
+		int ok = 1;
+		for (i = 0; ok && i < pinned; i++) {
+			snprintf(path, sizeof(path), "p%d", i);
+			ok = !save(path, i);
+		}
+		objdb_cache_config(0);
+		objdb_cache_config(1 << 20);
+		load("a");
+		objdb_cache_stats(&count, &size);
+		objdb_cache_config(size * 3);
+		for (i = 0; ok && i < pinned; i++) {
+			snprintf(path, sizeof(path), "p%d", i);
+			held[i] = objdb_load(path);
+			ok = held[i] != NULL;
+		}
+		objdb_cache_stats(&count, &size);
+		ok = ok && count == pinned;
+		for (i = 0; i < pinned; i++)
+			obj_release(held[i]);
+		ok = ok && load("a") == 0;
+		objdb_cache_stats(&count, &size);
+		ok = ok && count <= 3;
+		fprintf(stderr, "TEST4: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	{
+		/* group commit test, commits from several threads share syncs */
+		objdb_sync_config(1, 20, 64);
+		unsigned long long batches = metrics_counter(METRIC_OBJDB_BATCHES);
+		unsigned long long synced = metrics_counter(METRIC_OBJDB_SYNCED);
+		pthread_t th[COMMIT_THREADS];
+		int arg[COMMIT_THREADS], ok = 1;
+		for (i = 0; i < COMMIT_THREADS; i++) {
+			arg[i] = i;
+			pthread_create(&th[i], NULL, commit_thread, &arg[i]);
+		}
+		for (i = 0; i < COMMIT_THREADS; i++) {
+			void *res;
+			pthread_join(th[i], &res);
+			if (res)
+				ok = 0;
+		}
+		batches = metrics_counter(METRIC_OBJDB_BATCHES) - batches;
+		synced = metrics_counter(METRIC_OBJDB_SYNCED) - synced;
+		ok = ok && synced == COMMIT_THREADS * COMMITS && batches < synced;
+		for (i = 0; ok && i < COMMIT_THREADS * COMMITS; i++) {
+			char path[16];
+			snprintf(path, sizeof(path), "g%d_%d", i / COMMITS, i % COMMITS);
+			ok = load(path) == i;
+		}
+		fprintf(stderr, "TEST5: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	{
+		/* async test, completions run on objdb threads */
+		struct completion c = {
+			PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, NULL,
+		};
+		int ok = !objdb_load_async("b", loaded, &c);
+		if (ok)
+			wait_for(&c);
+		ok = ok && c.obj && obj_get_int(c.obj, "value", -1) == 1;
+		obj_release(c.obj);
+		c.obj = NULL;
+		ok = ok && !objdb_load_async("missing", loaded, &c);
+		if (ok)
+			wait_for(&c);
+		ok = ok && !c.obj;
+
+		struct objdb_txn *txn = objdb_start("async");
+		struct object *o = obj_new();
+		obj_set_int(o, "value", 77);
+		ok = ok && txn && !obj_save(o, objdb_f(txn));
+		obj_release(o);
+		ok = ok && !objdb_commit_async(txn, committed, &c);
+		if (ok)
+			wait_for(&c);
+		ok = ok && c.ok && load("async") == 77;
+		fprintf(stderr, "TEST6: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	{
+		/* preload test, every object is then a cache hit */
+		char buf[16];
+		const char *path;
+		int n;
+		objdb_cache_config(0);
+		objdb_cache_config(1 << 20);
+		int ok = !objdb_preload(2);
+		counted();
+		for (n = 0; ok && (path = object_name(buf, sizeof(buf), n)); n++)
+			ok = load(path) >= 0;
+		ok = ok && expect(n, 0, 0);
+		fprintf(stderr, "TEST7: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+
+		/* with a smaller budget preload stops early, the rest is loaded
+		 * on demand */
+		objdb_cache_config(0);
+		objdb_cache_config(1 << 20);
+		load("a");
+		objdb_cache_stats(&count, &size);
+		objdb_cache_config(0);
+		objdb_cache_config(size * 10);
+		ok = !objdb_preload(2);
+		objdb_cache_stats(&count, &size);
+		ok = ok && count > 0 && count <= 10;
+		counted();
+		for (i = 0; ok && i < n; i++)
+			ok = load(object_name(buf, sizeof(buf), i)) >= 0;
+		ok = ok && metrics_counter(METRIC_OBJDB_HIT) - hits < (unsigned)n &&
+			metrics_counter(METRIC_OBJDB_MISS) - misses > 0;
+		fprintf(stderr, "TEST8: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	objdb_shutdown();
+	nftw(root, cleanup, 8, FTW_DEPTH | FTW_PHYS);
+	return 0;
+}
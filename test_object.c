@@ -22,11 +22,33 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "atom.h"
 #include "object.h"
 #include "rc.h"
 
+#define ATOM_TEST_NAMES 20000
+
+/* every thread interns the same names, forcing the table to grow while the
+ * others are looking names up. */
+static void *atom_test_thread(void *arg)
+{
+	const struct atom **out = arg;
+	char name[32];
+	int i;
+	for (i = 0; i < ATOM_TEST_NAMES; i++) {
+		snprintf(name, sizeof(name), "atom%d", i);
+		out[i] = atom_intern(name);
+		if (!out[i] || atom_find(name) != out[i])
+			return "FAIL";
+	}
+	return NULL;
+}
+
 int main()
 {
 	/* test code */
@@ -50,6 +72,18 @@ int main()
 	fprintf(stderr, "TEST3: %s\n", obj_get(a, "flag"));
 	fprintf(stderr, "TEST4: %s\n", obj_get(a, "test"));
 
+	/* typed values */
+	obj_set_int(a, "hp", -42);
+	obj_set_double(a, "speed", 1.5);
+	obj_set_ref(a, "location", "room/1");
+	/* names holding the separators */
+	obj_set(a, "odd:int", "x");
+	obj_set_int(a, "k=v:ref", 7);
+	obj_set(a, "octal", "010");
+	obj_set(a, "partial", "12abc");
+	obj_set(a, "huge", "99999999999999999999");
+	obj_set_double(a, "big", 1e300);
+
 	const char test_path[] = "obj1.dat";
 	{
 		/* saving test */
@@ -82,11 +116,170 @@ int main()
 
 		fclose(f);
 
+		int ok = obj_get_int(b, "hp", 0) == -42 &&
+			obj_get_double(b, "speed", 0) == 1.5 &&
+			obj_type(b, "location") == OBJ_REF &&
+			!strcmp(obj_get_ref(b, "location"), "room/1") &&
+			!strcmp(obj_get(b, "hp"), "-42") &&
+			obj_get_int(b, "a", 0) == 100 &&
+			!strcmp(obj_get(b, "odd:int"), "x") &&
+			obj_type(b, "odd:int") == OBJ_STRING &&
+			obj_get_int(b, "k=v:ref", 0) == 7 &&
+			obj_get_int(b, "octal", 0) == 10 &&
+			obj_get_int(b, "partial", -1) == -1 &&
+			obj_get_int(b, "huge", -1) == -1 &&
+			obj_get_int(b, "big", 0) == INT64_MAX &&
+			obj_get_int(b, "missing", 5) == 5;
+
+		/* an out of range number is a parse error, nothing is set */
+		FILE *g = tmpfile();
+		if (g) {
+			fputs("x:int=99999999999999999999\n%%END%%\n", g);
+			rewind(g);
+			struct object *bad = obj_load(g, "tmpfile");
+			ok = ok && !bad;
+			obj_release(bad);
+			fclose(g);
+		}
+		fprintf(stderr, "TEST5: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+
 		/* dump the object */
 		obj_save(b, stdout);
 
 		obj_release(b);
 	}
 
+	{
+		/* large object test */
+		struct object *c = obj_new();
+		char name[32], value[32];
+		int n = 100000;
+		clock_t start = clock();
+		for (i = 0; i < n; i++) {
+			snprintf(name, sizeof(name), "key%d", (i * 7919) % n);
+			snprintf(value, sizeof(value), "%d", i);
+			if (obj_set(c, name, value)) {
+				fprintf(stderr, "%s():error!\n", "obj_set");
+				return EXIT_FAILURE;
+			}
+		}
+		for (i = 0; i < n; i++) {
+			snprintf(name, sizeof(name), "key%d", i);
+			if (!obj_get(c, name)) {
+				fprintf(stderr, "%s():%s:missing!\n", "obj_get", name);
+				return EXIT_FAILURE;
+			}
+		}
+		/* iteration must be in name order */
+		struct object_iter it = obj_iter_new(c);
+		const char *prev = "", *cur;
+		while (obj_iter_next(&it, &cur, NULL)) {
+			if (strcmp(prev, cur) >= 0) {
+				fprintf(stderr, "%s():%s:out of order!\n", "obj_iter_next", cur);
+				return EXIT_FAILURE;
+			}
+			prev = cur;
+		}
+		fprintf(stderr, "TEST6: %d properties in %ld ms\n", n,
+			(long)((clock() - start) * 1000 / CLOCKS_PER_SEC));
+		obj_release(c);
+	}
+
+	{
+		/* overwrite test, old values become garbage to be compacted */
+		struct object *d = obj_new();
+		char value[64];
+		int round;
+		for (round = 0; round < 1000; round++) {
+			for (i = 0; i < 10; i++) {
+				char name[16];
+				snprintf(name, sizeof(name), "k%d", i);
+				snprintf(value, sizeof(value), "%*d", (round * 7 + i) % 40, round);
+				obj_set(d, name, value);
+			}
+			/* setting a property from one of its own values */
+			obj_set(d, "copy", obj_get(d, "k3"));
+		}
+		snprintf(value, sizeof(value), "%*d", (999 * 7 + 3) % 40, 999);
+		int ok = !strcmp(obj_get(d, "copy"), value);
+		fprintf(stderr, "TEST7: %s\n", ok ? "ok" : "FAIL");
+		obj_release(d);
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	{
+		/* prototype test, children only hold their overrides */
+		struct object *proto = obj_new();
+		obj_set(proto, "name", "orc");
+		obj_set_int(proto, "hp", 30);
+		struct object *e = obj_new_child(proto);
+		obj_set_int(e, "hp", 12);
+		int ok = obj_get_int(e, "hp", 0) == 12 &&
+			obj_get_int(proto, "hp", 0) == 30 &&
+			!strcmp(obj_get(e, "name"), "orc") &&
+			obj_set(proto, "name", "elf") == -1;
+		/* saving only the overrides, then loading under a new parent */
+		FILE *f = tmpfile();
+		struct object *proto2 = obj_new();
+		obj_set(proto2, "name", "troll");
+		struct object *g = NULL;
+		if (f && !obj_save_local(e, f)) {
+			rewind(f);
+			g = obj_load_child(f, "tmpfile", proto2);
+		}
+		ok = ok && g && obj_get_int(g, "hp", 0) == 12 &&
+			!strcmp(obj_get(g, "name"), "troll") &&
+			obj_parent(g) == proto2;
+		if (f)
+			fclose(f);
+		obj_release(g);
+		obj_release(proto2);
+		obj_release(proto); /* the child keeps it */
+		fprintf(stderr, "TEST8: %s\n", ok ? "ok" : "FAIL");
+		obj_save(e, stdout);
+		obj_release(e);
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	{
+		/* atom test, every thread must get the same pointer for a name */
+		enum { nthreads = 4 };
+		static const struct atom *got[nthreads][ATOM_TEST_NAMES];
+		pthread_t th[nthreads];
+		int ok = !atom_find("never interned");
+		for (i = 0; i < nthreads; i++)
+			pthread_create(&th[i], NULL, atom_test_thread, got[i]);
+		for (i = 0; i < nthreads; i++) {
+			void *res;
+			pthread_join(th[i], &res);
+			if (res)
+				ok = 0;
+		}
+		for (i = 0; ok && i < ATOM_TEST_NAMES; i++) {
+			int t;
+			for (t = 1; t < nthreads; t++)
+				if (got[t][i] != got[0][i])
+					ok = 0;
+			char name[32];
+			snprintf(name, sizeof(name), "atom%d", i);
+			if (strcmp(atom_name(got[0][i]), name))
+				ok = 0;
+		}
+		/* properties set by name are found by atom */
+		struct object *f = obj_new();
+		obj_set(f, "atom1", "one");
+		const char *v = obj_get_atom(f, got[0][1]);
+		ok = ok && v && !strcmp(v, "one") &&
+			!obj_get_atom(f, atom_intern("atom2"));
+		obj_release(f);
+		fprintf(stderr, "TEST9: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
 	return 0;
 }
@@ -0,0 +1,314 @@
+/*
+ * Copyright 2015 Jon Mayo <jon@cobra-kai.com>
+ *
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "objdb.h"
+#include "object.h"
+#include "packfile.h"
+
+#define KEYS 200
+static char root[] = "/tmp/test_pack.XXXXXX";
+static size_t segment_max = 4096; /* small, so the keys span many segments */
+
+/* the value of key i in round r */
+static int value(char *buf, size_t max, int i, int r)
+{
+	return snprintf(buf, max, "value %d of key %d, padded to be a little longer", r, i);
+}
+
+static int append(struct pack *p, int i, int r)
+{
+	char path[32], data[128];
+	snprintf(path, sizeof(path), "key/%d", i);
+	return pack_append(p, path, data, value(data, sizeof(data), i, r));
+}
+
+/* returns 1 if key i reads back as round r, 0 if not. sets errno */
+static int check(struct pack *p, int i, int r)
+{
+	char path[32], want[128];
+	size_t len = 0;
+	snprintf(path, sizeof(path), "key/%d", i);
+	int wantlen = value(want, sizeof(want), i, r);
+	char *data = pack_read(p, path, &len);
+	int ok = data && len == (size_t)wantlen && !memcmp(data, want, len);
+	free(data);
+	return ok;
+}
+
+static struct pack *reopen(struct pack *p)
+{
+	if (p)
+		pack_close(p);
+	int fd = open(root, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return NULL;
+	p = pack_open(fd, segment_max);
+	close(fd);
+	return p;
+}
+
+/* the file name of segment seg */
+static void segment(char *name, size_t max, unsigned seg)
+{
+	snprintf(name, max, "%s/.pack/%08u.seg", root, seg);
+}
+
+/* the number of the last segment */
+static unsigned last_segment(void)
+{
+	char name[64];
+	unsigned seg = 0;
+	struct stat st;
+	for (;;) {
+		segment(name, sizeof(name), seg + 1);
+		if (stat(name, &st))
+			return seg;
+		seg++;
+	}
+}
+
+static int cleanup(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void)st; (void)flag; (void)ftw;
+	return remove(path);
+}
+
+int main()
+{
+	if (!mkdtemp(root)) {
+		perror(root);
+		return EXIT_FAILURE;
+	}
+	struct pack *p = reopen(NULL);
+	if (!p) {
+		fprintf(stderr, "%s():%s:error!\n", "pack_open", root);
+		return EXIT_FAILURE;
+	}
+	int i;
+
+	{
+		/* reopen test, the index is saved on close */
+		for (i = 0; i < KEYS; i++)
+			if (append(p, i, 0))
+				return EXIT_FAILURE;
+		int ok = !pack_sync(p) && (p = reopen(p)) && pack_count(p) == KEYS;
+		for (i = 0; ok && i < KEYS; i++)
+			ok = check(p, i, 0);
+		ok = ok && last_segment() > 2;
+		fprintf(stderr, "TEST1: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	{
+		/* torn tail test, a record cut short by a crash is dropped and
+		 * the key reads as its previous record */
+		int ok = !append(p, 7, 1) && !pack_sync(p);
+		pack_close(p);
+		char name[64];
+		struct stat st;
+		segment(name, sizeof(name), last_segment());
+		ok = ok && !stat(name, &st) && !truncate(name, st.st_size - 3);
+		ok = ok && (p = reopen(NULL)) && pack_count(p) == KEYS;
+		for (i = 0; ok && i < KEYS; i++)
+			ok = check(p, i, 0);
+		fprintf(stderr, "TEST2: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	{
+		/* corruption test, a damaged record fails its crc on read. with
+		 * no saved index the scan ends the segment there, and the other
+		 * segments are still found */
+		pack_close(p);
+		char name[64];
+		segment(name, sizeof(name), 1);
+		FILE *f = fopen(name, "r+");
+		struct stat st;
+		int ok = f && !stat(name, &st) && !fseeko(f, st.st_size - 1, SEEK_SET) &&
+			fputc('X', f) != EOF;
+		if (f)
+			fclose(f);
+		/* the last record of segment 1 */
+		int bad = -1;
+		ok = ok && (p = reopen(NULL));
+		for (i = 0; ok && i < KEYS; i++) {
+			errno = 0;
+			if (check(p, i, 0))
+				continue;
+			ok = bad == -1 && errno == EIO;
+			bad = i;
+		}
+		ok = ok && bad != -1;
+		char index[64];
+		snprintf(index, sizeof(index), "%s/.pack/index", root);
+		pack_close(p);
+		ok = ok && !unlink(index) && (p = reopen(NULL)) && pack_count(p) == KEYS - 1;
+		for (i = 0; ok && i < KEYS; i++) {
+			errno = 0;
+			ok = i == bad ? !check(p, i, 0) && errno == ENOENT : check(p, i, 0);
+		}
+		/* put it back for the next test */
+		ok = ok && bad != -1 && !append(p, bad, 0);
+		fprintf(stderr, "TEST3: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	{
+		/* compaction test, every old segment is dead after a second
+		 * round, and is removed a bounded step at a time */
+		unsigned segs = last_segment();
+		int ok = 1, r;
+		for (r = 1; ok && r <= 2; r++)
+			for (i = 0; ok && i < KEYS; i++)
+				ok = !append(p, i, r);
+		/* the segments are smaller than a step, each step removes one */
+		int removed = 0, e;
+		while (ok && (e = pack_compact(p)) > 0)
+			removed++;
+		ok = ok && !e && removed >= (int)segs;
+		for (i = 0; ok && i < KEYS; i++)
+			ok = check(p, i, 2);
+		ok = ok && (p = reopen(p)) && pack_count(p) == KEYS;
+		for (i = 0; ok && i < KEYS; i++)
+			ok = check(p, i, 2);
+		char name[64];
+		struct stat st;
+		segment(name, sizeof(name), 0);
+		ok = ok && stat(name, &st) && errno == ENOENT;
+		fprintf(stderr, "TEST4: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	{
+		/* chunked compaction test, segments bigger than one step take
+		 * several, and a record bigger than a step is copied whole */
+		segment_max = 4 << 20;
+		int ok = (p = reopen(p)) != NULL;
+		static char big[3 << 20];
+		memset(big, 'b', sizeof(big));
+		char path[32];
+		int r, n = 2000;
+		for (r = 0; ok && r < 2; r++) {
+			for (i = 0; ok && i < n; i++) {
+				snprintf(path, sizeof(path), "chunk/%d", i);
+				big[0] = '0' + r;
+				ok = !pack_append(p, path, big, 1024);
+			}
+			big[0] = '0' + r;
+			ok = ok && !pack_append(p, "big", big, sizeof(big));
+		}
+		/* the first round is all dead now */
+		int steps = 0, removed = 0, e;
+		while (ok && (e = pack_compact(p)) >= 0 && steps < 1000) {
+			steps++;
+			removed += e;
+			if (!e && removed)
+				break;
+		}
+		ok = ok && removed > 0 && steps > removed + 1;
+		size_t len;
+		char *data;
+		for (i = 0; ok && i < n; i++) {
+			snprintf(path, sizeof(path), "chunk/%d", i);
+			data = pack_read(p, path, &len);
+			ok = data && len == 1024 && data[0] == '1';
+			free(data);
+		}
+		data = ok ? pack_read(p, "big", &len) : NULL;
+		ok = data && len == sizeof(big) && data[0] == '1' &&
+			data[len - 1] == 'b';
+		free(data);
+		fprintf(stderr, "TEST5: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+
+	pack_close(p);
+	nftw(root, cleanup, 8, FTW_DEPTH | FTW_PHYS);
+
+	{
+		/* objdb test, a root with a pack only opens with the pack
+		 * backend. loads find commits through the index, and fall back
+		 * to object files */
+		char root2[] = "/tmp/test_pack.XXXXXX";
+		int ok = mkdtemp(root2) != NULL;
+		int fd = ok ? open(root2, O_RDONLY | O_DIRECTORY) : -1;
+		struct pack *q = fd < 0 ? NULL : pack_open(fd, segment_max);
+		static const char packed[] = "value:int=1\n%%END%%\n";
+		ok = q && !pack_append(q, "packed", packed, strlen(packed)) &&
+			!pack_close(q);
+		char name[64];
+		snprintf(name, sizeof(name), "%s/file", root2);
+		FILE *f = ok ? fopen(name, "w") : NULL;
+		ok = f && fputs("value:int=2\n%%END%%\n", f) >= 0;
+		if (f)
+			fclose(f);
+		ok = ok && !objdb_setroot(root2) &&
+			objdb_backend_config("files", 0, segment_max) &&
+			objdb_backend_config("journal", 0, segment_max) &&
+			objdb_backend_config(NULL, 0, segment_max) &&
+			!objdb_backend_config("pack", 0, segment_max);
+		struct object *o = ok ? objdb_load("packed") : NULL;
+		ok = o && obj_get_int(o, "value", -1) == 1;
+		obj_release(o);
+		o = ok ? objdb_load("file") : NULL;
+		ok = o && obj_get_int(o, "value", -1) == 2;
+		obj_release(o);
+		/* a commit goes to the pack, and shadows the file */
+		struct objdb_txn *txn = ok ? objdb_start("file") : NULL;
+		o = obj_new();
+		obj_set_int(o, "value", 3);
+		ok = txn && !obj_save(o, objdb_f(txn)) && objdb_commit(txn);
+		obj_release(o);
+		o = ok ? objdb_load("file") : NULL;
+		ok = o && obj_get_int(o, "value", -1) == 3;
+		obj_release(o);
+		f = ok ? fopen(name, "r") : NULL;
+		o = f ? obj_load(f, name) : NULL;
+		ok = o && obj_get_int(o, "value", -1) == 2;
+		obj_release(o);
+		if (f)
+			fclose(f);
+		objdb_shutdown();
+		if (fd >= 0)
+			close(fd);
+		nftw(root2, cleanup, 8, FTW_DEPTH | FTW_PHYS);
+		fprintf(stderr, "TEST6: %s\n", ok ? "ok" : "FAIL");
+		if (!ok)
+			return EXIT_FAILURE;
+	}
+	return 0;
+}
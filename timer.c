@@ -0,0 +1,247 @@
+/*
+ * Copyright 2015 Jon Mayo <jon@cobra-kai.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <time.h>
+
+#include "timer.h"
+
+/* hierarchical timing wheel.
+ *
+ * level 0 has one slot per millisecond for the next 64ms, each level above
+ * covers 64 times the range of the one below. a timer is placed in the
+ * coarsest slot that still expires before it does, and is moved down a level
+ * (cascaded) when the clock reaches that slot. insert and cancel are O(1),
+ * finding the next wakeup is O(levels) using the occupancy bitmaps.
+ *
+ * every thread has its own wheel, timers fire on the thread that added them. */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 5 /* 2^30 ms, about 12 days. later timers are re-filed */
+#define WHEEL_MAX ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+#define WHEEL_DETACHED (~0U) /* slot of timers about to be fired */
+
+static __thread struct wheel {
+	unsigned long long clock; /* next tick to be processed */
+	unsigned long long used[WHEEL_LEVELS]; /* bitmap of non-empty slots */
+	struct timer *slot[WHEEL_LEVELS][WHEEL_SIZE];
+	unsigned count;
+} wheel;
+
+unsigned long long timer_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned long long ror64(unsigned long long v, unsigned n)
+{
+	n &= 63;
+	return n ? (v >> n) | (v << (64 - n)) : v;
+}
+
+/* file a timer relative to the wheel's clock */
+static void wheel_insert(struct timer *t)
+{
+	unsigned long long expires = t->expires;
+	if (expires < wheel.clock)
+		expires = wheel.clock; /* overdue, fire on the next tick */
+	unsigned long long delta = expires - wheel.clock;
+	if (delta > WHEEL_MAX) {
+		/* park it at the far end, it gets re-filed when cascaded */
+		delta = WHEEL_MAX;
+		expires = wheel.clock + delta;
+	}
+
+	unsigned level = 0;
+	while (level < WHEEL_LEVELS - 1 &&
+			delta >= (1ULL << (WHEEL_BITS * (level + 1))))
+		level++;
+	unsigned idx = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+	struct timer **head = &wheel.slot[level][idx];
+	t->slot = level * WHEEL_SIZE + idx;
+	t->prev = head;
+	t->next = *head;
+	if (*head)
+		(*head)->prev = &t->next;
+	*head = t;
+	wheel.used[level] |= 1ULL << idx;
+}
+
+/* unlink without touching the count */
+static void wheel_remove(struct timer *t)
+{
+	*t->prev = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	t->next = NULL;
+	t->prev = NULL;
+}
+
+void timer_init(struct timer *t, void (*fn)(struct timer *t, void *p), void *p)
+{
+	t->next = NULL;
+	t->prev = NULL;
+	t->expires = 0;
+	t->fn = fn;
+	t->p = p;
+}
+
+/* timer_add() schedules t to fire in ms milliseconds. a pending timer is
+ * rescheduled. */
+void timer_add(struct timer *t, unsigned long ms)
+{
+	unsigned long long now = timer_now();
+	timer_cancel(t);
+	if (!wheel.count)
+		wheel.clock = now; /* idle wheel, catch up for free */
+	t->expires = now + ms;
+	wheel_insert(t);
+	wheel.count++;
+}
+
+void timer_cancel(struct timer *t)
+{
+	if (!t->prev)
+		return;
+	wheel_remove(t);
+	if (t->slot != WHEEL_DETACHED) {
+		unsigned level = t->slot / WHEEL_SIZE;
+		unsigned idx = t->slot % WHEEL_SIZE;
+		if (!wheel.slot[level][idx])
+			wheel.used[level] &= ~(1ULL << idx);
+	}
+	wheel.count--;
+}
+
+int timer_pending(const struct timer *t)
+{
+	return t->prev != NULL;
+}
+
+/* the earliest tick at which the wheel has work to do, either a timer in
+ * level 0 or a slot above that needs to be cascaded. */
+static unsigned long long wheel_next_tick(void)
+{
+	unsigned long long best = ~0ULL;
+	unsigned level;
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		unsigned long long used = wheel.used[level];
+		if (!used)
+			continue;
+		unsigned shift = WHEEL_BITS * level;
+		unsigned long long base = wheel.clock >> shift;
+		unsigned cur = base & WHEEL_MASK;
+		unsigned long long rot = ror64(used, cur);
+		unsigned long long tick;
+		if (!level) {
+			tick = wheel.clock + __builtin_ctzll(rot);
+		} else {
+			/* the current slot is due if the clock sits on its
+			 * boundary, otherwise it was filed a full turn ahead */
+			unsigned k;
+			if ((rot & 1) && !(wheel.clock & ((1ULL << shift) - 1)))
+				k = 0;
+			else if (rot & ~1ULL)
+				k = __builtin_ctzll(rot & ~1ULL);
+			else
+				k = WHEEL_SIZE;
+			tick = (base + k) << shift;
+		}
+		if (tick < best)
+			best = tick;
+	}
+	return best;
+}
+
+/* timer_next() returns the number of milliseconds until timer_run() has work
+ * to do, or -1 if there are no timers. */
+long timer_next(void)
+{
+	if (!wheel.count)
+		return -1;
+	unsigned long long tick = wheel_next_tick();
+	unsigned long long now = timer_now();
+	if (tick <= now)
+		return 0;
+	if (tick - now > 0x7fffffffUL)
+		return 0x7fffffffL;
+	return tick - now;
+}
+
+static void wheel_cascade(unsigned level, unsigned idx)
+{
+	struct timer *t = wheel.slot[level][idx];
+	wheel.slot[level][idx] = NULL;
+	wheel.used[level] &= ~(1ULL << idx);
+	while (t) {
+		struct timer *next = t->next;
+		wheel_insert(t);
+		t = next;
+	}
+}
+
+/* timer_run() fires every timer that has expired. */
+void timer_run(void)
+{
+	if (!wheel.count)
+		return;
+	unsigned long long now = timer_now();
+	while (wheel.clock <= now) {
+		unsigned long long tick = wheel_next_tick();
+		if (tick > now) {
+			wheel.clock = now + 1;
+			break;
+		}
+		wheel.clock = tick;
+
+		/* move higher levels down, coarsest first */
+		unsigned level;
+		for (level = WHEEL_LEVELS - 1; level > 0; level--) {
+			unsigned shift = WHEEL_BITS * level;
+			if (tick & ((1ULL << shift) - 1))
+				continue;
+			wheel_cascade(level, (tick >> shift) & WHEEL_MASK);
+		}
+
+		/* detach the slot so callbacks can add timers safely */
+		unsigned idx = tick & WHEEL_MASK;
+		struct timer *list = wheel.slot[0][idx];
+		wheel.slot[0][idx] = NULL;
+		wheel.used[0] &= ~(1ULL << idx);
+		if (list)
+			list->prev = &list;
+		struct timer *t;
+		for (t = list; t; t = t->next)
+			t->slot = WHEEL_DETACHED;
+		wheel.clock = tick + 1;
+		while (list) {
+			t = list;
+			wheel_remove(t);
+			wheel.count--;
+			t->fn(t, t->p);
+		}
+	}
+}
+
+/* timer_count() returns the number of pending timers. */
+unsigned timer_count(void)
+{
+	return wheel.count;
+}
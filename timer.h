@@ -0,0 +1,19 @@
+#ifndef TIMER_H
+#define TIMER_H
+/* timers are embedded in the structure that owns them */
+struct timer {
+	struct timer *next, **prev;
+	unsigned long long expires; /* in milliseconds, see timer_now() */
+	unsigned slot; /* position in the wheel, used by timer_cancel() */
+	void (*fn)(struct timer *t, void *p);
+	void *p;
+};
+void timer_init(struct timer *t, void (*fn)(struct timer *t, void *p), void *p);
+void timer_add(struct timer *t, unsigned long ms);
+void timer_cancel(struct timer *t);
+int timer_pending(const struct timer *t);
+unsigned long long timer_now(void);
+long timer_next(void);
+void timer_run(void);
+unsigned timer_count(void);
+#endif
@@ -18,41 +18,62 @@
 /******************************************************************************/
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <locale.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <sched.h>
 #include <search.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #include <netdb.h>
-#include <sys/select.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include "atom.h"
+#include "buf.h"
 #include "cmd.h"
+#include "grow.h"
+#include "log.h"
+#include "mccp.h"
+#include "metrics.h"
+#include "mpsc.h"
 #include "objdb.h"
 #include "object.h"
+#include "pool.h"
 #include "rc.h"
+#include "sched.h"
+#include "sock.h"
+#include "telnet.h"
+#include "timer.h"
 
 /******************************************************************************/
 #define container_of(ptr, type, member) \
-	((type*)(char*)(ptr) - offsetof(type, member))
+	((type*)((char*)(ptr) - offsetof(type, member)))
 
 /******************************************************************************/
 
 #define DLIST_INSERT_AFTER(head, item) do { \
 	(item)->prev = (head); \
 	(item)->next = *(head); \
+	if (*(head)) (*(head))->prev = &(item)->next; \
 	*(head) = (item); \
 	} while (0)
 #define DLIST_REMOVE(item) do { \
 	if ((item)->prev) *(item)->prev = (item)->next; \
+	if ((item)->next) (item)->next->prev = (item)->prev; \
 	(item)->prev = NULL; \
 	(item)->next = NULL; \
 	} while (0)
@@ -76,168 +97,193 @@ struct prop {
 };
 
 /******************************************************************************/
+struct object *system_env; /* system environment options */
+static const struct atom *atom_origin; /* "ORIGIN", resolved once in main() */
+static struct object *server_template; /* frozen parent of every server env */
 
-/* flags for struct socket->event() */
-#define EVENT_READ (1)
-#define EVENT_WRITE (2)
+/******************************************************************************/
+/* worker threads - each one owns a poller and the connections it accepted */
+struct worker {
+	struct sockbase sockbase; /* eventfd, signaled when messages arrive */
+	struct mpsc queue; /* messages for connections owned by this worker */
+	int signaled; /* set while a wakeup is outstanding */
+	unsigned index;
+	int cpu; /* -1 if not pinned */
+	pthread_t thread;
+};
 
-typedef int SOCKET;
-#define INVALID_SOCKET (-1)
+#define WORKER_MAX 256 /* limited by the bits available in a server id */
 
-struct sockbase {
-	SOCKET fd;
-	int rc;
-	void (*event)(SOCKET fd, struct sockbase *ptr, long event);
-	void (*free)(void *ptr);
+static struct worker *workers;
+static unsigned worker_count;
+static __thread struct worker *worker_self;
+
+/* env_long() returns a numeric option from system_env, or def if unset. */
+static long env_long(const char *name, long def)
+{
+	const char *v = obj_get(system_env, name);
+	if (!v || !*v)
+		return def;
+	char *end;
+	long n = strtol(v, &end, 0);
+	if (*end) {
+		log_warning("%s:not a number \"%s\"", name, v);
+		return def;
+	}
+	return n;
+}
+
+/******************************************************************************/
+/* connection stream - can be used by servers or clients */
+#define CONNECTION_IOV_MAX 64 /* segments written by one writev() */
+#define CONNECTION_BUF_SIZE 512 /* longest input line */
+
+struct connection {
+	struct sockbase sockbase;
+	/* input buffer, only allocated while a partial line is pending */
+	unsigned buflen;
+	unsigned bufmax;
+	unsigned char discard; /* skipping the rest of an overlong line */
+	char *buf;
+	struct telnet telnet; /* state of the telnet protocol on input */
+	/* output buffer */
+	struct buf_chain out;
+	/* compressed output, written ahead of out */
+	struct mccp *mccp; /* NULL unless MCCP is active */
+	struct buf_chain zout;
+	unsigned char overflow; /* output is dropped, and the client cut off */
 };
 
-#define SOCKMAX 256
+static int connection_mccp; /* offer compression to new connections */
+static size_t connection_out_max; /* queued output allowed, 0 for no limit */
+static __thread struct pool connection_buf_pool = POOL_INIT(CONNECTION_BUF_SIZE, 64);
 
-static struct socket_info {
-	SOCKET fd; /* this is redundant because of sockbase */
-	struct sockbase *ptr;
-} sockets[SOCKMAX];
-static int sockets_max = sizeof(sockets) / sizeof(*sockets);
-static int sockets_fdmax;
-static int sockets_count;
-static fd_set sockets_rfds, sockets_wfds;
+static void connection_overflow(struct connection *c);
 
-void sockerror(const char *reason)
+/* connection_full() returns non-zero if len more bytes of output must be
+ * dropped. a client that lets its output pile up past connection_out_max is
+ * disconnected. */
+static int connection_full(struct connection *c, size_t len)
 {
-	fprintf(stderr, "%s:%s\n", reason, strerror(errno));
+	if (c->overflow)
+		return 1;
+	if (!connection_out_max || c->out.len + c->zout.len + len <= connection_out_max)
+		return 0;
+	c->overflow = 1;
+	connection_overflow(c);
+	return 1;
 }
 
-void sockclose(SOCKET fd)
+/* telnet replies go out ahead of anything queued later */
+static void connection_telnet_send(void *p, const void *data, size_t len)
 {
-	if (fd != INVALID_SOCKET) {
-		close(fd);
-		sockets_count--;
-	} else {
-		fprintf(stderr, "%s:fd is invalid!\n", __func__);
-	}
+	struct connection *c = p;
+	if (connection_full(c, len))
+		return;
+	if (!buf_write(&c->out, data, len))
+		sockset(c->sockbase.fd, EVENT_WRITE);
 }
 
-int sockset(SOCKET fd, long events)
+static void connection_mccp_report(struct connection *c)
 {
-	if (fd == INVALID_SOCKET || fd >= sockets_max)
-		return -1;
-	if (events & EVENT_READ)
-		FD_SET(fd, &sockets_rfds);
-	if (events & EVENT_WRITE)
-		FD_SET(fd, &sockets_wfds);
-	return 0;
+	const struct mccp_stats *st = mccp_stats(c->mccp);
+	log_info("mccp:fd=%d raw=%llu packed=%llu ratio=%.2f cpu=%lluus (%.1fus/KB)",
+		c->sockbase.fd, st->raw, st->packed,
+		st->packed ? (double)st->raw / st->packed : 0.0,
+		st->cpu_ns / 1000, st->raw ? st->cpu_ns / (st->raw / 1024.0) / 1000 : 0.0);
 }
 
-int sockclr(SOCKET fd, long events)
+/* start compressing, everything queued so far goes out as plain text */
+static int connection_mccp_start(struct connection *c)
 {
-	if (fd == INVALID_SOCKET || fd >= sockets_max)
+	static const unsigned char start[] = {
+		TELNET_IAC, TELNET_SB, TELNET_OPT_MCCP2, TELNET_IAC, TELNET_SE
+	};
+
+	if (c->mccp)
+		return 0;
+	struct mccp *m = mccp_new();
+	if (!m)
+		return -1;
+	if (!telnet_enabled(&c->telnet, TELNET_OPT_MCCP2))
+		telnet_negotiate(&c->telnet, TELNET_WILL, TELNET_OPT_MCCP2);
+	if (buf_write(&c->out, start, sizeof(start))) {
+		mccp_free(m);
 		return -1;
-	if (events & EVENT_READ)
-		FD_CLR(fd, &sockets_rfds);
-	if (events & EVENT_WRITE)
-		FD_CLR(fd, &sockets_wfds);
+	}
+	buf_splice(&c->zout, &c->out);
+	c->mccp = m;
+	sockset(c->sockbase.fd, EVENT_WRITE);
 	return 0;
 }
 
-int sockadd(SOCKET fd, struct sockbase *ptr, long events,
-	void (*event)(SOCKET fd, struct sockbase *ptr, long event),
-	void (*free)(struct sockbase *ptr))
+/* end the compressed stream, output after this is plain text again */
+static void connection_mccp_end(struct connection *c)
 {
-	if (fd == INVALID_SOCKET || fd >= sockets_max)
-		return -1;
-	if (fd > sockets_fdmax)
-		sockets_fdmax = fd;
-	sockets_count++;
-	sockets[fd].fd = fd; /* this is somewhat redundant */
-	sockets[fd].ptr = ptr;
-	ptr->event = event;
-	ptr->free = (void(*)(void*))free;
-	sockset(fd, events);
-	return 0;
+	if (!c->mccp)
+		return;
+	if (mccp_compress(c->mccp, &c->out, &c->zout) ||
+			mccp_finish(c->mccp, &c->zout))
+		log_warning("%s():could not finish stream", __func__);
+	connection_mccp_report(c);
+	mccp_free(c->mccp);
+	c->mccp = NULL;
+	sockset(c->sockbase.fd, EVENT_WRITE);
 }
 
-int sockpoll(void)
+static int connection_telnet_option(void *p, unsigned char cmd, unsigned char opt)
 {
-	if (!sockets_count)
-		return -1;
-
-	fd_set rfds = sockets_rfds;
-	fd_set wfds = sockets_wfds;
-
-	struct timeval next = { .tv_sec = 300 }; // TODO: find next timer
-	int n = select(sockets_fdmax + 1, &rfds, &wfds, NULL, &next);
-	if (n < 0) {
-		sockerror("select()");
-		return -1;
-	}
-
-	int i;
-	for (i = 0; i < sockets_max; i++) {
-		if (sockets[i].ptr == NULL)
-			continue;
-		int fd = sockets[i].fd;
-		if (fd == INVALID_SOCKET)
-			continue;
-		int event = 0;
-		if (FD_ISSET(fd, &rfds))
-			event |= EVENT_READ;
-		if (FD_ISSET(fd, &wfds))
-			event |= EVENT_WRITE;
-
-		if (event) {
-			struct sockbase *s = sockets[i].ptr;
-			RETAIN(s);
-			s->event(fd, sockets[i].ptr, event);
-			RELEASE(s, s->free);
-		}
-	}
-
+	struct connection *c = p;
+	if (opt != TELNET_OPT_MCCP2 || !connection_mccp)
+		return 0;
+	if (cmd == TELNET_DO)
+		return !connection_mccp_start(c);
+	if (cmd == TELNET_DONT)
+		connection_mccp_end(c);
 	return 0;
 }
 
-/******************************************************************************/
-struct object *system_env; /* system environment options */
-
-/******************************************************************************/
-/* connection stream - can be used by servers or clients */
-struct connection {
-	struct sockbase sockbase;
-	/* input buffer */
-	unsigned buflen;
-	unsigned bufmax;
-	char buf[512];
-	/* output buffer */
-	unsigned outbuf_len, outbuf_max;
-	char outbuf[16384];
-};
-
 void connection_init(struct connection *c, SOCKET fd)
 {
 	c->sockbase.fd = fd;
 	c->buflen = 0;
-	c->bufmax = sizeof(c->buf); // TODO: support dynamic allocation
-	c->outbuf_len = 0;
-	c->outbuf_max = sizeof(c->outbuf); // TODO: support dynamic allocation
+	c->bufmax = CONNECTION_BUF_SIZE;
+	c->buf = NULL;
+	c->discard = 0;
+	c->overflow = 0;
+	buf_init(&c->out);
+	c->mccp = NULL;
+	buf_init(&c->zout);
+	telnet_init(&c->telnet, c);
+	c->telnet.send = connection_telnet_send;
+	c->telnet.option = connection_telnet_option;
+}
+
+void connection_free(struct connection *c)
+{
+	if (c->mccp) {
+		connection_mccp_report(c);
+		mccp_free(c->mccp);
+		c->mccp = NULL;
+	}
+	buf_free(&c->zout);
+	buf_free(&c->out);
+	pool_free(&connection_buf_pool, c->buf);
+	c->buf = NULL;
 }
 
 int connection_vprintf(struct connection *c, const char *fmt, va_list ap)
 {
-	int rem = (int)c->outbuf_max - (int)c->outbuf_len;
-	if (rem > 0) {
-		int e = vsnprintf(c->outbuf + c->outbuf_len, rem, fmt, ap);
-		if (e <= rem) {
-			c->outbuf_len += e;
-		} else {
-			fprintf(stderr, "WARNING:%s():output truncated (rem=%d e=%d)\n", __func__, rem, e);
-			c->outbuf_len = c->outbuf_max;
-			e = -1; /* treat this as an error */
-		}
-		sockset(c->sockbase.fd, EVENT_WRITE);
-		return e;
-	} else {
-		fprintf(stderr, "WARNING:%s():connection buffer full (max=%d len=%d)\n", __func__, c->outbuf_max, c->outbuf_len);
+	if (connection_full(c, 0))
+		return -1;
+	int e = buf_vprintf(&c->out, fmt, ap);
+	if (e < 0) {
+		log_warning("%s():out of memory for output", __func__);
 		return -1;
 	}
+	if (e)
+		sockset(c->sockbase.fd, EVENT_WRITE);
+	return e;
 }
 
 int connection_printf(struct connection *c, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
@@ -250,30 +296,64 @@ int connection_printf(struct connection *c, const char *fmt, ...)
 	return e;
 }
 
+/* connection_send() queues a shared segment, see buf_seg_printf(). */
+int connection_send(struct connection *c, struct buf_seg *seg)
+{
+	if (connection_full(c, seg->len))
+		return -1;
+	if (buf_append_seg(&c->out, seg))
+		return -1;
+	sockset(c->sockbase.fd, EVENT_WRITE);
+	return 0;
+}
+
 /******************************************************************************/
 /* each remote client is serviced by a single server instance */
 struct server {
 	struct connection c;
 	struct server *next, **prev;
 	struct object *env; /* current environment */
+	struct timer idle; /* disconnects the connection when it goes quiet */
+	struct sched_entity sched; /* commands waiting to run */
+	unsigned long long id; /* see server_id() */
+	unsigned long long accepted_ns; /* until the first byte is written */
+	int admin; /* may run admin commands, see act_admin() */
+};
+
+/* servers are freed on the worker that owns them */
+static __thread struct pool server_pool = POOL_INIT(sizeof(struct server), 64);
+
+/* a message posted to a connection that may belong to another worker */
+struct server_message {
+	struct mpsc_node node;
+	void (*run)(struct server_message *m); /* a task instead, it frees m */
+	unsigned long long to; /* 0 for every connection on the worker */
+	struct buf_seg *seg;
 };
 
+static __thread struct server *server_list; /* connections on this worker */
+
+static unsigned long server_idle_ms; /* 0 disables idle reaping */
+
 static void server_close(struct server *s)
 {
 	SOCKET fd = s->c.sockbase.fd;
 	if (fd != INVALID_SOCKET) {
-		FD_CLR(fd, &sockets_rfds);
-		FD_CLR(fd, &sockets_wfds);
-		sockclose(fd);
+		/* sockclose() may drop the last reference, so mark it first */
 		s->c.sockbase.fd = INVALID_SOCKET;
+		sockclose(fd);
 	}
 }
 
 void server_free(struct server *s)
 {
+	timer_cancel(&s->idle);
+	sched_remove(&s->sched);
+	DLIST_REMOVE(s);
 	server_close(s);
+	connection_free(&s->c);
 	obj_release(s->env);
-	free(s);
+	pool_free(&server_pool, s);
 }
 
 static void server_free_sockbase(struct sockbase *base)
@@ -283,106 +363,458 @@ static void server_free_sockbase(struct sockbase *base)
 	server_free(s);
 }
 
+/* run a queued command, returns non-zero if the connection is gone */
+static int server_command(struct sched_entity *e, const char *line, size_t len)
+{
+	struct server *s = container_of(e, struct server, sched);
+	struct sockbase *sb = &s->c.sockbase;
+	int closed;
+
+	RETAIN(sb); /* the command may close the connection */
+	if (command_run(line, len, s))
+		connection_printf(&s->c, "Huh?\n");
+	closed = s->c.sockbase.fd == INVALID_SOCKET;
+	RELEASE(sb, server_free_sockbase);
+	return closed;
+}
+
+/* server_input() frames lines in the input buffer and queues them for the
+ * scheduler, only an incomplete line at the end is moved. scan is where the
+ * new data begins and len is its length. */
+static void server_input(struct server *s, unsigned scan, unsigned len)
+{
+	struct connection *c = &s->c;
+	char *start = c->buf, *end = c->buf + scan + len;
+	char *cur = c->buf + scan;
+	char *nl;
+	int dropped = 0;
+
+	c->buflen = scan + len;
+	while ((nl = memchr(cur, '\n', end - cur))) {
+		char *next = nl + 1;
+		if (c->discard) {
+			c->discard = 0; /* end of the overlong line */
+		} else {
+			if (nl > start && nl[-1] == '\r')
+				nl--;
+			if (sched_push(&s->sched, start, nl - start))
+				dropped++;
+		}
+		start = cur = next;
+	}
+	if (dropped)
+		connection_printf(c, "You are typing too fast, %d commands were dropped.\n", dropped);
+
+	c->buflen = end - start;
+	if (c->buflen == c->bufmax) {
+		/* no room left for the end of the line */
+		connection_printf(c, "Line too long.\n");
+		metrics_count(METRIC_TRUNCATED, 1);
+		c->discard = 1;
+		c->buflen = 0;
+	} else if (start != c->buf && c->buflen) {
+		memmove(c->buf, start, c->buflen);
+	}
+	if (c->discard)
+		c->buflen = 0;
+}
+
 static void server_event(SOCKET fd, struct sockbase *sockbase, long event)
 {
 	struct connection *c = container_of(sockbase, struct connection, sockbase);
 	struct server *s = container_of(c, struct server, c);
 
 	if (event & EVENT_WRITE) {
-		// TODO: handle write
-		if (c->outbuf_len) {
-			int e = write(fd, c->outbuf, c->outbuf_len);
-			if (e < 0) {
+		/* compress everything queued since the last write in one go */
+		if (c->mccp && c->out.len && mccp_compress(c->mccp, &c->out, &c->zout)) {
+			server_close(s);
+			return;
+		}
+		struct buf_chain *out = c->zout.len ? &c->zout : &c->out;
+		if (out->len) {
+			struct iovec iov[CONNECTION_IOV_MAX];
+			int cnt = buf_iov(out, iov, CONNECTION_IOV_MAX);
+			ssize_t e = sockwritev(fd, iov, cnt);
+			if (e < 0 && (errno == EAGAIN || errno == EINTR)) {
+				e = 0; /* try again on the next event */
+			} else if (e < 0) {
 				sockerror("write()");
 				server_close(s);
 				return;
 			}
-			if (e < (int)c->outbuf_len) {
-				memmove(c->outbuf, c->outbuf + e, c->outbuf_len - e);
+			/* a partial write only advances offsets */
+			buf_consume(out, e);
+			if (e > 0) {
+				metrics_count(METRIC_BYTES_WRITTEN, e);
+				if (s->accepted_ns) {
+					metrics_record(METRIC_FIRST_BYTE, metrics_now() - s->accepted_ns);
+					s->accepted_ns = 0;
+				}
 			}
-			c->outbuf_len -= e;
-			/* if the buffer is empty, clear the write flag */
-			if (!c->outbuf_len)
-				sockclr(fd, EVENT_WRITE);
 		}
+		/* if the buffer is empty, clear the write flag */
+		if (!c->out.len && !c->zout.len)
+			sockclr(fd, EVENT_WRITE);
 	}
 	if (event & EVENT_READ) {
-		// TODO: handle read
-		int rem = (int)c->bufmax - (int)c->buflen;
-		fprintf(stderr, "INFO:%s():rem=%d\n", __func__, rem);
-
-		if (rem > 0) {
-			int e = read(fd, c->buf + c->buflen, rem);
-			if (e < 0) {
-				sockerror("read()");
-				server_close(s);
+		if (!c->buf) {
+			c->buf = pool_alloc(&connection_buf_pool);
+			if (!c->buf) {
+				log_warning("%s():out of memory for input", __func__);
 				return;
 			}
-			if (e == 0) {
-				fprintf(stderr, "Connection closed\n");
-				server_close(s);
-				return;
-			}
-			fprintf(stderr, "INFO:%s():e=%d\n", __func__, e);
-			c->buflen += e;
 		}
+		int rem = (int)c->bufmax - (int)c->buflen;
+		int e = sockread(fd, c->buf + c->buflen, rem);
+		if (e < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return; /* spurious wakeup */
+		}
+		if (e < 0) {
+			sockerror("read()");
+			server_close(s);
+			return;
+		}
+		if (e == 0) {
+			log_info("Connection closed");
+			server_close(s);
+			return;
+		}
+		log_debug("%s():e=%d", __func__, e);
+		metrics_count(METRIC_BYTES_READ, e);
+		if (c->overflow)
+			return; /* being cut off */
+		if (server_idle_ms)
+			timer_add(&s->idle, server_idle_ms);
+
+		/* strip telnet commands, then run every complete line */
+		unsigned n = telnet_parse(&c->telnet, c->buf + c->buflen, e);
+		server_input(s, c->buflen, n);
+
+		/* hand the buffer back until the next read */
+		if (!c->buflen) {
+			pool_free(&connection_buf_pool, c->buf);
+			c->buf = NULL;
+		}
+	}
+}
+
+static void server_idle(struct timer *t, void *p)
+{
+	struct server *s = p;
+	struct sockbase *sb = &s->c.sockbase;
+	(void)t;
+	if (!s->c.overflow)
+		log_info("%s():%s:idle timeout", __func__, obj_get_atom(s->env, atom_origin));
+	RETAIN(sb);
+	server_close(s);
+	RELEASE(sb, server_free_sockbase);
+}
+
+/* the writer may be in the middle of walking server_list, so the client is
+ * cut off from the event loop instead, through its idle timer. */
+static void connection_overflow(struct connection *c)
+{
+	struct server *s = container_of(c, struct server, c);
+	log_warning("%s:%zu bytes of output not read, disconnecting",
+		obj_get_atom(s->env, atom_origin), c->out.len + c->zout.len);
+	timer_cancel(&s->idle);
+	timer_add(&s->idle, 0);
+}
+
+/* ids are <worker:8><generation:32><fd:24>, they stay valid across threads
+ * and a stale id can't match a newer connection that reused the fd. */
+static unsigned long long server_make_id(SOCKET fd)
+{
+	static __thread unsigned generation;
+	return ((unsigned long long)worker_self->index << 56) |
+		((unsigned long long)++generation << 24) |
+		((unsigned long long)fd & 0xffffff);
+}
+
+unsigned long long server_id(struct server *s)
+{
+	return s->id;
+}
+
+/* find a server owned by the calling thread */
+static struct server *server_lookup(unsigned long long id)
+{
+	if ((id >> 56) != worker_self->index)
+		return NULL;
+	struct sockbase *sb = sockget(id & 0xffffff);
+	if (!sb || sb->event != server_event)
+		return NULL;
+	struct connection *c = container_of(sb, struct connection, sockbase);
+	struct server *s = container_of(c, struct server, c);
+	return s->id == id ? s : NULL;
+}
+
+/* only the first wakeup since the worker last drained pays a syscall */
+static void worker_wake(struct worker *w)
+{
+	if (!__atomic_exchange_n(&w->signaled, 1, __ATOMIC_ACQ_REL)) {
+		uint64_t one = 1;
+		if (write(w->sockbase.fd, &one, sizeof(one)) != sizeof(one))
+			sockerror("eventfd");
+	}
+}
+
+/* post a segment to another worker, it holds a reference until delivered */
+static int server_post(struct worker *w, unsigned long long to, struct buf_seg *seg)
+{
+	struct server_message *m = malloc(sizeof(*m));
+	if (!m) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return -1;
+	}
+	m->run = NULL;
+	m->to = to;
+	m->seg = seg;
+	buf_seg_retain(seg);
+	mpsc_push(&w->queue, &m->node);
+	worker_wake(w);
+	return 0;
+}
+
+/* an objdb completion, run on the worker that started the request.
+ *
+ * at shutdown the workers exit before objdb_shutdown() finishes what is
+ * queued, and copyover execs from inside it. a completion that arrives after
+ * its worker has exited is left in the worker's queue and never runs, so
+ * neither the task nor the object or argument it carries is freed. that is
+ * only safe because the process exits or execs right after, a caller must
+ * not rely on done to release anything else. */
+struct worker_task {
+	struct server_message m;
+	struct worker *w;
+	void (*loaded)(void *arg, struct object *obj);
+	void (*committed)(void *arg, int ok);
+	void *arg;
+	struct object *obj;
+	int ok;
+};
+
+static void worker_task_loaded(struct server_message *m)
+{
+	struct worker_task *t = container_of(m, struct worker_task, m);
+	t->loaded(t->arg, t->obj);
+	free(t);
+}
+
+static void worker_task_committed(struct server_message *m)
+{
+	struct worker_task *t = container_of(m, struct worker_task, m);
+	t->committed(t->arg, t->ok);
+	free(t);
+}
+
+/* called from an objdb thread, hand the result to the worker */
+static void worker_task_post(struct worker_task *t)
+{
+	mpsc_push(&t->w->queue, &t->m.node);
+	worker_wake(t->w);
+}
+
+static void worker_objdb_loaded(void *p, struct object *obj)
+{
+	struct worker_task *t = p;
+	t->obj = obj;
+	t->m.run = worker_task_loaded;
+	worker_task_post(t);
+}
+
+static void worker_objdb_committed(void *p, int ok)
+{
+	struct worker_task *t = p;
+	t->ok = ok;
+	t->m.run = worker_task_committed;
+	worker_task_post(t);
+}
+
+/* worker_load() loads path without blocking this worker, done is called from
+ * its event loop. returns -1 if done will not be called. */
+static int worker_load(const char *path, void (*done)(void *arg, struct object *obj), void *arg)
+{
+	struct worker_task *t = calloc(1, sizeof(*t));
+	if (!t) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return -1;
+	}
+	t->w = worker_self;
+	t->loaded = done;
+	t->arg = arg;
+	if (objdb_load_async(path, worker_objdb_loaded, t)) {
+		free(t);
+		return -1;
 	}
+	return 0;
 }
 
-static struct sockbase *server_new(SOCKET fd, const char *origin)
+/* worker_commit() commits without blocking this worker, done is called from
+ * its event loop once the commit is durable or has failed. */
+static int worker_commit(struct objdb_txn *txn, void (*done)(void *arg, int ok), void *arg)
+{
+	struct worker_task *t = calloc(1, sizeof(*t));
+	if (!t) {
+		log_error("%s:%s", __func__, strerror(errno));
+		objdb_rollback(txn);
+		return -1;
+	}
+	t->w = worker_self;
+	t->committed = done;
+	t->arg = arg;
+	return objdb_commit_async(txn, worker_objdb_committed, t);
+}
+
+/* queue a segment on every connection owned by this worker */
+static void server_fanout(struct buf_seg *seg)
 {
 	struct server *s;
-	s = calloc(1, sizeof(*s));
+	for (s = server_list; s; s = s->next)
+		connection_send(&s->c, seg);
+}
+
+/* server_send_seg() queues a shared segment for a connection on any worker.
+ * returns 0 on success, -1 if the connection is known to be gone. */
+int server_send_seg(unsigned long long id, struct buf_seg *seg)
+{
+	unsigned index = id >> 56;
+	if (!id || index >= worker_count)
+		return -1;
+	struct worker *w = &workers[index];
+	if (w != worker_self)
+		return server_post(w, id, seg);
+	struct server *s = server_lookup(id);
+	if (!s)
+		return -1;
+	return connection_send(&s->c, seg);
+}
+
+/* server_send() queues text for a connection on any worker. */
+int server_send(unsigned long long id, const char *text)
+{
+	struct buf_seg *seg = buf_seg_printf("%s", text);
+	if (!seg)
+		return -1;
+	int e = server_send_seg(id, seg);
+	buf_seg_release(seg);
+	return e;
+}
+
+/* server_broadcast() sends one formatted message to every connection. it is
+ * formatted once and shared by all of the output queues. */
+int server_broadcast(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	struct buf_seg *seg = buf_seg_vprintf(fmt, ap);
+	va_end(ap);
+	if (!seg)
+		return -1;
+	unsigned i;
+	for (i = 0; i < worker_count; i++) {
+		if (&workers[i] == worker_self)
+			server_fanout(seg);
+		else
+			server_post(&workers[i], 0, seg);
+	}
+	buf_seg_release(seg);
+	return 0;
+}
+
+/* server_new() creates a connection for fd. env is NULL for a new arrival,
+ * or the saved environment of a connection adopted after a copyover. */
+static struct sockbase *server_new(SOCKET fd, const char *origin, struct object *env)
+{
+	struct server *s;
+	s = pool_alloc(&server_pool);
+	if (!s) {
+		/* callers count on fd and env being disposed of on failure */
+		log_error("could not allocate connection");
+		close(fd); /* not registered yet */
+		if (env)
+			obj_release(env);
+		return NULL;
+	}
+	memset(s, 0, sizeof(*s));
 	RETAIN(&s->c.sockbase);
 	connection_init(&s->c, fd);
-
-	/* copy the template environment */
-	const char *template = obj_get(system_env, "server.template");
-	if (template) {
-		s->env = objdb_load(template);
-	} else {
-		fprintf(stderr, "WARNING:server.template not set, using empty environment\n");
+	s->id = server_make_id(fd);
+	if (!env)
+		s->accepted_ns = metrics_now();
+	timer_init(&s->idle, server_idle, s);
+	sched_init(&s->sched, server_command);
+
+	/* inherit the template environment, only overrides are stored */
+	if (env)
+		s->env = env;
+	else if (server_template)
+		s->env = obj_new_child(server_template);
+	else
 		s->env = obj_new();
-	}
 
 	/* set environment variable */
-	if (obj_set(s->env, "ORIGIN", origin)) {
+	if (!env && obj_set_atom(s->env, atom_origin, origin)) {
+		struct sockbase *sb = &s->c.sockbase;
+		log_error("could not create connection");
+		RELEASE(sb, server_free_sockbase);
+		return NULL;
+	}
+
+	if (sockadd(fd, &s->c.sockbase, EVENT_READ, server_event, server_free_sockbase)) {
 		struct sockbase *sb = &s->c.sockbase;
-		fprintf(stderr, "ERROR:could not create connection\n");
+		log_error("could not register connection");
 		RELEASE(sb, server_free_sockbase);
 		return NULL;
 	}
 
-	sockadd(fd, &s->c.sockbase, EVENT_READ, server_event, server_free_sockbase);
-
-	/* show an annoying legal notice */
-	connection_printf(&s->c,
-		"Copyright 2015 Jon Mayo <jon@cobra-kai.com>\n"
-		"\n"
-		"This program is free software: you can redistribute it and/or modify it\n"
-		"under the terms of the GNU Affero General Public License version 3 as\n"
-		"published by the Free Software Foundation supplemented with the\n"
-		"Additional Terms, as set forth in the License Agreement for the Waking\n"
-		"Well MUD.\n"
-		"\n"
-		"This program is distributed in the hope that it will be useful, but\n"
-		"WITHOUT ANY WARRANTY; without even the implied warranty of\n"
-		"MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Affero\n"
-		"General Public License for more details.\n"
-		"\n"
-		"You should have received a copy of the License Agreement for the Waking\n"
-		"Well MUD along with this program. If not, see\n"
-		"http://www.gnu.org/licenses/agpl-3.0.en.html\n"
-		"\n"
-		"You are required to keep these \"Appropriate Legal Notices\" intact as\n"
-		"set forth in section 5(d) of the GNU Affero General Public License\n"
-		"version 3. In accordance with section 7(b) these Legal Notices must\n"
-		"retain the display of the \"the Waking Well MUD\" logo in order to\n"
-		"indicate the origin of the Program. If the display of the logo is not\n"
-		"reasonably feasible for technical reasons, these Legal Notices must\n"
-		"display the phrase \"the Waking Well MUD\".\n\n");
-
-	command_run("print", s); // TODO: execute starting object
+	DLIST_INSERT_AFTER(&server_list, s);
+
+	if (connection_mccp)
+		telnet_negotiate(&s->c.telnet, TELNET_WILL, TELNET_OPT_MCCP2);
+
+	if (env) {
+		connection_printf(&s->c, "Copyover complete.\n");
+		if (server_idle_ms)
+			timer_add(&s->idle, server_idle_ms);
+		return &s->c.sockbase;
+	}
+
+	/* show an annoying legal notice, formatted once and shared */
+	static __thread struct buf_seg *legal_notice;
+	if (!legal_notice)
+		legal_notice = buf_seg_printf("%s",
+			"Copyright 2015 Jon Mayo <jon@cobra-kai.com>\n"
+			"\n"
+			"This program is free software: you can redistribute it and/or modify it\n"
+			"under the terms of the GNU Affero General Public License version 3 as\n"
+			"published by the Free Software Foundation supplemented with the\n"
+			"Additional Terms, as set forth in the License Agreement for the Waking\n"
+			"Well MUD.\n"
+			"\n"
+			"This program is distributed in the hope that it will be useful, but\n"
+			"WITHOUT ANY WARRANTY; without even the implied warranty of\n"
+			"MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Affero\n"
+			"General Public License for more details.\n"
+			"\n"
+			"You should have received a copy of the License Agreement for the Waking\n"
+			"Well MUD along with this program. If not, see\n"
+			"http://www.gnu.org/licenses/agpl-3.0.en.html\n"
+			"\n"
+			"You are required to keep these \"Appropriate Legal Notices\" intact as\n"
+			"set forth in section 5(d) of the GNU Affero General Public License\n"
+			"version 3. In accordance with section 7(b) these Legal Notices must\n"
+			"retain the display of the \"the Waking Well MUD\" logo in order to\n"
+			"indicate the origin of the Program. If the display of the logo is not\n"
+			"reasonably feasible for technical reasons, these Legal Notices must\n"
+			"display the phrase \"the Waking Well MUD\".\n\n");
+	if (legal_notice)
+		connection_send(&s->c, legal_notice);
+
+	command_run("print", strlen("print"), s); // TODO: execute starting object
+
+	if (server_idle_ms)
+		timer_add(&s->idle, server_idle_ms);
 
 	return &s->c.sockbase;
 }
@@ -396,12 +828,15 @@ struct service {
 	struct object *template; // TODO: load this
 };
 
-static struct service *service_list;
+static __thread struct service *service_list;
 
 static void service_close(struct service *s)
 {
-	sockclose(s->sockbase.fd);
-	s->sockbase.fd = -1;
+	SOCKET fd = s->sockbase.fd;
+	if (fd != INVALID_SOCKET) {
+		s->sockbase.fd = INVALID_SOCKET;
+		sockclose(fd);
+	}
 }
 
 void service_free(struct service *s)
@@ -421,13 +856,14 @@ static void service_event(SOCKET fd, struct sockbase *sockbase, long event)
 	// TODO: setup global parameters from the service structure:
 	struct service *s = container_of(sockbase, struct service, sockbase);
 
-	if (event & EVENT_READ) {
+	/* drain the backlog, an accept storm shouldn't cost one wakeup each */
+	while (event & EVENT_READ) {
 		struct sockaddr_storage sa;
 		socklen_t sa_len = sizeof(sa);
 
-		SOCKET newfd = accept4(fd, (struct sockaddr*)&sa, &sa_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		SOCKET newfd = sockaccept(fd, (struct sockaddr*)&sa, &sa_len);
 		if (newfd == INVALID_SOCKET) {
-			if (errno != EAGAIN)
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
 				sockerror("accept()");
 			return;
 		}
@@ -445,17 +881,40 @@ static void service_event(SOCKET fd, struct sockbase *sockbase, long event)
 		// TODO: check for truncation in snprintf
 		snprintf(host + hostlen, sizeof(host) - hostlen, "/%s", port);
 
-		struct sockbase *newserver = server_new(newfd, host);
+		/* server_new() closes newfd on failure */
+		struct sockbase *newserver = server_new(newfd, host, NULL);
 		if (!newserver) {
-			fprintf(stderr, "ERROR:could not create connection\n");
-			sockclose(newfd);
-			return;
+			log_error("could not create connection");
+			continue;
 		}
 
-		fprintf(stderr, "New conncection: %s\n", host);
+		log_info("New conncection: %s", host);
+		metrics_count(METRIC_ACCEPTED, 1);
 	}
 }
 
+/* service_add() accepts connections on a listening socket.
+ * returns 0 on success, or -1 and closes fd. */
+static int service_add(SOCKET fd)
+{
+	struct service *s;
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		log_error("%s:%s", __func__, strerror(errno));
+		sockclose(fd);
+		return -1;
+	}
+	RETAIN(&s->sockbase); // TODO: write a function to close a service too
+	s->sockbase.fd = fd;
+	if (sockadd(fd, &s->sockbase, EVENT_READ, service_event, service_free_sockbase)) {
+		sockclose(fd);
+		free(s);
+		return -1;
+	}
+	DLIST_INSERT_AFTER(&service_list, s);
+	return 0;
+}
+
 int service_open(const char *hostport)
 {
 	/* split host and port number from HHHHH/NNNN */
@@ -475,7 +934,7 @@ int service_open(const char *hostport)
 	};
 	int e = getaddrinfo(*host ? host : NULL, service, &hints, &res);
 	if (e) {
-		fprintf(stderr, "ERROR:%s:%s\n", hostport, gai_strerror(e));
+		log_error("%s:%s", hostport, gai_strerror(e));
 		return -1;
 	}
 
@@ -488,41 +947,737 @@ int service_open(const char *hostport)
 		/* fcntl(fd, F_SETFL, O_NONBLOCK); */
 		/* fcntl(fd, F_SETFD, FD_CLOEXEC); */
 
+		/* every worker binds its own listener, the kernel balances them */
+		if (worker_count > 1) {
+			int one = 1;
+			if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)))
+				sockerror(hostport);
+		}
+
 		if (bind(fd, cur->ai_addr, cur->ai_addrlen) == -1 ||
-				listen(fd, 6) == -1) {
+				listen(fd, SOMAXCONN) == -1) {
 			sockerror(hostport);
 			sockclose(fd);
 			continue;
 		}
 
-		/* add the service */
-		struct service *s;
-		s = calloc(1, sizeof(*s));
-		RETAIN(&s->sockbase); // TODO: write a function to close a service too
-		s->sockbase.fd = fd;
-		DLIST_INSERT_AFTER(&service_list, s);
-		sockadd(fd, &s->sockbase, EVENT_READ, service_event, service_free_sockbase);
-		fprintf(stderr, "Started %s\n", hostport);
+		if (!service_add(fd))
+			log_info("Started %s", hostport);
 	}
 	freeaddrinfo(res);
 	return 0;
 }
 
 /******************************************************************************/
+/* admin commands start with this check, to anybody else they don't exist */
+static int server_admin(struct server *s)
+{
+	if (s->admin)
+		return 1;
+	connection_printf(&s->c, "Huh?\n");
+	return 0;
+}
+
+/* admin <password> unlocks the admin commands for this connection. there are
+ * no admins unless admin.password is set. */
+void act_admin(void *p, const char *arg, size_t arglen)
+{
+	struct server *s = p;
+	const char *password = obj_get(system_env, "admin.password");
+	size_t i, len = password ? strlen(password) : 0;
+	/* look at every byte, so the time taken gives nothing away */
+	int diff = !len || arglen != len;
+	for (i = 0; i < arglen; i++)
+		diff |= arg[i] ^ (i < len ? password[i] : 0);
+	if (diff) {
+		log_warning("%s:admin password refused", obj_get_atom(s->env, atom_origin));
+		connection_printf(&s->c, "Wrong password.\n");
+		return;
+	}
+	s->admin = 1;
+	log_info("%s:admin", obj_get_atom(s->env, atom_origin));
+	connection_printf(&s->c, "Admin commands unlocked.\n");
+}
+
 // TODO: these functions need a connection and an object
-void act_print(void *p)
+void act_print(void *p, const char *arg, size_t arglen)
 {
 	struct server *s = p;
-	fprintf(stderr, "%s():p=%p\n", __func__, p);
+	(void)arg;
+	(void)arglen;
+	log_debug("%s():p=%p", __func__, p);
 
 	connection_printf(&s->c, "Hello\n");
 }
 
+void act_quit(void *p, const char *arg, size_t arglen)
+{
+	struct server *s = p;
+	(void)arg;
+	(void)arglen;
+	server_close(s);
+}
+
+void act_shout(void *p, const char *arg, size_t arglen)
+{
+	struct server *s = p;
+	if (!arglen) {
+		connection_printf(&s->c, "Shout what?\n");
+		return;
+	}
+	server_broadcast("%s shouts: %.*s\n", obj_get_atom(s->env, atom_origin),
+		(int)arglen, arg);
+}
+
+/* show what compression is saving and costing this connection */
+void act_mccp(void *p, const char *arg, size_t arglen)
+{
+	struct server *s = p;
+	(void)arg;
+	(void)arglen;
+	if (!s->c.mccp) {
+		connection_printf(&s->c, "Compression is off.\n");
+		return;
+	}
+	const struct mccp_stats *st = mccp_stats(s->c.mccp);
+	connection_printf(&s->c, "Compression is on: %llu bytes sent as %llu, %llu us of CPU.\n",
+		st->raw, st->packed, st->cpu_ns / 1000);
+}
+
+/* show the queue depths of this worker's scheduler */
+void act_sched(void *p, const char *arg, size_t arglen)
+{
+	struct server *s = p;
+	const struct sched_stats *st = sched_stats();
+	(void)arg;
+	(void)arglen;
+	connection_printf(&s->c, "Scheduler: %u connections waiting, %u commands queued, deepest queue %u.\n",
+		st->runnable, st->queued, st->max_depth);
+	connection_printf(&s->c, "Ran %llu commands, dropped %llu, throttled %llu times.\n",
+		st->ran, st->dropped, st->throttled);
+	connection_printf(&s->c, "You: %u queued, %lu dropped, %lu throttled.\n",
+		s->sched.depth, s->sched.dropped, s->sched.throttled);
+}
+
+/* show or change how much is logged */
+void act_loglevel(void *p, const char *arg, size_t arglen)
+{
+	struct server *s = p;
+	if (!server_admin(s))
+		return;
+	if (arglen) {
+		char name[16];
+		snprintf(name, sizeof(name), "%.*s", (int)arglen, arg);
+		int level = log_level_parse(name);
+		if (level < 0) {
+			connection_printf(&s->c, "Levels are error, warning, info and debug.\n");
+			return;
+		}
+		log_set_level(level);
+	}
+	connection_printf(&s->c, "Log level is %s, %lu messages dropped.\n",
+		log_level_name(log_level()), log_dropped());
+}
+
+static void act_metrics_command(void *p, const char *name, unsigned long long calls, unsigned long long ns)
+{
+	struct server *s = p;
+	connection_printf(&s->c, "  %-12s %10llu calls %10llu ns mean\n", name, calls, ns / calls);
+}
+
+/* show latency percentiles and counters */
+void act_metrics(void *p, const char *arg, size_t arglen)
+{
+	struct server *s = p;
+	unsigned i;
+	(void)arg;
+	(void)arglen;
+	if (!server_admin(s))
+		return;
+	connection_printf(&s->c, "%-13s %10s %10s %10s %10s %10s %10s %10s\n",
+		"latency (ns)", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+	for (i = 0; i < METRIC_HIST_MAX; i++) {
+		struct metrics_summary m;
+		metrics_summary(i, &m);
+		connection_printf(&s->c, "%-13s %10llu %10llu %10llu %10llu %10llu %10llu %10llu\n",
+			m.name, m.count, m.mean, m.pct[0], m.pct[1], m.pct[2], m.pct[3], m.max);
+	}
+	for (i = 0; i < METRIC_COUNTER_MAX; i++)
+		connection_printf(&s->c, "%-13s %10llu\n", metrics_counter_name(i), metrics_counter(i));
+	unsigned cached;
+	size_t cached_size;
+	objdb_cache_stats(&cached, &cached_size);
+	connection_printf(&s->c, "objdb cache: %u objects, %zu bytes\n", cached, cached_size);
+	connection_printf(&s->c, "commands:\n");
+	command_stats(act_metrics_command, s);
+}
+
+/******************************************************************************/
+/* heartbeat - drives periodic game activity. hooks run on worker 0 with no
+ * connection, the timer is only armed once there is a hook. */
+static struct timer heartbeat_timer;
+static unsigned long heartbeat_ms;
+static void (**heartbeat_hooks)(void);
+static unsigned heartbeat_hooks_len, heartbeat_hooks_max;
+
+static void heartbeat(struct timer *t, void *p)
+{
+	(void)p;
+	timer_add(t, heartbeat_ms); /* re-arm first so the rate doesn't drift */
+	unsigned i;
+	for (i = 0; i < heartbeat_hooks_len; i++)
+		heartbeat_hooks[i]();
+}
+
+/* heartbeat_register() calls f every heartbeat. call it before the workers
+ * start. returns 0 on success, -1 on failure. */
+int heartbeat_register(void (*f)(void))
+{
+	if (grow(&heartbeat_hooks, &heartbeat_hooks_max, heartbeat_hooks_len + 1,
+			sizeof(*heartbeat_hooks)))
+		return -1;
+	heartbeat_hooks[heartbeat_hooks_len++] = f;
+	return 0;
+}
+
 /******************************************************************************/
+/* metrics dump - writes the metrics to system/metrics for collection */
+static struct timer metrics_timer;
+static unsigned long metrics_interval_ms;
+
+static void metrics_set(struct object *o, const char *name, const char *suffix, unsigned long long v)
+{
+	char key[128], value[32];
+	snprintf(key, sizeof(key), "%s%s", name, suffix);
+	snprintf(value, sizeof(value), "%llu", v);
+	obj_set(o, key, value);
+}
+
+static void metrics_dump_command(void *p, const char *name, unsigned long long calls, unsigned long long ns)
+{
+	char key[96];
+	snprintf(key, sizeof(key), "command.%s", name);
+	metrics_set(p, key, ".calls", calls);
+	metrics_set(p, key, ".ns", ns);
+}
+
+static void metrics_dump_done(void *p, int ok)
+{
+	(void)p;
+	if (!ok)
+		log_warning("metrics:could not commit");
+}
+
+static void metrics_dump(struct timer *t, void *p)
+{
+	static const char *pct[] = { ".p50", ".p90", ".p99", ".p999" };
+	struct object *o = obj_new();
+	unsigned i, j;
+	(void)p;
+
+	timer_add(t, metrics_interval_ms);
+	if (!o) {
+		log_warning("metrics:could not allocate an object");
+		return;
+	}
+	metrics_set(o, "time", "", time(NULL));
+	for (i = 0; i < METRIC_HIST_MAX; i++) {
+		struct metrics_summary m;
+		metrics_summary(i, &m);
+		metrics_set(o, m.name, ".count", m.count);
+		metrics_set(o, m.name, ".mean", m.mean);
+		for (j = 0; j < METRICS_PERCENTILES; j++)
+			metrics_set(o, m.name, pct[j], m.pct[j]);
+		metrics_set(o, m.name, ".max", m.max);
+	}
+	for (i = 0; i < METRIC_COUNTER_MAX; i++)
+		metrics_set(o, metrics_counter_name(i), "", metrics_counter(i));
+	command_stats(metrics_dump_command, o);
+
+	struct objdb_txn *txn = objdb_start("system/metrics");
+	if (!txn || !objdb_f(txn)) {
+		log_warning("metrics:could not start a transaction");
+	} else if (obj_save(o, objdb_f(txn))) {
+		log_warning("metrics:could not save");
+		objdb_rollback(txn);
+	} else {
+		/* don't hold up this worker for the fsync */
+		worker_commit(txn, metrics_dump_done, NULL);
+	}
+	obj_release(o);
+}
+
+/* called on the same worker once the object is loaded, the connection may be
+ * gone by then */
+static void act_objdb_loaded(void *p, struct object *obj)
+{
+	unsigned long long *id = p;
+	struct server *s = server_lookup(*id);
+	free(id);
+	if (s && !obj) {
+		connection_printf(&s->c, "No such object.\n");
+	} else if (s) {
+		struct object_iter it = obj_iter_new(obj);
+		const char *name, *value;
+		while (obj_iter_next(&it, &name, &value))
+			connection_printf(&s->c, "%s=%s\n", name, value);
+	}
+	if (obj)
+		obj_release(obj);
+}
+
+/* show the properties of an object, read without blocking this worker */
+void act_objdb(void *p, const char *arg, size_t arglen)
+{
+	struct server *s = p;
+	char path[256];
+	if (!server_admin(s))
+		return;
+	if (!arglen || arglen >= sizeof(path)) {
+		connection_printf(&s->c, "Usage: objdb <path>\n");
+		return;
+	}
+	memcpy(path, arg, arglen);
+	path[arglen] = 0;
+	/* stay inside the db */
+	if (path[0] == '/' || path[0] == '.' || strstr(path, "/.")) {
+		connection_printf(&s->c, "Bad path.\n");
+		return;
+	}
+	unsigned long long *id = malloc(sizeof(*id));
+	if (!id)
+		return;
+	*id = s->id;
+	if (worker_load(path, act_objdb_loaded, id)) {
+		free(id);
+		connection_printf(&s->c, "Unable to load.\n");
+	}
+}
+
+/******************************************************************************/
+/* copyover - re-exec the binary without dropping connections.
+ *
+ * every worker ends compression and drains its output, then appends its
+ * listeners and connections to a memfd in obj_save() format and stops. the
+ * last worker to finish execs the binary again, and the new process adopts
+ * the descriptors listed in the file named by WELL_COPYOVER. a connection's
+ * environment is saved without its template, and inherits the new process's
+ * server.template when loaded. */
+#define COPYOVER_ENV "WELL_COPYOVER"
+#define COPYOVER_DRAIN_MS 2000 /* give up on slow readers after this long */
+#define COPYOVER_POLL_MS 10
+
+static char **main_argv;
+static char *main_exe; /* resolved at startup, see main_exe_path() */
+static int copyover_pending;
+static pthread_mutex_t copyover_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *copyover_file;
+static unsigned copyover_saved; /* workers that have written their state */
+static __thread unsigned long long copyover_deadline;
+static __thread struct timer copyover_timer;
+
+/* state inherited from the previous process */
+static struct copyover_rec {
+	int is_server;
+	int admin;
+	SOCKET fd;
+	unsigned worker;
+	struct object *env; /* servers only */
+} *copyover_recs;
+static unsigned copyover_recs_len, copyover_recs_max;
+
+/* copyover_start() asks every worker to save its state and re-exec.
+ * returns 0 on success, -1 on failure. */
+static int copyover_start(void)
+{
+	if (!main_exe)
+		return -1; /* nothing to exec */
+	pthread_mutex_lock(&copyover_lock);
+	if (copyover_file) {
+		pthread_mutex_unlock(&copyover_lock);
+		return -1; /* already in progress */
+	}
+	/* no MFD_CLOEXEC, the new process reads it */
+	int fd = memfd_create("well-copyover", 0);
+	if (fd < 0) {
+		log_error("memfd_create():%s", strerror(errno));
+		pthread_mutex_unlock(&copyover_lock);
+		return -1;
+	}
+	copyover_file = fdopen(fd, "w+");
+	if (!copyover_file) {
+		log_error("fdopen():%s", strerror(errno));
+		close(fd);
+		pthread_mutex_unlock(&copyover_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&copyover_lock);
+
+	__atomic_store_n(&copyover_pending, 1, __ATOMIC_RELEASE);
+	unsigned i;
+	for (i = 0; i < worker_count; i++) {
+		if (&workers[i] != worker_self)
+			worker_wake(&workers[i]);
+	}
+	return 0;
+}
+
+static void copyover_tick(struct timer *t, void *p)
+{
+	(void)t;
+	(void)p; /* only here to wake up the event loop */
+}
+
+static int copyover_drained(void)
+{
+	struct server *s;
+	for (s = server_list; s; s = s->next) {
+		struct connection *c = &s->c;
+		if (c->sockbase.fd == INVALID_SOCKET)
+			continue;
+		if (c->out.len || c->zout.len || sockpending(c->sockbase.fd))
+			return 0;
+	}
+	return 1;
+}
+
+/* the fd must survive the exec */
+static int copyover_keep(SOCKET fd)
+{
+	int flags = fcntl(fd, F_GETFD);
+	if (flags < 0 || fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC) < 0) {
+		sockerror("fcntl()");
+		return -1;
+	}
+	return 0;
+}
+
+static void copyover_record(FILE *f, const char *type, SOCKET fd, int admin)
+{
+	struct object *rec = obj_new();
+	obj_set(rec, "type", type);
+	obj_set_int(rec, "fd", fd);
+	obj_set_int(rec, "worker", worker_self->index);
+	if (admin)
+		obj_set_int(rec, "admin", 1);
+	obj_save(rec, f);
+	obj_release(rec);
+}
+
+static void copyover_exec(void)
+{
+	char num[32];
+	FILE *f = copyover_file;
+
+	/* a record without a type marks the end */
+	struct object *end = obj_new();
+	obj_save(end, f);
+	obj_release(end);
+	fflush(f);
+	int fd = fileno(f);
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		log_error("lseek():%s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	snprintf(num, sizeof(num), "%d", fd);
+	setenv(COPYOVER_ENV, num, 1);
+	log_info("copyover:restarting");
+	objdb_shutdown(); /* the exec would lose what is queued */
+	log_shutdown();
+	execv(main_exe, main_argv);
+	/* the old state is half torn down, there is no going back */
+	log_error("execv():%s", strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+/* copyover_worker() is called from the event loop while a copyover is
+ * pending. it returns while output is draining, then never returns. */
+static void copyover_worker(void)
+{
+	struct server *s;
+
+	if (!copyover_deadline) {
+		copyover_deadline = timer_now() + COPYOVER_DRAIN_MS;
+		timer_init(&copyover_timer, copyover_tick, NULL);
+		/* the new process can't continue a compressed stream */
+		for (s = server_list; s; s = s->next)
+			connection_mccp_end(&s->c);
+		/* go around once more for messages posted before the request */
+		timer_add(&copyover_timer, 0);
+		return;
+	}
+	if (!copyover_drained() && timer_now() < copyover_deadline) {
+		timer_add(&copyover_timer, COPYOVER_POLL_MS);
+		return;
+	}
+
+	pthread_mutex_lock(&copyover_lock);
+	struct service *sv;
+	for (sv = service_list; sv; sv = sv->next) {
+		if (sv->sockbase.fd == INVALID_SOCKET || copyover_keep(sv->sockbase.fd))
+			continue;
+		copyover_record(copyover_file, "service", sv->sockbase.fd, 0);
+	}
+	for (s = server_list; s; s = s->next) {
+		SOCKET fd = s->c.sockbase.fd;
+		if (fd == INVALID_SOCKET || copyover_keep(fd))
+			continue;
+		copyover_record(copyover_file, "server", fd, s->admin);
+		/* only the overrides, the new process has its own template */
+		obj_save_local(s->env, copyover_file);
+	}
+	int last = ++copyover_saved == worker_count;
+	pthread_mutex_unlock(&copyover_lock);
+
+	if (last)
+		copyover_exec();
+	for (;;)
+		pause(); /* the exec ends this thread */
+}
+
+/* copyover_load() reads the state left by the previous process, if any.
+ * returns 0 on success, -1 on failure. */
+static int copyover_load(void)
+{
+	const char *v = getenv(COPYOVER_ENV);
+	if (!v)
+		return 0;
+	int memfd = atoi(v);
+	unsetenv(COPYOVER_ENV);
+	FILE *f = fdopen(memfd, "r");
+	if (!f) {
+		log_error("fdopen():%s", strerror(errno));
+		return -1;
+	}
+
+	struct object *rec;
+	while ((rec = obj_load(f, "copyover"))) {
+		const char *type = obj_get(rec, "type");
+		int64_t fd = obj_get_int(rec, "fd", -1);
+		int64_t worker = obj_get_int(rec, "worker", -1);
+		if (!type || fd < 0 || worker < 0) {
+			obj_release(rec);
+			break; /* end of the records */
+		}
+		if (grow(&copyover_recs, &copyover_recs_max, copyover_recs_len + 1,
+				sizeof(*copyover_recs))) {
+			obj_release(rec);
+			break;
+		}
+		struct copyover_rec *cr = &copyover_recs[copyover_recs_len];
+		cr->is_server = !strcmp(type, "server");
+		cr->admin = obj_get_int(rec, "admin", 0);
+		cr->fd = fd;
+		cr->worker = worker;
+		cr->env = cr->is_server ? obj_load_child(f, "copyover", server_template) : NULL;
+		obj_release(rec);
+		if (cr->is_server && !cr->env)
+			break;
+		fcntl(cr->fd, F_SETFD, FD_CLOEXEC);
+		copyover_recs_len++;
+	}
+	fclose(f);
+	log_info("copyover:%u descriptors inherited", copyover_recs_len);
+	return 0;
+}
+
+/* copyover_adopt() registers the inherited descriptors that belong to w. if
+ * there are fewer workers than before, the extra ones are shared out.
+ * returns the number of listeners adopted. */
+static unsigned copyover_adopt(struct worker *w)
+{
+	unsigned i, services = 0;
+	for (i = 0; i < copyover_recs_len; i++) {
+		struct copyover_rec *cr = &copyover_recs[i];
+		if (cr->worker % worker_count != w->index)
+			continue;
+		if (!cr->is_server) {
+			if (!service_add(cr->fd))
+				services++;
+		} else {
+			struct sockbase *sb = server_new(cr->fd, NULL, cr->env);
+			if (!sb)
+				log_error("copyover:could not adopt fd %d", cr->fd);
+			else
+				container_of(sb, struct server, c.sockbase)->admin = cr->admin;
+		}
+		cr->env = NULL; /* server_new() owns it now */
+	}
+	return services;
+}
+
+void act_copyover(void *p, const char *arg, size_t arglen)
+{
+	struct server *s = p;
+	(void)arg;
+	(void)arglen;
+	if (!server_admin(s))
+		return;
+	server_broadcast("Copyover in progress, please wait.\n");
+	if (copyover_start())
+		connection_printf(&s->c, "Copyover is not possible right now.\n");
+}
+
+/******************************************************************************/
+
+static void worker_free_sockbase(struct sockbase *base)
+{
+	(void)base; /* workers are never freed */
+}
+
+/* drain messages posted by server_send() */
+static void worker_event(SOCKET fd, struct sockbase *sockbase, long event)
+{
+	struct worker *w = container_of(sockbase, struct worker, sockbase);
+	uint64_t n;
+
+	if (!(event & EVENT_READ))
+		return;
+	if (sockread(fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		sockerror("eventfd");
+	/* clear before draining, a producer that misses this will signal again */
+	__atomic_store_n(&w->signaled, 0, __ATOMIC_SEQ_CST);
+
+	struct mpsc_node *node;
+	while ((node = mpsc_pop(&w->queue))) {
+		struct server_message *m = container_of(node, struct server_message, node);
+		if (m->run) {
+			m->run(m);
+		} else if (!m->to) {
+			server_fanout(m->seg);
+		} else {
+			struct server *s = server_lookup(m->to);
+			if (s)
+				connection_send(&s->c, m->seg);
+		}
+		if (!m->run) {
+			buf_seg_release(m->seg);
+			free(m);
+		}
+	}
+}
+
+static void *worker_main(void *p)
+{
+	struct worker *w = p;
+	worker_self = w;
+
+	if (w->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		int e = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (e)
+			log_warning("worker %u:unable to pin to cpu %d:%s",
+				w->index, w->cpu, strerror(e));
+	}
+
+	/* select the I/O backend before any sockets are opened */
+	if (sockinit(obj_get(system_env, "io.backend")))
+		return (void*)-1;
+	if (!w->index)
+		log_info("Using %s for I/O", sockbackend());
+
+	SOCKET efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd == INVALID_SOCKET) {
+		sockerror("eventfd()");
+		return (void*)-1;
+	}
+	RETAIN(&w->sockbase);
+	w->sockbase.fd = efd;
+	if (sockadd(efd, &w->sockbase, EVENT_READ, worker_event, worker_free_sockbase))
+		return (void*)-1;
+
+	/* game wide timers live on the first worker */
+	if (!w->index && heartbeat_ms && heartbeat_hooks_len)
+		timer_add(&heartbeat_timer, heartbeat_ms);
+	if (!w->index && metrics_interval_ms)
+		timer_add(&metrics_timer, metrics_interval_ms);
+
+	if (!copyover_adopt(w))
+		service_open("/5000"); // TODO: read from system_env
+	while (sockcount() > 0) {
+		if (sockpoll()) {
+			return (void*)-1;
+		}
+		sched_run();
+		if (__atomic_load_n(&copyover_pending, __ATOMIC_ACQUIRE))
+			copyover_worker();
+	}
+	return NULL;
+}
+
+/* workers_run() starts count workers, the calling thread becomes the first.
+ * returns 0 on success, -1 on failure. */
+static int workers_run(unsigned count, int pin)
+{
+	if (!count)
+		count = 1;
+	if (count > WORKER_MAX)
+		count = WORKER_MAX;
+	workers = calloc(count, sizeof(*workers));
+	if (!workers) {
+		log_error("%s:%s", __func__, strerror(errno));
+		return -1;
+	}
+	worker_count = count;
+
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned i;
+	for (i = 0; i < count; i++) {
+		struct worker *w = &workers[i];
+		w->index = i;
+		w->cpu = pin && ncpu > 0 ? (int)(i % ncpu) : -1;
+		w->sockbase.fd = INVALID_SOCKET;
+		mpsc_init(&w->queue);
+	}
+	for (i = 1; i < count; i++) {
+		int e = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+		if (e) {
+			log_error("worker %u:%s", i, strerror(e));
+			return -1;
+		}
+	}
+
+	int failed = worker_main(&workers[0]) != NULL;
+	for (i = 1; i < count; i++) {
+		void *res;
+		pthread_join(workers[i].thread, &res);
+		if (res)
+			failed = 1;
+	}
+	return failed ? -1 : 0;
+}
+
+/******************************************************************************/
+
+/* main_exe_path() finds the binary for copyover to exec. it is resolved to a
+ * path at startup, because a deploy replaces the file with a new inode and
+ * /proc/self/exe would go on naming the old one. */
+static char *main_exe_path(const char *argv0)
+{
+	char path[PATH_MAX];
+	if (strchr(argv0, '/')) {
+		if (realpath(argv0, path))
+			return strdup(path);
+		log_error("%s:%s", argv0, strerror(errno));
+		return NULL;
+	}
+	/* found through PATH, ask the kernel where it came from */
+	ssize_t n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	if (n < 0) {
+		log_error("/proc/self/exe:%s", strerror(errno));
+		return NULL;
+	}
+	path[n] = 0;
+	return strdup(path);
+}
 
 int main(int argc, char **argv)
 {
 	setlocale(LC_ALL, NULL);
+	main_argv = argv;
+	main_exe = main_exe_path(argv[0]);
 
 	/* parse command-line options */
 	int e = 0;
@@ -538,28 +1693,123 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 	if (e) {
-		fprintf(stderr, "unable to configure DB path\n");
+		log_error("unable to configure DB path");
 		return EXIT_FAILURE;
 	}
 
+	/* each connection costs a descriptor, use as many as we are allowed */
+	struct rlimit rl;
+	if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl))
+			log_error("setrlimit():%s", strerror(errno));
+	}
+
 	/* load enviroment options */
 	system_env = objdb_load("system/config");
 	if (!system_env) {
-		fprintf(stderr, "ERROR:system/config not found.\n");
+		log_error("system/config not found.");
 		return EXIT_FAILURE;
 	}
 
-	/* load core commands */
-	command_register("print", act_print);
+	/* objdb.cache is the budget for cached objects in KB, 0 turns it off */
+	objdb_cache_config(env_long("objdb.cache", 16384) * 1024);
+	/* objdb.sync=1 makes commits durable, sharing each fsync among those
+	 * that arrive within objdb.sync.window ms, up to objdb.sync.batch */
+	objdb_sync_config(env_long("objdb.sync", 1), env_long("objdb.sync.window", 5),
+		env_long("objdb.sync.batch", 64));
+	/* objdb.threads serve loads that must not block a worker */
+	objdb_pool_config(env_long("objdb.threads", 2));
+	/* objdb.backend=journal appends commits to one file, and writes them
+	 * back to the object files every objdb.checkpoint KB. objdb.backend=pack
+	 * appends them to segment files of objdb.segment KB */
+	if (objdb_backend_config(obj_get(system_env, "objdb.backend"),
+			env_long("objdb.checkpoint", 4096) * 1024,
+			env_long("objdb.segment", 65536) * 1024))
+		return EXIT_FAILURE;
+	/* objdb.preload threads warm the cache with the whole db before the
+	 * port is opened, 0 loads everything on demand */
+	if (objdb_preload(env_long("objdb.preload", 4)))
+		return EXIT_FAILURE;
 
-	service_open("/5000"); // TODO: read from system_env
-	while (sockets_count > 0) {
-		if (sockpoll()) {
+	atom_origin = atom_intern("ORIGIN");
+	if (!atom_origin)
+		return EXIT_FAILURE;
+
+	/* server.template is loaded once, and shared by every connection */
+	const char *template = obj_get(system_env, "server.template");
+	if (template) {
+		server_template = objdb_load(template);
+		if (!server_template) {
+			log_error("%s:unable to load server.template", template);
 			return EXIT_FAILURE;
 		}
+		obj_freeze(server_template);
+	} else {
+		log_warning("server.template not set, using empty environment");
+	}
+
+	/* load core commands */
+	command_register("print", act_print);
+	command_register("quit", act_quit);
+	command_register("shout", act_shout);
+	command_register("mccp", act_mccp);
+	command_register("sched", act_sched);
+	command_register("admin", act_admin);
+	command_register("copyover", act_copyover);
+	command_register("loglevel", act_loglevel);
+	command_register("metrics", act_metrics);
+	command_register("objdb", act_objdb);
+
+	/* log.level is one of error, warning, info or debug */
+	const char *level = obj_get(system_env, "log.level");
+	if (level) {
+		int n = log_level_parse(level);
+		if (n < 0)
+			log_warning("log.level:unknown level \"%s\"", level);
+		else
+			log_set_level(n);
+	}
+	log_init();
+
+	/* mccp=1 offers compression, see mccp_config() for the others */
+	connection_mccp = env_long("mccp", 1);
+	/* output.max KB may be queued for a client before it is cut off */
+	connection_out_max = env_long("output.max", 1024) * 1024;
+	if (mccp_config(env_long("mccp.level", 6), env_long("mccp.window", 15),
+			obj_get(system_env, "mccp.flush")))
+		return EXIT_FAILURE;
+
+	/* per connection command limits, see sched_config() */
+	sched_config(env_long("sched.rate", 20), env_long("sched.burst", 40),
+		env_long("sched.quantum", 4), env_long("sched.depth", 100));
+
+	/* timers */
+	server_idle_ms = env_long("idle.timeout", 0) * 1000;
+	heartbeat_ms = env_long("heartbeat", 1000);
+	timer_init(&heartbeat_timer, heartbeat, NULL);
+	metrics_interval_ms = env_long("metrics.interval", 60) * 1000;
+	timer_init(&metrics_timer, metrics_dump, NULL);
+
+	/* pick up connections from before a copyover */
+	if (copyover_load())
+		return EXIT_FAILURE;
+
+	/* threads=N runs N reactors, threads.pin=1 pins each to a cpu */
+	if (workers_run(env_long("threads", 1), env_long("threads.pin", 0))) {
+		objdb_shutdown();
+		log_shutdown();
+		return EXIT_FAILURE;
 	}
 
+	objdb_shutdown();
+	free(copyover_recs);
+	copyover_recs = NULL;
+	obj_release(server_template);
 	obj_release(system_env);
 	system_env = NULL;
+	free(main_exe);
+	free(heartbeat_hooks);
+	log_shutdown();
 	return 0;
 }